@@ -0,0 +1,291 @@
+#include "AudioVideoProcessor.h"
+#include "AudioVideoGlobal.h"
+#include "FFmpegUtil.h"
+
+#ifdef __cplusplus
+#define __STDC_CONSTANT_MACROS
+extern "C"
+{
+#endif
+#include <libavutil/mem.h>
+#include <libavutil/samplefmt.h>
+#ifdef __cplusplus
+}
+#endif
+
+#include <atomic>
+#include <string.h>
+
+namespace avp
+{
+
+struct AudioSampleFifo::Impl
+{
+    Impl();
+    ~Impl();
+    bool init(int sampleType, int numChannels, int capacity);
+    int write(const unsigned char* const* data, int numSamples);
+    int getWriteSpan(unsigned char* data[8]);
+    void commitWrite(int numSamples);
+    int read(unsigned char* data[8], int numSamples);
+    int peek(unsigned char* data[8], int numSamples);
+    void drain(int numSamples);
+    int size() const;
+    int space() const;
+    void clear();
+    void close();
+
+    unsigned char* planes[8];
+    int numPlanes;
+    int sampleNumBytes;
+    int sampleType;
+    int numChannels;
+    int capacity;
+    // Both counters only grow, the producer owns writeCount and the consumer owns readCount,
+    // the ring position is the counter modulo capacity.
+    std::atomic<long long int> writeCount;
+    std::atomic<long long int> readCount;
+};
+
+AudioSampleFifo::Impl::Impl()
+{
+    for (int i = 0; i < 8; i++)
+        planes[i] = 0;
+    numPlanes = 0;
+    sampleNumBytes = 0;
+    sampleType = SampleTypeUnknown;
+    numChannels = 0;
+    capacity = 0;
+    writeCount = 0;
+    readCount = 0;
+}
+
+AudioSampleFifo::Impl::~Impl()
+{
+    close();
+}
+
+bool AudioSampleFifo::Impl::init(int sampleType_, int numChannels_, int capacity_)
+{
+    close();
+
+    if (sampleType_ < SampleType8U || sampleType_ > SampleType64FP || numChannels_ <= 0 || capacity_ <= 0)
+    {
+        lprintf("Error in %s, invalid param, sample type %d, num channels %d, capacity %d\n",
+            __FUNCTION__, sampleType_, numChannels_, capacity_);
+        return false;
+    }
+
+    bool isPlanar = av_sample_fmt_is_planar((AVSampleFormat)sampleType_);
+    if (isPlanar && numChannels_ > 8)
+    {
+        lprintf("Error in %s, planar sample type supports at most 8 channels, num channels %d\n",
+            __FUNCTION__, numChannels_);
+        return false;
+    }
+
+    sampleType = sampleType_;
+    numChannels = numChannels_;
+    capacity = capacity_;
+    numPlanes = isPlanar ? numChannels : 1;
+    sampleNumBytes = getSampleTypeNumBytes(sampleType) * (isPlanar ? 1 : numChannels);
+    for (int i = 0; i < numPlanes; i++)
+    {
+        planes[i] = (unsigned char*)av_malloc(capacity * sampleNumBytes);
+        if (!planes[i])
+        {
+            lprintf("Error in %s, could not allocate memory\n", __FUNCTION__);
+            close();
+            return false;
+        }
+    }
+    writeCount = 0;
+    readCount = 0;
+    return true;
+}
+
+int AudioSampleFifo::Impl::write(const unsigned char* const* data, int numSamples)
+{
+    if (!capacity || !data || numSamples <= 0)
+        return 0;
+
+    // NOTICE!!!
+    // Load the counter owned by the other thread exactly once, FFMIN evaluates its arguments twice
+    long long int w = writeCount.load(std::memory_order_relaxed);
+    int numFree = capacity - int(w - readCount.load(std::memory_order_acquire));
+    int num = FFMIN(numSamples, numFree);
+    int pos = w % capacity;
+    int first = FFMIN(num, capacity - pos);
+    for (int i = 0; i < numPlanes; i++)
+    {
+        memcpy(planes[i] + pos * sampleNumBytes, data[i], first * sampleNumBytes);
+        if (num > first)
+            memcpy(planes[i], data[i] + first * sampleNumBytes, (num - first) * sampleNumBytes);
+    }
+    writeCount.store(w + num, std::memory_order_release);
+    return num;
+}
+
+int AudioSampleFifo::Impl::getWriteSpan(unsigned char* data[8])
+{
+    if (!capacity)
+        return 0;
+
+    long long int w = writeCount.load(std::memory_order_relaxed);
+    int pos = w % capacity;
+    int numFree = capacity - int(w - readCount.load(std::memory_order_acquire));
+    int num = FFMIN(numFree, capacity - pos);
+    for (int i = 0; i < 8; i++)
+        data[i] = i < numPlanes ? planes[i] + pos * sampleNumBytes : 0;
+    return num;
+}
+
+void AudioSampleFifo::Impl::commitWrite(int numSamples)
+{
+    if (numSamples > 0)
+        writeCount.store(writeCount.load(std::memory_order_relaxed) + numSamples, std::memory_order_release);
+}
+
+int AudioSampleFifo::Impl::read(unsigned char* data[8], int numSamples)
+{
+    if (!capacity || !data || numSamples <= 0)
+        return 0;
+
+    long long int r = readCount.load(std::memory_order_relaxed);
+    int avail = int(writeCount.load(std::memory_order_acquire) - r);
+    int num = FFMIN(numSamples, avail);
+    int pos = r % capacity;
+    int first = FFMIN(num, capacity - pos);
+    for (int i = 0; i < numPlanes; i++)
+    {
+        memcpy(data[i], planes[i] + pos * sampleNumBytes, first * sampleNumBytes);
+        if (num > first)
+            memcpy(data[i] + first * sampleNumBytes, planes[i], (num - first) * sampleNumBytes);
+    }
+    readCount.store(r + num, std::memory_order_release);
+    return num;
+}
+
+int AudioSampleFifo::Impl::peek(unsigned char* data[8], int numSamples)
+{
+    if (!capacity || numSamples <= 0)
+        return 0;
+
+    long long int r = readCount.load(std::memory_order_relaxed);
+    int pos = r % capacity;
+    int avail = int(writeCount.load(std::memory_order_acquire) - r);
+    int num = FFMIN(FFMIN(numSamples, avail), capacity - pos);
+    for (int i = 0; i < 8; i++)
+        data[i] = i < numPlanes ? planes[i] + pos * sampleNumBytes : 0;
+    return num;
+}
+
+void AudioSampleFifo::Impl::drain(int numSamples)
+{
+    if (numSamples <= 0)
+        return;
+
+    long long int r = readCount.load(std::memory_order_relaxed);
+    int avail = int(writeCount.load(std::memory_order_acquire) - r);
+    int num = FFMIN(numSamples, avail);
+    readCount.store(r + num, std::memory_order_release);
+}
+
+int AudioSampleFifo::Impl::size() const
+{
+    return int(writeCount.load(std::memory_order_acquire) - readCount.load(std::memory_order_acquire));
+}
+
+int AudioSampleFifo::Impl::space() const
+{
+    return capacity - size();
+}
+
+void AudioSampleFifo::Impl::clear()
+{
+    readCount.store(writeCount.load(std::memory_order_acquire), std::memory_order_release);
+}
+
+void AudioSampleFifo::Impl::close()
+{
+    for (int i = 0; i < 8; i++)
+    {
+        if (planes[i])
+            av_free(planes[i]);
+        planes[i] = 0;
+    }
+    numPlanes = 0;
+    sampleNumBytes = 0;
+    sampleType = SampleTypeUnknown;
+    numChannels = 0;
+    capacity = 0;
+    writeCount = 0;
+    readCount = 0;
+}
+
+AudioSampleFifo::AudioSampleFifo()
+{
+    ptrImpl.reset(new Impl);
+}
+
+bool AudioSampleFifo::init(int sampleType, int numChannels, int capacity)
+{
+    return ptrImpl->init(sampleType, numChannels, capacity);
+}
+
+int AudioSampleFifo::write(const unsigned char* const* data, int numSamples)
+{
+    return ptrImpl->write(data, numSamples);
+}
+
+int AudioSampleFifo::getWriteSpan(unsigned char* data[8])
+{
+    return ptrImpl->getWriteSpan(data);
+}
+
+void AudioSampleFifo::commitWrite(int numSamples)
+{
+    ptrImpl->commitWrite(numSamples);
+}
+
+int AudioSampleFifo::read(unsigned char* data[8], int numSamples)
+{
+    return ptrImpl->read(data, numSamples);
+}
+
+int AudioSampleFifo::peek(unsigned char* data[8], int numSamples)
+{
+    return ptrImpl->peek(data, numSamples);
+}
+
+void AudioSampleFifo::drain(int numSamples)
+{
+    ptrImpl->drain(numSamples);
+}
+
+int AudioSampleFifo::size() const
+{
+    return ptrImpl->size();
+}
+
+int AudioSampleFifo::space() const
+{
+    return ptrImpl->space();
+}
+
+int AudioSampleFifo::capacity() const
+{
+    return ptrImpl->capacity;
+}
+
+void AudioSampleFifo::clear()
+{
+    ptrImpl->clear();
+}
+
+void AudioSampleFifo::close()
+{
+    ptrImpl->close();
+}
+
+}
@@ -0,0 +1,740 @@
+#include "AudioVideoColorConvert.h"
+
+#include <math.h>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define AVP_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC compiles intrinsics of any instruction set, gcc and clang need the target attribute
+#if defined(AVP_X86) && !defined(_MSC_VER)
+#define AVP_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define AVP_TARGET_AVX2
+#endif
+
+namespace avp
+{
+
+std::atomic<int> fastColorConvertEnabled(0);
+
+void setFastColorConvert(bool enable)
+{
+    fastColorConvertEnabled.store(enable ? 1 : 0, std::memory_order_relaxed);
+}
+
+// NOTICE!!!
+// The scalar and the AVX2 code share the same fixed point arithmetic, so that they give identical results.
+// Inputs are shifted left by 7 bits and multiplied by the coefficients keeping the high 16 bits of the products,
+// the same as _mm256_mulhi_epi16.
+static inline int mulhi(int a, int c)
+{
+    return (a * c) >> 16;
+}
+
+static inline unsigned char clip8(int val)
+{
+    return val < 0 ? 0 : (val > 255 ? 255 : val);
+}
+
+// Q13 coefficients, the results of mulhi carry 4 fractional bits
+struct YuvToBgrCoefs
+{
+    short y, rv, gu, gv, bu;
+    short yOffset;
+};
+
+// Q15 coefficients, the results of mulhi carry 6 fractional bits
+struct BgrToYuvCoefs
+{
+    short yr, yg, yb;
+    short ur, ug, ub;
+    short vr, vg, vb;
+    short yOffset;
+};
+
+// Bilinear tables and coefficients of a tensor row, chroma positions are in bytes of the chroma row,
+// mul and add are in b, g, r order
+struct TensorRowParams
+{
+    const int* x0;
+    const int* x1;
+    const float* wx;
+    const int* cx0;
+    const int* cx1;
+    const float* cwx;
+    float ys, yOffset;
+    float rv, gu, gv, bu;
+    float mul[3], add[3];
+};
+
+static void getMatrix(int matrix, double* kr, double* kb)
+{
+    *kr = matrix == ColorMatrixBT709 ? 0.2126 : 0.299;
+    *kb = matrix == ColorMatrixBT709 ? 0.0722 : 0.114;
+}
+
+static void getYuvToBgrCoefs(int matrix, int fullRange, YuvToBgrCoefs& c)
+{
+    double kr, kb;
+    getMatrix(matrix, &kr, &kb);
+    double kg = 1 - kr - kb;
+    double ys = fullRange ? 1.0 : 255.0 / 219.0;
+    double cs = fullRange ? 1.0 : 255.0 / 224.0;
+    c.y = floor(ys * 8192 + 0.5);
+    c.rv = floor(2 * (1 - kr) * cs * 8192 + 0.5);
+    c.gu = floor(2 * kb * (1 - kb) / kg * cs * 8192 + 0.5);
+    c.gv = floor(2 * kr * (1 - kr) / kg * cs * 8192 + 0.5);
+    c.bu = floor(2 * (1 - kb) * cs * 8192 + 0.5);
+    c.yOffset = fullRange ? 0 : 16;
+}
+
+static void getBgrToYuvCoefs(int matrix, int fullRange, BgrToYuvCoefs& c)
+{
+    double kr, kb;
+    getMatrix(matrix, &kr, &kb);
+    double kg = 1 - kr - kb;
+    double ys = fullRange ? 1.0 : 219.0 / 255.0;
+    double cs = fullRange ? 1.0 : 224.0 / 255.0;
+    c.yr = floor(kr * ys * 32768 + 0.5);
+    c.yg = floor(kg * ys * 32768 + 0.5);
+    c.yb = floor(kb * ys * 32768 + 0.5);
+    c.ur = -floor(kr / (2 * (1 - kb)) * cs * 32768 + 0.5);
+    c.ug = -floor(kg / (2 * (1 - kb)) * cs * 32768 + 0.5);
+    c.ub = floor(0.5 * cs * 32768 + 0.5);
+    c.vr = floor(0.5 * cs * 32768 + 0.5);
+    c.vg = -floor(kg / (2 * (1 - kr)) * cs * 32768 + 0.5);
+    c.vb = -floor(kb / (2 * (1 - kr)) * cs * 32768 + 0.5);
+    c.yOffset = fullRange ? 0 : 16;
+}
+
+static void yuvToBgrRow(const unsigned char* yRow, const unsigned char* uRow, const unsigned char* vRow, int chromaStep,
+    unsigned char* dst, int dstChannels, int begin, int end, const YuvToBgrCoefs& c)
+{
+    for (int x = begin; x < end; x++)
+    {
+        int yt = mulhi((yRow[x] - c.yOffset) << 7, c.y);
+        int u = (uRow[(x >> 1) * chromaStep] - 128) << 7;
+        int v = (vRow[(x >> 1) * chromaStep] - 128) << 7;
+        unsigned char* ptr = dst + x * dstChannels;
+        ptr[0] = clip8((yt + mulhi(u, c.bu) + 8) >> 4);
+        ptr[1] = clip8((yt - mulhi(u, c.gu) - mulhi(v, c.gv) + 8) >> 4);
+        ptr[2] = clip8((yt + mulhi(v, c.rv) + 8) >> 4);
+        if (dstChannels == 4)
+            ptr[3] = 255;
+    }
+}
+
+// Convert two rows of bgr pixels, row1 may equal row0 for the last row of an odd height picture
+static void bgrToYuvRows(const unsigned char* row0, const unsigned char* row1, int srcChannels,
+    unsigned char* yRow0, unsigned char* yRow1, unsigned char* uRow, unsigned char* vRow, int chromaStep,
+    int width, int begin, int end, const BgrToYuvCoefs& c)
+{
+    for (int x = begin; x < end; x++)
+    {
+        const unsigned char* p0 = row0 + x * srcChannels;
+        const unsigned char* p1 = row1 + x * srcChannels;
+        yRow0[x] = clip8((mulhi(p0[2] << 7, c.yr) + mulhi(p0[1] << 7, c.yg) + mulhi(p0[0] << 7, c.yb) +
+            (c.yOffset << 6) + 32) >> 6);
+        if (yRow1 != yRow0)
+            yRow1[x] = clip8((mulhi(p1[2] << 7, c.yr) + mulhi(p1[1] << 7, c.yg) + mulhi(p1[0] << 7, c.yb) +
+                (c.yOffset << 6) + 32) >> 6);
+        if (x & 1)
+            continue;
+
+        const unsigned char* q0 = row0 + (x + 1 < width ? x + 1 : x) * srcChannels;
+        const unsigned char* q1 = row1 + (x + 1 < width ? x + 1 : x) * srcChannels;
+        int b = (p0[0] + q0[0] + p1[0] + q1[0] + 2) >> 2;
+        int g = (p0[1] + q0[1] + p1[1] + q1[1] + 2) >> 2;
+        int r = (p0[2] + q0[2] + p1[2] + q1[2] + 2) >> 2;
+        uRow[(x >> 1) * chromaStep] = clip8((mulhi(r << 7, c.ur) + mulhi(g << 7, c.ug) + mulhi(b << 7, c.ub) +
+            (128 << 6) + 32) >> 6);
+        vRow[(x >> 1) * chromaStep] = clip8((mulhi(r << 7, c.vr) + mulhi(g << 7, c.vg) + mulhi(b << 7, c.vb) +
+            (128 << 6) + 32) >> 6);
+    }
+}
+
+#ifdef AVP_X86
+
+static bool detectAVX2()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    __cpuid(info, 1);
+    // The os should save the ymm registers
+    if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)) || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+static bool hasAVX2()
+{
+    static std::atomic<int> supported(-1);
+    int val = supported.load(std::memory_order_relaxed);
+    if (val < 0)
+    {
+        val = detectAVX2() ? 1 : 0;
+        supported.store(val, std::memory_order_relaxed);
+    }
+    return val != 0;
+}
+
+// Split 16 bgr24 or bgr0 pixels into planes
+AVP_TARGET_AVX2 static inline void loadBgr16(const unsigned char* src, int srcChannels, __m128i& b, __m128i& g, __m128i& r)
+{
+    __m128i p0, p1, p2, p3;
+    if (srcChannels == 4)
+    {
+        const __m128i mask = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+        p0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)src), mask);
+        p1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 16)), mask);
+        p2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 32)), mask);
+        p3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 48)), mask);
+    }
+    else
+    {
+        const __m128i mask = _mm_setr_epi8(0, 3, 6, 9, 1, 4, 7, 10, 2, 5, 8, 11, -1, -1, -1, -1);
+        __m128i a0 = _mm_loadu_si128((const __m128i*)src);
+        __m128i a1 = _mm_loadu_si128((const __m128i*)(src + 16));
+        __m128i a2 = _mm_loadu_si128((const __m128i*)(src + 32));
+        p0 = _mm_shuffle_epi8(a0, mask);
+        p1 = _mm_shuffle_epi8(_mm_alignr_epi8(a1, a0, 12), mask);
+        p2 = _mm_shuffle_epi8(_mm_alignr_epi8(a2, a1, 8), mask);
+        p3 = _mm_shuffle_epi8(_mm_srli_si128(a2, 4), mask);
+    }
+    __m128i t0 = _mm_unpacklo_epi32(p0, p1);
+    __m128i t1 = _mm_unpacklo_epi32(p2, p3);
+    __m128i t2 = _mm_unpackhi_epi32(p0, p1);
+    __m128i t3 = _mm_unpackhi_epi32(p2, p3);
+    b = _mm_unpacklo_epi64(t0, t1);
+    g = _mm_unpackhi_epi64(t0, t1);
+    r = _mm_unpacklo_epi64(t2, t3);
+}
+
+// Interleave 16 pixels of planes into bgr24 or bgr0
+AVP_TARGET_AVX2 static inline void storeBgr16(unsigned char* dst, int dstChannels, __m128i b, __m128i g, __m128i r)
+{
+    __m128i a = _mm_set1_epi8(-1);
+    __m128i bgLo = _mm_unpacklo_epi8(b, g), bgHi = _mm_unpackhi_epi8(b, g);
+    __m128i raLo = _mm_unpacklo_epi8(r, a), raHi = _mm_unpackhi_epi8(r, a);
+    __m128i p0 = _mm_unpacklo_epi16(bgLo, raLo);
+    __m128i p1 = _mm_unpackhi_epi16(bgLo, raLo);
+    __m128i p2 = _mm_unpacklo_epi16(bgHi, raHi);
+    __m128i p3 = _mm_unpackhi_epi16(bgHi, raHi);
+    if (dstChannels == 4)
+    {
+        _mm_storeu_si128((__m128i*)dst, p0);
+        _mm_storeu_si128((__m128i*)(dst + 16), p1);
+        _mm_storeu_si128((__m128i*)(dst + 32), p2);
+        _mm_storeu_si128((__m128i*)(dst + 48), p3);
+    }
+    else
+    {
+        const __m128i mask = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+        p0 = _mm_shuffle_epi8(p0, mask);
+        p1 = _mm_shuffle_epi8(p1, mask);
+        p2 = _mm_shuffle_epi8(p2, mask);
+        p3 = _mm_shuffle_epi8(p3, mask);
+        _mm_storeu_si128((__m128i*)dst, _mm_or_si128(p0, _mm_slli_si128(p1, 12)));
+        _mm_storeu_si128((__m128i*)(dst + 16), _mm_or_si128(_mm_srli_si128(p1, 4), _mm_slli_si128(p2, 8)));
+        _mm_storeu_si128((__m128i*)(dst + 32), _mm_or_si128(_mm_srli_si128(p2, 8), _mm_slli_si128(p3, 4)));
+    }
+}
+
+AVP_TARGET_AVX2 static inline __m128i packTo8(__m256i val)
+{
+    return _mm_packus_epi16(_mm256_castsi256_si128(val), _mm256_extracti128_si256(val, 1));
+}
+
+// Returns the number of pixels converted, a multiple of 16
+AVP_TARGET_AVX2 static int yuvToBgrRowAVX2(const unsigned char* yRow, const unsigned char* uRow, const unsigned char* vRow,
+    int interleaved, unsigned char* dst, int dstChannels, int width, const YuvToBgrCoefs& c)
+{
+    const __m256i cy = _mm256_set1_epi16(c.y), crv = _mm256_set1_epi16(c.rv);
+    const __m256i cgu = _mm256_set1_epi16(c.gu), cgv = _mm256_set1_epi16(c.gv), cbu = _mm256_set1_epi16(c.bu);
+    const __m256i yOffset = _mm256_set1_epi16(c.yOffset), uvOffset = _mm256_set1_epi16(128);
+    const __m256i round = _mm256_set1_epi16(8);
+    const __m128i splitMask = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i u8, v8;
+        if (interleaved)
+        {
+            __m128i uv = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(uRow + x)), splitMask);
+            u8 = uv;
+            v8 = _mm_srli_si128(uv, 8);
+        }
+        else
+        {
+            u8 = _mm_loadl_epi64((const __m128i*)(uRow + x / 2));
+            v8 = _mm_loadl_epi64((const __m128i*)(vRow + x / 2));
+        }
+        __m256i y = _mm256_slli_epi16(_mm256_sub_epi16(
+            _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(yRow + x))), yOffset), 7);
+        __m256i u = _mm256_slli_epi16(_mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_unpacklo_epi8(u8, u8)), uvOffset), 7);
+        __m256i v = _mm256_slli_epi16(_mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_unpacklo_epi8(v8, v8)), uvOffset), 7);
+        __m256i yt = _mm256_add_epi16(_mm256_mulhi_epi16(y, cy), round);
+        __m256i b = _mm256_srai_epi16(_mm256_add_epi16(yt, _mm256_mulhi_epi16(u, cbu)), 4);
+        __m256i g = _mm256_srai_epi16(_mm256_sub_epi16(_mm256_sub_epi16(yt,
+            _mm256_mulhi_epi16(u, cgu)), _mm256_mulhi_epi16(v, cgv)), 4);
+        __m256i r = _mm256_srai_epi16(_mm256_add_epi16(yt, _mm256_mulhi_epi16(v, crv)), 4);
+        storeBgr16(dst + x * dstChannels, dstChannels, packTo8(b), packTo8(g), packTo8(r));
+    }
+    return x;
+}
+
+AVP_TARGET_AVX2 static inline __m256i bgrToY(__m256i b, __m256i g, __m256i r,
+    __m256i cyb, __m256i cyg, __m256i cyr, __m256i offset)
+{
+    __m256i sum = _mm256_add_epi16(_mm256_add_epi16(_mm256_mulhi_epi16(_mm256_slli_epi16(r, 7), cyr),
+        _mm256_mulhi_epi16(_mm256_slli_epi16(g, 7), cyg)), _mm256_mulhi_epi16(_mm256_slli_epi16(b, 7), cyb));
+    return _mm256_srai_epi16(_mm256_add_epi16(sum, offset), 6);
+}
+
+// Sum horizontal pairs of 16 values, and keep the 8 sums in the low half in order
+AVP_TARGET_AVX2 static inline __m256i pairAverage(__m256i sum)
+{
+    __m256i pairs = _mm256_permute4x64_epi64(_mm256_hadd_epi16(sum, sum), 0x08);
+    return _mm256_srli_epi16(_mm256_add_epi16(pairs, _mm256_set1_epi16(2)), 2);
+}
+
+// Returns the number of pixels converted, a multiple of 16
+AVP_TARGET_AVX2 static int bgrToYuvRowsAVX2(const unsigned char* row0, const unsigned char* row1, int srcChannels,
+    unsigned char* yRow0, unsigned char* yRow1, unsigned char* uRow, unsigned char* vRow, int interleaved,
+    int width, const BgrToYuvCoefs& c)
+{
+    const __m256i cyr = _mm256_set1_epi16(c.yr), cyg = _mm256_set1_epi16(c.yg), cyb = _mm256_set1_epi16(c.yb);
+    const __m256i cur = _mm256_set1_epi16(c.ur), cug = _mm256_set1_epi16(c.ug), cub = _mm256_set1_epi16(c.ub);
+    const __m256i cvr = _mm256_set1_epi16(c.vr), cvg = _mm256_set1_epi16(c.vg), cvb = _mm256_set1_epi16(c.vb);
+    const __m256i yOffset = _mm256_set1_epi16((c.yOffset << 6) + 32);
+    const __m256i uvOffset = _mm256_set1_epi16((128 << 6) + 32);
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i b8, g8, r8;
+        loadBgr16(row0 + x * srcChannels, srcChannels, b8, g8, r8);
+        __m256i b0 = _mm256_cvtepu8_epi16(b8), g0 = _mm256_cvtepu8_epi16(g8), r0 = _mm256_cvtepu8_epi16(r8);
+        loadBgr16(row1 + x * srcChannels, srcChannels, b8, g8, r8);
+        __m256i b1 = _mm256_cvtepu8_epi16(b8), g1 = _mm256_cvtepu8_epi16(g8), r1 = _mm256_cvtepu8_epi16(r8);
+
+        _mm_storeu_si128((__m128i*)(yRow0 + x), packTo8(bgrToY(b0, g0, r0, cyb, cyg, cyr, yOffset)));
+        if (yRow1 != yRow0)
+            _mm_storeu_si128((__m128i*)(yRow1 + x), packTo8(bgrToY(b1, g1, r1, cyb, cyg, cyr, yOffset)));
+
+        __m256i b = _mm256_slli_epi16(pairAverage(_mm256_add_epi16(b0, b1)), 7);
+        __m256i g = _mm256_slli_epi16(pairAverage(_mm256_add_epi16(g0, g1)), 7);
+        __m256i r = _mm256_slli_epi16(pairAverage(_mm256_add_epi16(r0, r1)), 7);
+        __m256i u = _mm256_srai_epi16(_mm256_add_epi16(_mm256_add_epi16(_mm256_add_epi16(
+            _mm256_mulhi_epi16(r, cur), _mm256_mulhi_epi16(g, cug)), _mm256_mulhi_epi16(b, cub)), uvOffset), 6);
+        __m256i v = _mm256_srai_epi16(_mm256_add_epi16(_mm256_add_epi16(_mm256_add_epi16(
+            _mm256_mulhi_epi16(r, cvr), _mm256_mulhi_epi16(g, cvg)), _mm256_mulhi_epi16(b, cvb)), uvOffset), 6);
+        __m128i u8 = packTo8(u), v8 = packTo8(v);
+        if (interleaved)
+            _mm_storeu_si128((__m128i*)(uRow + x), _mm_unpacklo_epi8(u8, v8));
+        else
+        {
+            _mm_storel_epi64((__m128i*)(uRow + x / 2), u8);
+            _mm_storel_epi64((__m128i*)(vRow + x / 2), v8);
+        }
+    }
+    return x;
+}
+
+// Returns the number of values blended, a multiple of 8
+AVP_TARGET_AVX2 static int blendRowsAVX2(const unsigned char* row0, const unsigned char* row1, float w1,
+    float* dst, int count)
+{
+    const __m256 vw0 = _mm256_set1_ps(1 - w1), vw1 = _mm256_set1_ps(w1);
+    int x = 0;
+    for (; x + 8 <= count; x += 8)
+    {
+        __m256 a = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(row0 + x))));
+        __m256 b = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(row1 + x))));
+        _mm256_storeu_ps(dst + x, _mm256_add_ps(_mm256_mul_ps(a, vw0), _mm256_mul_ps(b, vw1)));
+    }
+    return x;
+}
+
+AVP_TARGET_AVX2 static inline __m256 gatherLerp(const float* row, const int* index0, const int* index1,
+    const float* weight, __m256 one)
+{
+    __m256 a = _mm256_i32gather_ps(row, _mm256_loadu_si256((const __m256i*)index0), 4);
+    __m256 b = _mm256_i32gather_ps(row, _mm256_loadu_si256((const __m256i*)index1), 4);
+    __m256 w1 = _mm256_loadu_ps(weight);
+    return _mm256_add_ps(_mm256_mul_ps(a, _mm256_sub_ps(one, w1)), _mm256_mul_ps(b, w1));
+}
+
+// Returns the number of tensor values written per plane, a multiple of 8
+AVP_TARGET_AVX2 static int yuvToTensorRowAVX2(const float* yRow, const float* uRow, const float* vRow,
+    const TensorRowParams& p, float* bPtr, float* gPtr, float* rPtr, int width)
+{
+    const __m256 one = _mm256_set1_ps(1), zero = _mm256_setzero_ps(), max = _mm256_set1_ps(255);
+    const __m256 ys = _mm256_set1_ps(p.ys), yOffset = _mm256_set1_ps(p.yOffset), uvOffset = _mm256_set1_ps(128);
+    const __m256 rv = _mm256_set1_ps(p.rv), gu = _mm256_set1_ps(p.gu), gv = _mm256_set1_ps(p.gv), bu = _mm256_set1_ps(p.bu);
+    const __m256 mulB = _mm256_set1_ps(p.mul[0]), mulG = _mm256_set1_ps(p.mul[1]), mulR = _mm256_set1_ps(p.mul[2]);
+    const __m256 addB = _mm256_set1_ps(p.add[0]), addG = _mm256_set1_ps(p.add[1]), addR = _mm256_set1_ps(p.add[2]);
+    int x = 0;
+    for (; x + 8 <= width; x += 8)
+    {
+        __m256 y = _mm256_mul_ps(_mm256_sub_ps(gatherLerp(yRow, p.x0 + x, p.x1 + x, p.wx + x, one), yOffset), ys);
+        __m256 u = _mm256_sub_ps(gatherLerp(uRow, p.cx0 + x, p.cx1 + x, p.cwx + x, one), uvOffset);
+        __m256 v = _mm256_sub_ps(gatherLerp(vRow, p.cx0 + x, p.cx1 + x, p.cwx + x, one), uvOffset);
+        __m256 b = _mm256_add_ps(y, _mm256_mul_ps(bu, u));
+        __m256 g = _mm256_sub_ps(_mm256_sub_ps(y, _mm256_mul_ps(gu, u)), _mm256_mul_ps(gv, v));
+        __m256 r = _mm256_add_ps(y, _mm256_mul_ps(rv, v));
+        b = _mm256_min_ps(_mm256_max_ps(b, zero), max);
+        g = _mm256_min_ps(_mm256_max_ps(g, zero), max);
+        r = _mm256_min_ps(_mm256_max_ps(r, zero), max);
+        _mm256_storeu_ps(bPtr + x, _mm256_add_ps(_mm256_mul_ps(b, mulB), addB));
+        _mm256_storeu_ps(gPtr + x, _mm256_add_ps(_mm256_mul_ps(g, mulG), addG));
+        _mm256_storeu_ps(rPtr + x, _mm256_add_ps(_mm256_mul_ps(r, mulR), addR));
+    }
+    return x;
+}
+
+#else
+
+static bool hasAVX2()
+{
+    return false;
+}
+
+#endif
+
+static bool isFastYuvFormat(AVPixelFormat fmt)
+{
+    return fmt == AV_PIX_FMT_YUV420P || fmt == AV_PIX_FMT_YUVJ420P || fmt == AV_PIX_FMT_NV12;
+}
+
+static bool isFastBgrFormat(AVPixelFormat fmt)
+{
+    return fmt == AV_PIX_FMT_BGR24 || fmt == AV_PIX_FMT_BGR0;
+}
+
+bool supportsFastColorConvert(AVPixelFormat srcFmt, AVPixelFormat dstFmt)
+{
+    return (isFastYuvFormat(srcFmt) && isFastBgrFormat(dstFmt)) ||
+        (isFastBgrFormat(srcFmt) && (dstFmt == AV_PIX_FMT_YUV420P || dstFmt == AV_PIX_FMT_NV12));
+}
+
+bool fastColorConvert(const unsigned char* const* srcData, const int* srcSteps, AVPixelFormat srcFmt,
+    unsigned char* const* dstData, const int* dstSteps, AVPixelFormat dstFmt,
+    int width, int height, int matrix, int fullRange)
+{
+    if (!supportsFastColorConvert(srcFmt, dstFmt) || width <= 0 || height <= 0)
+        return false;
+
+    bool simd = hasAVX2();
+    if (isFastYuvFormat(srcFmt))
+    {
+        YuvToBgrCoefs c;
+        getYuvToBgrCoefs(matrix, fullRange || srcFmt == AV_PIX_FMT_YUVJ420P, c);
+        int interleaved = srcFmt == AV_PIX_FMT_NV12;
+        int dstChannels = dstFmt == AV_PIX_FMT_BGR0 ? 4 : 3;
+        for (int i = 0; i < height; i++)
+        {
+            const unsigned char* yRow = srcData[0] + i * srcSteps[0];
+            const unsigned char* uRow = srcData[1] + (i >> 1) * srcSteps[1];
+            const unsigned char* vRow = interleaved ? uRow + 1 : srcData[2] + (i >> 1) * srcSteps[2];
+            unsigned char* dst = dstData[0] + i * dstSteps[0];
+            int begin = 0;
+#ifdef AVP_X86
+            if (simd)
+                begin = yuvToBgrRowAVX2(yRow, uRow, vRow, interleaved, dst, dstChannels, width, c);
+#endif
+            yuvToBgrRow(yRow, uRow, vRow, interleaved ? 2 : 1, dst, dstChannels, begin, width, c);
+        }
+    }
+    else
+    {
+        BgrToYuvCoefs c;
+        getBgrToYuvCoefs(matrix, fullRange, c);
+        int interleaved = dstFmt == AV_PIX_FMT_NV12;
+        int srcChannels = srcFmt == AV_PIX_FMT_BGR0 ? 4 : 3;
+        for (int i = 0; i < height; i += 2)
+        {
+            int j = i + 1 < height ? i + 1 : i;
+            const unsigned char* row0 = srcData[0] + i * srcSteps[0];
+            const unsigned char* row1 = srcData[0] + j * srcSteps[0];
+            unsigned char* yRow0 = dstData[0] + i * dstSteps[0];
+            unsigned char* yRow1 = dstData[0] + j * dstSteps[0];
+            unsigned char* uRow = dstData[1] + (i >> 1) * dstSteps[1];
+            unsigned char* vRow = interleaved ? uRow + 1 : dstData[2] + (i >> 1) * dstSteps[2];
+            int begin = 0;
+#ifdef AVP_X86
+            if (simd)
+                begin = bgrToYuvRowsAVX2(row0, row1, srcChannels, yRow0, yRow1, uRow, vRow, interleaved, width, c);
+#endif
+            bgrToYuvRows(row0, row1, srcChannels, yRow0, yRow1, uRow, vRow, interleaved ? 2 : 1,
+                width, begin, width, c);
+        }
+    }
+    return true;
+}
+
+void setSwsColorMatrix(SwsContext* swsCtx, int matrix, int fullRange)
+{
+    int* invTable, *table;
+    int srcRange, dstRange, brightness, contrast, saturation;
+    if (sws_getColorspaceDetails(swsCtx, &invTable, &srcRange, &table, &dstRange,
+        &brightness, &contrast, &saturation) < 0)
+        return;
+    sws_setColorspaceDetails(swsCtx, sws_getCoefficients(matrix == ColorMatrixBT709 ? SWS_CS_ITU709 : SWS_CS_DEFAULT),
+        srcRange || fullRange, table, dstRange, brightness, contrast, saturation);
+}
+
+void getTensorRect(const TensorOptions& options, int srcWidth, int srcHeight,
+    int& x, int& y, int& width, int& height)
+{
+    x = 0;
+    y = 0;
+    width = options.width;
+    height = options.height;
+    if (!options.letterbox || srcWidth <= 0 || srcHeight <= 0 || options.width <= 0 || options.height <= 0)
+        return;
+
+    if ((long long int)srcWidth * options.height >= (long long int)srcHeight * options.width)
+    {
+        height = ((long long int)srcHeight * options.width + srcWidth / 2) / srcWidth;
+        height = height < 1 ? 1 : (height > options.height ? options.height : height);
+    }
+    else
+    {
+        width = ((long long int)srcWidth * options.height + srcHeight / 2) / srcHeight;
+        width = width < 1 ? 1 : (width > options.width ? options.width : width);
+    }
+    x = (options.width - width) / 2;
+    y = (options.height - height) / 2;
+}
+
+// Writes 8 bit value v of plane c as v * mul[c] + add[c],
+// data[b], data[g] and data[r] are the planes of each color
+struct TensorWriter
+{
+    TensorWriter(float* tensor, const TensorOptions& options)
+    {
+        int planeSize = options.width * options.height;
+        for (int c = 0; c < 3; c++)
+        {
+            data[c] = tensor + c * planeSize;
+            mul[c] = options.scale[c];
+            add[c] = -options.mean[c] * options.scale[c];
+            pad[c] = options.padValue * mul[c] + add[c];
+        }
+        b = options.rgb ? 2 : 0;
+        g = 1;
+        r = options.rgb ? 0 : 2;
+        width = options.width;
+    }
+
+    void fill(int row, int begin, int end)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            float* ptr = data[c] + row * width;
+            for (int i = begin; i < end; i++)
+                ptr[i] = pad[c];
+        }
+    }
+
+    float* data[3];
+    float mul[3], add[3], pad[3];
+    int b, g, r;
+    int width;
+};
+
+// Source positions of a bilinear resize from srcSize to dstSize with pixel centers aligned
+static void getResizeTable(int srcSize, int dstSize, std::vector<int>& index0, std::vector<int>& index1,
+    std::vector<float>& weight)
+{
+    index0.resize(dstSize);
+    index1.resize(dstSize);
+    weight.resize(dstSize);
+    double ratio = double(srcSize) / dstSize;
+    for (int i = 0; i < dstSize; i++)
+    {
+        double pos = (i + 0.5) * ratio - 0.5;
+        pos = pos < 0 ? 0 : (pos > srcSize - 1 ? srcSize - 1 : pos);
+        int pos0 = (int)pos;
+        index0[i] = pos0;
+        index1[i] = pos0 + 1 < srcSize ? pos0 + 1 : pos0;
+        weight[i] = float(pos - pos0);
+    }
+}
+
+static inline float clip255(float val)
+{
+    return val < 0 ? 0 : (val > 255 ? 255 : val);
+}
+
+// dst[i] = row0[i] * (1 - w1) + row1[i] * w1 for i in [0, count)
+static void blendRows(const unsigned char* row0, const unsigned char* row1, float w1, float* dst, int count, bool simd)
+{
+    int begin = 0;
+#ifdef AVP_X86
+    if (simd)
+        begin = blendRowsAVX2(row0, row1, w1, dst, count);
+#endif
+    float w0 = 1 - w1;
+    for (int i = begin; i < count; i++)
+        dst[i] = row0[i] * w0 + row1[i] * w1;
+}
+
+static void yuvToTensorRow(const float* yRow, const float* uRow, const float* vRow, const TensorRowParams& p,
+    float* bPtr, float* gPtr, float* rPtr, int begin, int end)
+{
+    for (int j = begin; j < end; j++)
+    {
+        int a0 = p.x0[j], a1 = p.x1[j], c0 = p.cx0[j], c1 = p.cx1[j];
+        float wx1 = p.wx[j], wx0 = 1 - wx1;
+        float cwx1 = p.cwx[j], cwx0 = 1 - cwx1;
+        float yv = ((yRow[a0] * wx0 + yRow[a1] * wx1) - p.yOffset) * p.ys;
+        float uv = (uRow[c0] * cwx0 + uRow[c1] * cwx1) - 128;
+        float vv = (vRow[c0] * cwx0 + vRow[c1] * cwx1) - 128;
+        bPtr[j] = clip255(yv + p.bu * uv) * p.mul[0] + p.add[0];
+        gPtr[j] = clip255(yv - p.gu * uv - p.gv * vv) * p.mul[1] + p.add[1];
+        rPtr[j] = clip255(yv + p.rv * vv) * p.mul[2] + p.add[2];
+    }
+}
+
+bool supportsFastTensorConvert(AVPixelFormat srcFmt)
+{
+    return isFastYuvFormat(srcFmt);
+}
+
+bool fastTensorConvert(const unsigned char* const* srcData, const int* srcSteps, AVPixelFormat srcFmt,
+    int srcWidth, int srcHeight, int matrix, int fullRange, float* tensor, const TensorOptions& options)
+{
+    if (!supportsFastTensorConvert(srcFmt) || srcWidth <= 0 || srcHeight <= 0 ||
+        options.width <= 0 || options.height <= 0 || !tensor)
+        return false;
+
+    int rectX, rectY, rectWidth, rectHeight;
+    getTensorRect(options, srcWidth, srcHeight, rectX, rectY, rectWidth, rectHeight);
+
+    fullRange = fullRange || srcFmt == AV_PIX_FMT_YUVJ420P;
+    double kr, kb;
+    getMatrix(matrix, &kr, &kb);
+    double kg = 1 - kr - kb;
+    double cs = fullRange ? 1.0 : 255.0 / 224.0;
+    TensorRowParams p;
+    p.ys = fullRange ? 1.0 : 255.0 / 219.0;
+    p.yOffset = fullRange ? 0 : 16;
+    p.rv = 2 * (1 - kr) * cs;
+    p.gu = 2 * kb * (1 - kb) / kg * cs;
+    p.gv = 2 * kr * (1 - kr) / kg * cs;
+    p.bu = 2 * (1 - kb) * cs;
+
+    // Chroma tables are in bytes, so that nv12 only differs by the v offset
+    std::vector<int> x0, x1, y0, y1, cx0, cx1, cy0, cy1;
+    std::vector<float> wx, wy, cwx, cwy;
+    getResizeTable(srcWidth, rectWidth, x0, x1, wx);
+    getResizeTable(srcHeight, rectHeight, y0, y1, wy);
+    getResizeTable((srcWidth + 1) / 2, rectWidth, cx0, cx1, cwx);
+    getResizeTable((srcHeight + 1) / 2, rectHeight, cy0, cy1, cwy);
+    int interleaved = srcFmt == AV_PIX_FMT_NV12;
+    if (interleaved)
+    {
+        for (int j = 0; j < rectWidth; j++)
+        {
+            cx0[j] *= 2;
+            cx1[j] *= 2;
+        }
+    }
+    p.x0 = x0.data();
+    p.x1 = x1.data();
+    p.wx = wx.data();
+    p.cx0 = cx0.data();
+    p.cx1 = cx1.data();
+    p.cwx = cwx.data();
+
+    // Each tensor row blends its two source rows vertically into floats first,
+    // the horizontal pass then picks the two columns of each tensor value from them
+    int chromaWidth = (srcWidth + 1) / 2;
+    int chromaRowSize = interleaved ? chromaWidth * 2 : chromaWidth;
+    std::vector<float> yBlend(srcWidth), uBlend(chromaRowSize), vBlend(interleaved ? 1 : chromaWidth);
+    const float* vBlendRow = interleaved ? uBlend.data() + 1 : vBlend.data();
+    bool simd = hasAVX2();
+
+    // Rows are produced top to bottom, consecutive rows share source rows which stay in cache,
+    // and the three planes are written sequentially
+    TensorWriter w(tensor, options);
+    for (int c = 0; c < 3; c++)
+    {
+        int plane = c == 0 ? w.b : (c == 1 ? w.g : w.r);
+        p.mul[c] = w.mul[plane];
+        p.add[c] = w.add[plane];
+    }
+    for (int i = 0; i < rectY; i++)
+        w.fill(i, 0, options.width);
+    for (int i = 0; i < rectHeight; i++)
+    {
+        int row = rectY + i;
+        w.fill(row, 0, rectX);
+        w.fill(row, rectX + rectWidth, options.width);
+
+        blendRows(srcData[0] + y0[i] * srcSteps[0], srcData[0] + y1[i] * srcSteps[0], wy[i],
+            yBlend.data(), srcWidth, simd);
+        blendRows(srcData[1] + cy0[i] * srcSteps[1], srcData[1] + cy1[i] * srcSteps[1], cwy[i],
+            uBlend.data(), chromaRowSize, simd);
+        if (!interleaved)
+            blendRows(srcData[2] + cy0[i] * srcSteps[2], srcData[2] + cy1[i] * srcSteps[2], cwy[i],
+                vBlend.data(), chromaWidth, simd);
+
+        float* bPtr = w.data[w.b] + row * options.width + rectX;
+        float* gPtr = w.data[w.g] + row * options.width + rectX;
+        float* rPtr = w.data[w.r] + row * options.width + rectX;
+        int begin = 0;
+#ifdef AVP_X86
+        if (simd)
+            begin = yuvToTensorRowAVX2(yBlend.data(), uBlend.data(), vBlendRow, p, bPtr, gPtr, rPtr, rectWidth);
+#endif
+        yuvToTensorRow(yBlend.data(), uBlend.data(), vBlendRow, p, bPtr, gPtr, rPtr, begin, rectWidth);
+    }
+    for (int i = rectY + rectHeight; i < options.height; i++)
+        w.fill(i, 0, options.width);
+    return true;
+}
+
+void gbrpToTensor(const unsigned char* const* srcData, const int* srcSteps,
+    int x, int y, int width, int height, float* tensor, const TensorOptions& options)
+{
+    TensorWriter w(tensor, options);
+    // Planes of gbrp are in g, b, r order
+    int planes[3] = { w.g, w.b, w.r };
+    for (int i = 0; i < options.height; i++)
+    {
+        if (i < y || i >= y + height)
+        {
+            w.fill(i, 0, options.width);
+            continue;
+        }
+        w.fill(i, 0, x);
+        w.fill(i, x + width, options.width);
+        for (int c = 0; c < 3; c++)
+        {
+            int p = planes[c];
+            const unsigned char* src = srcData[c] + (i - y) * srcSteps[c];
+            float* dst = w.data[p] + i * options.width + x;
+            float mul = w.mul[p], add = w.add[p];
+            for (int j = 0; j < width; j++)
+                dst[j] = src[j] * mul + add;
+        }
+    }
+}
+
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "AudioVideoProcessor.h"
+
+#ifdef __cplusplus
+#define __STDC_CONSTANT_MACROS
+extern "C"
+{
+#endif
+#include <libavutil/pixfmt.h>
+#include <libswscale/swscale.h>
+#ifdef __cplusplus
+}
+#endif
+
+#include <atomic>
+
+namespace avp
+{
+
+enum ColorMatrix
+{
+    ColorMatrixBT601,
+    ColorMatrixBT709
+};
+
+extern std::atomic<int> fastColorConvertEnabled;
+
+// Whether there is a dedicated kernel from srcFmt to dstFmt of the same size, which are
+// yuv420p, yuvj420p and nv12 to bgr24 and bgr0, and bgr24 and bgr0 to yuv420p and nv12.
+// Chroma is taken from the nearest sample when upsampling and averaged over 2x2 when downsampling.
+bool supportsFastColorConvert(AVPixelFormat srcFmt, AVPixelFormat dstFmt);
+
+// Convert one picture with AVX2 if the cpu supports it, matrix and fullRange describe the yuv side.
+// Returns false if the formats are not supported.
+bool fastColorConvert(const unsigned char* const* srcData, const int* srcSteps, AVPixelFormat srcFmt,
+    unsigned char* const* dstData, const int* dstSteps, AVPixelFormat dstFmt,
+    int width, int height, int matrix, int fullRange);
+
+// Make a yuv to rgb swsCtx use matrix and fullRange for the yuv side
+void setSwsColorMatrix(SwsContext* swsCtx, int matrix, int fullRange);
+
+// Whether fastTensorConvert takes pictures of srcFmt, which are yuv420p, yuvj420p and nv12
+bool supportsFastTensorConvert(AVPixelFormat srcFmt);
+
+// Resize a picture bilinearly into the rectangle of the tensor given by getTensorRect,
+// converting and normalizing on the fly and filling the border, so that every float is written once.
+// Uses avx2 if the cpu has it. Returns false if the format is not supported.
+bool fastTensorConvert(const unsigned char* const* srcData, const int* srcSteps, AVPixelFormat srcFmt,
+    int srcWidth, int srcHeight, int matrix, int fullRange, float* tensor, const TensorOptions& options);
+
+// Normalize a gbrp picture already resized to the rectangle (x, y, width, height) into tensor and fill the border
+void gbrpToTensor(const unsigned char* const* srcData, const int* srcSteps,
+    int x, int y, int width, int height, float* tensor, const TensorOptions& options);
+
+}
@@ -1,4 +1,6 @@
 #include "AudioVideoProcessor.h"
+#include "AudioVideoProcessorUtil.h"
+#include "FFmpegUtil.h"
 
 #ifdef __cplusplus
 #define __STDC_CONSTANT_MACROS
@@ -7,6 +9,7 @@ extern "C"
 #endif
 #include <libavutil/error.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/pixfmt.h>
 #include <libavutil/samplefmt.h>
 #include <libavutil/mem.h>
@@ -24,8 +27,8 @@ int alignedAllocImage(unsigned char** data, int* step, int width, int height, in
         return -1;
 
     *step = (width * (pixelType == avp::PixelTypeBGR24 ? 3 : 4) + stepAlignSize - 1) / stepAlignSize * stepAlignSize;
-    *data = (unsigned char*)_aligned_malloc(*step * height, ptrAlignSize);
-    return 0;
+    *data = (unsigned char*)avp::alignedMalloc(*step * height, ptrAlignSize);
+    return *data ? 0 : -1;
 }
 
 namespace avp
@@ -38,7 +41,7 @@ AudioVideoFrame2::AudioVideoFrame2(unsigned char** data_, int* steps_, int media
     : mediaType(mediaType_),
     pixelType(pixelType_), width(width_), height(height_),
     sampleType(sampleType_), numChannels(numChannels_), channelLayout(channelLayout_),
-    numSamples(numSamples_), timeStamp(timeStamp_), frameIndex(frameIndex_)
+    numSamples(numSamples_), timeStamp(timeStamp_), frameIndex(frameIndex_), flags(0)
 {
     memset(data, 0, sizeof(data));
     memset(steps, 0, sizeof(steps));
@@ -63,7 +66,7 @@ AudioVideoFrame2::AudioVideoFrame2(unsigned char** data_, int step_, int sampleT
     : mediaType(AUDIO),
     pixelType(PixelTypeUnknown), width(0), height(0),
     sampleType(sampleType_), numChannels(numChannels_), channelLayout(channelLayout_),
-    numSamples(numSamples_), timeStamp(timeStamp_), frameIndex(frameIndex_)
+    numSamples(numSamples_), timeStamp(timeStamp_), frameIndex(frameIndex_), flags(0)
 {
     memset(data, 0, sizeof(data));
     memset(steps, 0, sizeof(steps));
@@ -77,7 +80,7 @@ AudioVideoFrame2::AudioVideoFrame2(unsigned char** data_, int* steps_, int pixel
     : mediaType(VIDEO),
     pixelType(pixelType_), width(width_), height(height_),
     sampleType(SampleTypeUnknown), numChannels(0), channelLayout(0),
-    numSamples(0), timeStamp(timeStamp_), frameIndex(frameIndex_)
+    numSamples(0), timeStamp(timeStamp_), frameIndex(frameIndex_), flags(0)
 {
     memset(data, 0, sizeof(data));
     memset(steps, 0, sizeof(steps));
@@ -92,7 +95,7 @@ AudioVideoFrame2::AudioVideoFrame2(int sampleType_, int numChannels_, int channe
     : mediaType(UNKNOWN),
     pixelType(PixelTypeUnknown), width(0), height(0),
     sampleType(SampleTypeUnknown), numChannels(0), channelLayout(0),
-    numSamples(0), timeStamp(-1LL), frameIndex(-1)
+    numSamples(0), timeStamp(-1LL), frameIndex(-1), flags(0)
 {
     create(sampleType_, numChannels_, channelLayout_, numSamples_, timeStamp_, frameIndex_);
 }
@@ -102,7 +105,7 @@ AudioVideoFrame2::AudioVideoFrame2(int pixelType_, int width_, int height_,
     : mediaType(UNKNOWN),
     pixelType(PixelTypeUnknown), width(0), height(0),
     sampleType(SampleTypeUnknown), numChannels(0), channelLayout(0),
-    numSamples(0), timeStamp(-1LL), frameIndex(-1)
+    numSamples(0), timeStamp(-1LL), frameIndex(-1), flags(0)
 {
     create(pixelType_, width_, height_, timeStamp_, frameIndex_);
 }
@@ -115,6 +118,7 @@ bool AudioVideoFrame2::create(int sampleType_, int numChannels_, int channelLayo
         channelLayout = channelLayout_;
         timeStamp = timeStamp_;
         frameIndex = frameIndex_;
+        flags = 0;
         return true;
     }
 
@@ -158,6 +162,7 @@ bool AudioVideoFrame2::create(int pixelType_, int width_, int height_, long long
     {
         timeStamp = timeStamp_;
         frameIndex = frameIndex_;
+        flags = 0;
         return true;
     }
 
@@ -184,13 +189,13 @@ bool AudioVideoFrame2::create(int pixelType_, int width_, int height_, long long
         memset(steps, 0, 8 * sizeof(int));
         data[0] = tempData;
         steps[0] = tempStep;
-        sdata.reset(tempData, _aligned_free);
+        sdata.reset(tempData, alignedFree);
         return true;
     }
 
     unsigned char* tempData[4] = { 0 };
     int tempSteps[4] = { 0 };
-    if (av_image_alloc(tempData, tempSteps, width, height, (AVPixelFormat)pixelType, 16) < 0)
+    if (av_image_alloc(tempData, tempSteps, width, height, getAVPixelFormat(pixelType), 16) < 0)
     {
         release();
         return false;
@@ -206,6 +211,55 @@ bool AudioVideoFrame2::create(int pixelType_, int width_, int height_, long long
     return true;
 }
 
+bool AudioVideoFrame2::createAligned(int pixelType_, int width_, int height_, int stepAlign, int padRows, int padCols,
+    long long int timeStamp_, int frameIndex_)
+{
+    release();
+
+    AVPixelFormat pixFmt = getAVPixelFormat(pixelType_);
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(pixFmt);
+    if (!desc || (desc->flags & AV_PIX_FMT_FLAG_PAL) || width_ <= 0 || height_ <= 0 ||
+        stepAlign <= 0 || stepAlign > 4096 || (stepAlign & (stepAlign - 1)) || padRows < 0 || padCols < 0)
+        return false;
+
+    int lineSizes[4] = { 0 };
+    if (av_image_fill_linesizes(lineSizes, pixFmt, width_ + padCols) < 0)
+        return false;
+
+    int numPlanes = av_pix_fmt_count_planes(pixFmt);
+    int planeSteps[4] = { 0 };
+    size_t planeOffsets[4] = { 0 };
+    size_t totalSize = 0;
+    for (int i = 0; i < numPlanes; i++)
+    {
+        int shift = (i == 1 || i == 2) ? desc->log2_chroma_h : 0;
+        int planeHeight = -((-height_) >> shift) + (-((-padRows) >> shift));
+        planeSteps[i] = (lineSizes[i] + stepAlign - 1) / stepAlign * stepAlign;
+        planeOffsets[i] = totalSize;
+        totalSize += (size_t)planeSteps[i] * planeHeight;
+    }
+
+    unsigned char* rawPtr = (unsigned char*)alignedMalloc(totalSize, FFMAX(stepAlign, 64));
+    if (!rawPtr)
+        return false;
+    if (padRows || padCols)
+        memset(rawPtr, 0, totalSize);
+
+    mediaType = VIDEO;
+    timeStamp = timeStamp_;
+    frameIndex = frameIndex_;
+    pixelType = pixelType_;
+    width = width_;
+    height = height_;
+    for (int i = 0; i < numPlanes; i++)
+    {
+        data[i] = rawPtr + planeOffsets[i];
+        steps[i] = planeSteps[i];
+    }
+    sdata.reset(rawPtr, alignedFree);
+    return true;
+}
+
 bool AudioVideoFrame2::copyTo(AudioVideoFrame2& frame) const
 {
     if (mediaType == UNKNOWN)
@@ -217,7 +271,8 @@ bool AudioVideoFrame2::copyTo(AudioVideoFrame2& frame) const
     {
         if (!frame.create(pixelType, width, height, timeStamp, frameIndex))
             return false;
-        av_image_copy(frame.data, frame.steps, (const unsigned char**)data, steps, (AVPixelFormat)pixelType, width, height);
+        av_image_copy(frame.data, frame.steps, (const unsigned char**)data, steps, getAVPixelFormat(pixelType), width, height);
+        frame.flags = flags;
         return true;
     }
     else if (mediaType == AUDIO)
@@ -225,6 +280,7 @@ bool AudioVideoFrame2::copyTo(AudioVideoFrame2& frame) const
         if (!frame.create(sampleType, numChannels, channelLayout, numSamples, timeStamp, frameIndex))
             return false;
         av_samples_copy(frame.data, (unsigned char* const *)data, 0, 0, numSamples, numChannels, (AVSampleFormat)sampleType);
+        frame.flags = flags;
         return true;
     }
     return false;
@@ -253,6 +309,7 @@ void AudioVideoFrame2::release()
     numSamples = 0;
     timeStamp = -1LL;
     frameIndex = -1;
+    flags = 0;
 }
 
 SharedAudioVideoFrame::SharedAudioVideoFrame() :
@@ -317,7 +374,7 @@ SharedAudioVideoFrame::SharedAudioVideoFrame(const AudioVideoFrame& frame) :
             for (int i = 0; i < height; i++)
                 memcpy(data + i * step, frame.data + i * frame.step, width * 4);
         }
-        sharedData.reset(data, _aligned_free);
+        sharedData.reset(data, alignedFree);
     }
 }
 
@@ -363,7 +420,7 @@ SharedAudioVideoFrame sharedVideoFrame(int pixelType_, int width_, int height_,
     int ret = alignedAllocImage(&frame.data, &frame.step, width_, height_, pixelType_);
     if (ret < 0)
         return SharedAudioVideoFrame();
-    frame.sharedData.reset(frame.data, _aligned_free);
+    frame.sharedData.reset(frame.data, alignedFree);
     return frame;
 }
 
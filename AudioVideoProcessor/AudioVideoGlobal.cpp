@@ -1,4 +1,5 @@
 #include "AudioVideoProcessor.h"
+#include "AudioVideoGlobal.h"
 
 #ifdef __cplusplus
 extern "C"
@@ -11,7 +12,24 @@ extern "C"
 }
 #endif
 
+#include <atomic>
+#include <chrono>
 #include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#endif
 
 namespace avp
 {
@@ -53,8 +71,21 @@ LogCallbackFunc logCallback = defaultLogCallback;
 
 static std::mutex logMutex;
 
+static std::atomic<int> asyncLog(0);
+
+static void pushAsyncLog(const char* format, va_list vl);
+
 void lprintf(const char* format, ...)
 {
+    if (asyncLog.load(std::memory_order_acquire))
+    {
+        va_list vl;
+        va_start(vl, format);
+        pushAsyncLog(format, vl);
+        va_end(vl);
+        return;
+    }
+
     std::lock_guard<std::mutex> lg(logMutex);
     if (logCallback)
     {
@@ -65,6 +96,323 @@ void lprintf(const char* format, ...)
     }
 }
 
+static void callLogCallback(const char* format, ...)
+{
+    if (logCallback)
+    {
+        va_list vl;
+        va_start(vl, format);
+        logCallback(format, vl);
+        va_end(vl);
+    }
+}
+
+typedef std::vector<std::pair<ThreadExitFunc, void*> > ThreadExitCalls;
+
+static void runThreadExitCalls(ThreadExitCalls* calls)
+{
+    for (int i = calls->size() - 1; i >= 0; i--)
+        (*calls)[i].first((*calls)[i].second);
+    calls->clear();
+}
+
+#if defined(_MSC_VER) && _MSC_VER < 1900
+// No thread_local, a fiber local storage callback is called by every thread exiting with its value
+static DWORD threadExitFlsIndex = FLS_OUT_OF_INDEXES;
+static std::once_flag threadExitFlsOnce;
+
+static void WINAPI threadExitFlsCallback(void* data)
+{
+    ThreadExitCalls* calls = (ThreadExitCalls*)data;
+    if (calls)
+    {
+        runThreadExitCalls(calls);
+        delete calls;
+    }
+}
+
+static void allocThreadExitFls()
+{
+    threadExitFlsIndex = FlsAlloc(threadExitFlsCallback);
+}
+
+void callAtThreadExit(ThreadExitFunc func, void* data)
+{
+    std::call_once(threadExitFlsOnce, allocThreadExitFls);
+    if (threadExitFlsIndex == FLS_OUT_OF_INDEXES)
+        return;
+    ThreadExitCalls* calls = (ThreadExitCalls*)FlsGetValue(threadExitFlsIndex);
+    if (!calls)
+    {
+        calls = new ThreadExitCalls;
+        FlsSetValue(threadExitFlsIndex, calls);
+    }
+    calls->push_back(std::make_pair(func, data));
+}
+#else
+struct ThreadExitCaller
+{
+    ~ThreadExitCaller()
+    {
+        runThreadExitCalls(&calls);
+    }
+    ThreadExitCalls calls;
+};
+
+static thread_local ThreadExitCaller threadExitCaller;
+
+void callAtThreadExit(ThreadExitFunc func, void* data)
+{
+    threadExitCaller.calls.push_back(std::make_pair(func, data));
+}
+#endif
+
+// Single producer single consumer ring of formatted log messages,
+// the owner thread pushes and the log thread pops.
+struct LogBuffer
+{
+    enum { Capacity = 256, MessageSize = 256 };
+    char messages[Capacity][MessageSize];
+    std::atomic<long long int> writeCount;
+    std::atomic<long long int> readCount;
+    std::atomic<long long int> numDropped;
+    // The following are only touched by the log thread
+    char lastMessage[MessageSize];
+    int numRepeated;
+    long long int lastMessageTime;
+    int numPassed;
+    int numSuppressed;
+    long long int periodStartTime;
+};
+
+// Like trace buffers, the buffer of a thread exiting goes to freeLogBuffers and is taken
+// by the next thread logging asynchronously. It stays in logBuffers, so that the messages
+// it still holds are passed to the log callback, and the next thread appends after them.
+static std::mutex logBuffersMutex;
+static std::vector<LogBuffer*> logBuffers;
+static std::vector<LogBuffer*> freeLogBuffers;
+static AVP_THREAD_LOCAL LogBuffer* threadLogBuffer = 0;
+static std::thread logThread;
+static std::atomic<int> logThreadStop(0);
+static FFmpegLogCallbackFunc savedFFmpegLogCallback = 0;
+
+static long long int getMilliSecCount()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void releaseThreadLogBuffer(void* data)
+{
+    std::lock_guard<std::mutex> lg(logBuffersMutex);
+    freeLogBuffers.push_back((LogBuffer*)data);
+}
+
+static void pushAsyncLogMessage(const char* message)
+{
+    if (!threadLogBuffer)
+    {
+        LogBuffer* buffer = 0;
+        {
+            std::lock_guard<std::mutex> lg(logBuffersMutex);
+            if (!freeLogBuffers.empty())
+            {
+                buffer = freeLogBuffers.back();
+                freeLogBuffers.pop_back();
+            }
+            else
+            {
+                buffer = new LogBuffer;
+                buffer->writeCount = 0;
+                buffer->readCount = 0;
+                buffer->numDropped = 0;
+                buffer->lastMessage[0] = 0;
+                buffer->numRepeated = 0;
+                buffer->lastMessageTime = 0;
+                buffer->numPassed = 0;
+                buffer->numSuppressed = 0;
+                buffer->periodStartTime = 0;
+                logBuffers.push_back(buffer);
+            }
+        }
+        threadLogBuffer = buffer;
+        callAtThreadExit(releaseThreadLogBuffer, buffer);
+    }
+
+    LogBuffer* buffer = threadLogBuffer;
+    long long int w = buffer->writeCount.load(std::memory_order_relaxed);
+    if (w - buffer->readCount.load(std::memory_order_acquire) >= LogBuffer::Capacity)
+    {
+        buffer->numDropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    char* dst = buffer->messages[w % LogBuffer::Capacity];
+    strncpy(dst, message, LogBuffer::MessageSize - 1);
+    dst[LogBuffer::MessageSize - 1] = 0;
+    buffer->writeCount.store(w + 1, std::memory_order_release);
+}
+
+static void pushAsyncLog(const char* format, va_list vl)
+{
+    char message[LogBuffer::MessageSize];
+    vsnprintf(message, LogBuffer::MessageSize, format, vl);
+    message[LogBuffer::MessageSize - 1] = 0;
+    pushAsyncLogMessage(message);
+}
+
+static void asyncFFmpegLogCallback(void* ptr, int level, const char* format, va_list vl)
+{
+    if (level > av_log_get_level())
+        return;
+
+    char message[LogBuffer::MessageSize];
+    int printPrefix = 1;
+    av_log_format_line(ptr, level, format, vl, message, LogBuffer::MessageSize, &printPrefix);
+    pushAsyncLogMessage(message);
+}
+
+// At most this number of distinct messages of a thread is passed to the log callback per second
+static const int maxNumMessagesPerSecond = 100;
+
+static void flushRepeated(LogBuffer* buffer)
+{
+    if (buffer->numRepeated > 0)
+        callLogCallback("Last message repeated %d times\n", buffer->numRepeated);
+    buffer->numRepeated = 0;
+}
+
+static void flushSuppressed(LogBuffer* buffer)
+{
+    if (buffer->numSuppressed > 0)
+        callLogCallback("%d log messages suppressed, more than %d messages per second\n", 
+            buffer->numSuppressed, maxNumMessagesPerSecond);
+    buffer->numSuppressed = 0;
+}
+
+// Pass the messages of all the buffers to the log callback, return the number of messages taken
+static int drainLogBuffers(std::vector<LogBuffer*>& buffers)
+{
+    // NOTICE!!!
+    // Copy the buffer list and release logBuffersMutex before calling the log callback,
+    // otherwise a log callback calling lprintf would dead lock when registering its buffer
+    {
+        std::lock_guard<std::mutex> lgBuffers(logBuffersMutex);
+        buffers = logBuffers;
+    }
+
+    std::lock_guard<std::mutex> lg(logMutex);
+    long long int currTime = getMilliSecCount();
+    int numTaken = 0;
+    int numBuffers = buffers.size();
+    for (int i = 0; i < numBuffers; i++)
+    {
+        LogBuffer* buffer = buffers[i];
+        if (currTime - buffer->periodStartTime >= 1000)
+        {
+            flushSuppressed(buffer);
+            buffer->numPassed = 0;
+            buffer->periodStartTime = currTime;
+        }
+        long long int r = buffer->readCount.load(std::memory_order_relaxed);
+        long long int w = buffer->writeCount.load(std::memory_order_acquire);
+        for (; r < w; r++)
+        {
+            const char* message = buffer->messages[r % LogBuffer::Capacity];
+            // A message identical to the previous one of the same thread is counted instead of passed,
+            // but the count is reported at least once a second
+            if (strcmp(message, buffer->lastMessage) == 0 && currTime - buffer->lastMessageTime < 1000)
+            {
+                buffer->numRepeated++;
+                continue;
+            }
+            if (buffer->numPassed >= maxNumMessagesPerSecond)
+            {
+                buffer->numSuppressed++;
+                continue;
+            }
+            buffer->numPassed++;
+            flushRepeated(buffer);
+            callLogCallback("%s", message);
+            strcpy(buffer->lastMessage, message);
+            buffer->lastMessageTime = currTime;
+        }
+        numTaken += int(w - buffer->readCount.load(std::memory_order_relaxed));
+        buffer->readCount.store(w, std::memory_order_release);
+
+        if (buffer->numRepeated > 0 && currTime - buffer->lastMessageTime >= 1000)
+        {
+            flushRepeated(buffer);
+            buffer->lastMessageTime = currTime;
+        }
+        long long int numDropped = buffer->numDropped.exchange(0, std::memory_order_relaxed);
+        if (numDropped > 0)
+            callLogCallback("%lld log messages dropped, log buffer full\n", numDropped);
+    }
+    return numTaken;
+}
+
+static void logThreadProc()
+{
+    std::vector<LogBuffer*> buffers;
+    while (!logThreadStop.load(std::memory_order_acquire))
+    {
+        if (drainLogBuffers(buffers) == 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    drainLogBuffers(buffers);
+
+    std::lock_guard<std::mutex> lg(logMutex);
+    int numBuffers = buffers.size();
+    for (int i = 0; i < numBuffers; i++)
+    {
+        flushRepeated(buffers[i]);
+        flushSuppressed(buffers[i]);
+        buffers[i]->lastMessage[0] = 0;
+    }
+}
+
+static std::mutex asyncLogMutex;
+
+void setAsyncLog(bool async, bool routeFFmpegLog)
+{
+    std::lock_guard<std::mutex> lg(asyncLogMutex);
+    if (async && !asyncLog.load(std::memory_order_relaxed))
+    {
+        logThreadStop.store(0, std::memory_order_release);
+        logThread = std::thread(logThreadProc);
+        asyncLog.store(1, std::memory_order_release);
+    }
+    else if (!async && asyncLog.load(std::memory_order_relaxed))
+    {
+        // Messages pushed by other threads at the moment are passed on next enabling
+        asyncLog.store(0, std::memory_order_release);
+        logThreadStop.store(1, std::memory_order_release);
+        logThread.join();
+    }
+
+    bool routed = ffmpegLogCallback == asyncFFmpegLogCallback;
+    if (async && routeFFmpegLog && !routed)
+    {
+        savedFFmpegLogCallback = ffmpegLogCallback;
+        ffmpegLogCallback = asyncFFmpegLogCallback;
+        av_log_set_callback(ffmpegLogCallback);
+    }
+    else if ((!async || !routeFFmpegLog) && routed)
+    {
+        ffmpegLogCallback = savedFFmpegLogCallback;
+        av_log_set_callback(ffmpegLogCallback);
+    }
+}
+
+// Stop the log thread before the static std::thread is destroyed
+static struct AsyncLogStopper
+{
+    ~AsyncLogStopper()
+    {
+        setAsyncLog(false);
+    }
+} asyncLogStopper;
+
 FFmpegLogCallbackFunc setFFmpegLogCallback(FFmpegLogCallbackFunc func)
 {
     FFmpegLogCallbackFunc oldCallback = ffmpegLogCallback;
@@ -2,6 +2,13 @@
 
 #include "AudioVideoProcessor.h"
 
+// Visual Studio 2013 does not support thread_local, __declspec(thread) only works for POD types
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define AVP_THREAD_LOCAL __declspec(thread)
+#else
+#define AVP_THREAD_LOCAL thread_local
+#endif
+
 namespace avp
 {
 
@@ -15,16 +22,15 @@ void defaultLogCallback(const char* format, va_list vl);
 
 void lprintf(const char* format, ...);
 
+typedef void(*ThreadExitFunc)(void* data);
+
+// Call func with data when the calling thread exits, such as to recycle a buffer the thread
+// points to by an AVP_THREAD_LOCAL pointer, which has no destructor in Visual Studio 2013.
+// Functions registered by the main thread may not be called at process exit.
+void callAtThreadExit(ThreadExitFunc func, void* data);
+
 inline bool isInterfaceSampleType(int type)
 {
     return (type > SampleTypeUnknown) && (type <= SampleType64FP);
 }
-
-inline bool isInterfacePixelType(int type)
-{
-    return (type == PixelTypeBGR24) ||
-        (type == PixelTypeBGR32) ||
-        (type == PixelTypeNV12) ||
-        (type == PixelTypeYUV420P);
-}
 }
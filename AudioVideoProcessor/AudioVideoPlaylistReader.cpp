@@ -0,0 +1,458 @@
+#include "AudioVideoProcessor.h"
+#include "AudioVideoGlobal.h"
+#include "FFmpegUtil.h"
+#include "AudioVideoTrace.h"
+
+#ifdef __cplusplus
+#define __STDC_CONSTANT_MACROS
+extern "C"
+{
+#endif
+#include <libavformat/avformat.h>
+#ifdef __cplusplus
+}
+#endif
+#include <fstream>
+#include <thread>
+
+// Start time and duration of a file not opened yet, from the header if the container stores them
+static bool probeFile(const std::string& fileName, const std::string& formatName,
+    const std::vector<avp::Option>& options, long long int& startTime, long long int& duration)
+{
+    startTime = -1;
+    duration = -1;
+
+    AVInputFormat* inputFormat = av_find_input_format(formatName.c_str());
+    AVDictionary* dict = NULL;
+    cvtOptions(options, &dict);
+    AVFormatContext* fmtCtx = NULL;
+    if (avformat_open_input(&fmtCtx, fileName.c_str(), inputFormat, &dict) < 0)
+    {
+        avp::lprintf("Could not open source file %s\n", fileName.c_str());
+        av_dict_free(&dict);
+        return false;
+    }
+    av_dict_free(&dict);
+
+    if (fmtCtx->duration == AV_NOPTS_VALUE && avformat_find_stream_info(fmtCtx, NULL) < 0)
+    {
+        avp::lprintf("Could not find stream information\n");
+        avformat_close_input(&fmtCtx);
+        return false;
+    }
+    if (fmtCtx->start_time != AV_NOPTS_VALUE)
+        startTime = fmtCtx->start_time;
+    if (fmtCtx->duration != AV_NOPTS_VALUE)
+        duration = fmtCtx->duration;
+    avformat_close_input(&fmtCtx);
+    return true;
+}
+
+static std::string trim(const std::string& str)
+{
+    size_t begin = str.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos)
+        return std::string();
+    size_t end = str.find_last_not_of(" \t\r\n");
+    return str.substr(begin, end - begin + 1);
+}
+
+static bool isAbsolutePath(const std::string& path)
+{
+    return !path.empty() && (path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':') ||
+        path.find("://") != std::string::npos);
+}
+
+static bool parseManifest(const std::string& manifestName, std::vector<std::string>& fileNames)
+{
+    fileNames.clear();
+    std::ifstream ifs(manifestName.c_str());
+    if (!ifs)
+    {
+        avp::lprintf("Could not open manifest %s\n", manifestName.c_str());
+        return false;
+    }
+
+    size_t pos = manifestName.find_last_of("/\\");
+    std::string dirName = pos == std::string::npos ? std::string() : manifestName.substr(0, pos + 1);
+    std::string line;
+    while (std::getline(ifs, line))
+    {
+        line = trim(line);
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        std::string fileName;
+        if (line.compare(0, 5, "file ") == 0)
+        {
+            fileName = trim(line.substr(5));
+            if (fileName.size() >= 2 && (fileName[0] == '\'' || fileName[0] == '"') &&
+                fileName[fileName.size() - 1] == fileName[0])
+                fileName = fileName.substr(1, fileName.size() - 2);
+        }
+        // Other ffconcat directives, such as the version line and durations
+        else if (line.compare(0, 8, "ffconcat") == 0 || line.compare(0, 9, "duration ") == 0 ||
+            line.compare(0, 8, "inpoint ") == 0 || line.compare(0, 9, "outpoint ") == 0 ||
+            line.compare(0, 7, "stream ") == 0 || line.compare(0, 6, "exact_") == 0 ||
+            line.compare(0, 5, "file_") == 0 || line.compare(0, 7, "option ") == 0)
+            continue;
+        else
+            fileName = line;
+
+        fileNames.push_back(isAbsolutePath(fileName) ? fileName : dirName + fileName);
+    }
+
+    if (fileNames.empty())
+    {
+        avp::lprintf("No file listed in manifest %s\n", manifestName.c_str());
+        return false;
+    }
+    return true;
+}
+
+namespace avp
+{
+
+struct AudioVideoPlaylistReader::Impl
+{
+    Impl();
+    ~Impl();
+    void init();
+    bool open(const std::vector<std::string>& fileNames, const std::vector<int>& indexes,
+        int sampleType, int pixelType, const std::string& formatName, const std::vector<Option>& options);
+    bool read(AudioVideoFrame2& frame, int& index);
+    bool seek(long long int timeStamp, int index);
+    void getProperties(int index, InputStreamProperties& prop);
+    void close();
+
+    // Make file the current one, taking the prefetched reader if it is the file prefetched
+    bool openFile(int file);
+    // Open file on the prefetch thread, after closing the reader which is done with
+    void startPrefetch(int file, AudioVideoReader3 doneReader);
+    void waitPrefetch();
+    // Offset of the time stamps of file on the timeline, -1 if unknown
+    long long int getFileOffset(int file);
+    long long int getFileDuration(int file);
+
+    std::vector<std::string> fileNames;
+    std::vector<int> indexes;
+    int sampleType;
+    int pixelType;
+    std::string formatName;
+    std::vector<Option> options;
+    // Per file, -1 if not known yet, written by the prefetch thread only for the file it opens
+    std::vector<long long int> startTimes;
+    std::vector<long long int> durations;
+    std::vector<long long int> offsets;
+    std::vector<int> probed;
+
+    AudioVideoReader3 reader;
+    int fileIndex;
+    AudioVideoReader3 nextReader;
+    int nextFileIndex;
+    int nextOpened;
+    std::thread prefetchThread;
+    // End of the latest frame on the timeline, the offset of a file of unknown duration follows it
+    long long int endTimeStamp;
+    int isOpened;
+};
+
+AudioVideoPlaylistReader::Impl::Impl()
+{
+    init();
+}
+
+AudioVideoPlaylistReader::Impl::~Impl()
+{
+    close();
+}
+
+void AudioVideoPlaylistReader::Impl::init()
+{
+    fileNames.clear();
+    indexes.clear();
+    sampleType = SampleTypeUnknown;
+    pixelType = PixelTypeUnknown;
+    formatName.clear();
+    options.clear();
+    startTimes.clear();
+    durations.clear();
+    offsets.clear();
+    probed.clear();
+    reader = AudioVideoReader3();
+    fileIndex = -1;
+    nextReader = AudioVideoReader3();
+    nextFileIndex = -1;
+    nextOpened = 0;
+    endTimeStamp = 0;
+    isOpened = 0;
+}
+
+bool AudioVideoPlaylistReader::Impl::open(const std::vector<std::string>& fileNames_, const std::vector<int>& indexes_,
+    int sampleType_, int pixelType_, const std::string& formatName_, const std::vector<Option>& options_)
+{
+    close();
+
+    if (fileNames_.empty())
+    {
+        lprintf("Error in %s, empty file list\n", __FUNCTION__);
+        return false;
+    }
+
+    fileNames = fileNames_;
+    indexes = indexes_;
+    sampleType = sampleType_;
+    pixelType = pixelType_;
+    formatName = formatName_;
+    options = options_;
+    int numFiles = fileNames.size();
+    startTimes.assign(numFiles, -1);
+    durations.assign(numFiles, -1);
+    offsets.assign(numFiles, -1);
+    probed.assign(numFiles, 0);
+    offsets[0] = 0;
+
+    if (!openFile(0))
+    {
+        close();
+        return false;
+    }
+    isOpened = 1;
+    return true;
+}
+
+bool AudioVideoPlaylistReader::Impl::openFile(int file)
+{
+    waitPrefetch();
+    AudioVideoReader3 doneReader = reader;
+    if (file == nextFileIndex && nextOpened)
+    {
+        reader = nextReader;
+    }
+    else
+    {
+        doneReader.close();
+        reader = AudioVideoReader3();
+        if (!reader.open(fileNames[file], indexes, sampleType, pixelType, formatName, options))
+        {
+            lprintf("Error in %s, could not open file %s\n", __FUNCTION__, fileNames[file].c_str());
+            fileIndex = -1;
+            return false;
+        }
+        startTimes[file] = reader.getStartTime();
+        durations[file] = reader.getDuration();
+        probed[file] = 1;
+    }
+    nextReader = AudioVideoReader3();
+    nextFileIndex = -1;
+    nextOpened = 0;
+    fileIndex = file;
+
+    // A file of unknown offset directly follows what has been read
+    if (offsets[file] < 0)
+        offsets[file] = getFileOffset(file) >= 0 ? offsets[file] : endTimeStamp;
+
+    if (file + 1 < (int)fileNames.size())
+        startPrefetch(file + 1, doneReader);
+    else
+        doneReader.close();
+    return true;
+}
+
+void AudioVideoPlaylistReader::Impl::startPrefetch(int file, AudioVideoReader3 doneReader)
+{
+    nextFileIndex = file;
+    nextOpened = 0;
+    prefetchThread = std::thread([this, file, doneReader]() mutable
+    {
+        // Closing the previous file is also kept off the reading thread
+        doneReader.close();
+        TraceScope trace("AudioVideoPlaylistReader::prefetch", -1, file);
+        if (nextReader.open(fileNames[file], indexes, sampleType, pixelType, formatName, options))
+        {
+            startTimes[file] = nextReader.getStartTime();
+            durations[file] = nextReader.getDuration();
+            probed[file] = 1;
+            nextOpened = 1;
+        }
+        else
+            lprintf("Error in %s, could not open file %s\n", __FUNCTION__, fileNames[file].c_str());
+    });
+}
+
+void AudioVideoPlaylistReader::Impl::waitPrefetch()
+{
+    if (prefetchThread.joinable())
+        prefetchThread.join();
+}
+
+long long int AudioVideoPlaylistReader::Impl::getFileDuration(int file)
+{
+    if (!probed[file])
+    {
+        probeFile(fileNames[file], formatName, options, startTimes[file], durations[file]);
+        probed[file] = 1;
+    }
+    return durations[file];
+}
+
+long long int AudioVideoPlaylistReader::Impl::getFileOffset(int file)
+{
+    if (offsets[file] >= 0)
+        return offsets[file];
+
+    long long int prevOffset = getFileOffset(file - 1);
+    long long int prevDuration = prevOffset >= 0 ? getFileDuration(file - 1) : -1;
+    if (prevDuration < 0)
+        return -1;
+    offsets[file] = prevOffset + prevDuration;
+    return offsets[file];
+}
+
+bool AudioVideoPlaylistReader::Impl::read(AudioVideoFrame2& frame, int& index)
+{
+    if (!isOpened)
+        return false;
+
+    while (true)
+    {
+        if (fileIndex >= 0 && reader.read(frame, index))
+            break;
+
+        // Move on to the next file, files which fail to open are skipped
+        int numFiles = fileNames.size();
+        int file = fileIndex >= 0 ? fileIndex + 1 : nextFileIndex;
+        if (file < 0 || file >= numFiles)
+            return false;
+        if (!openFile(file))
+        {
+            if (file + 1 >= numFiles)
+                return false;
+            nextFileIndex = file + 1;
+            offsets[file + 1] = endTimeStamp;
+        }
+    }
+
+    long long int startTime = startTimes[fileIndex] < 0 ? 0 : startTimes[fileIndex];
+    InputStreamProperties prop;
+    reader.getProperties(index, prop);
+    if (frame.timeStamp >= 0)
+    {
+        frame.timeStamp = frame.timeStamp - startTime + offsets[fileIndex];
+        long long int frameDuration = 0;
+        if (frame.mediaType == VIDEO && prop.frameRate > 0)
+        {
+            frameDuration = 1000000 / prop.frameRate;
+            frame.frameIndex = frame.timeStamp * prop.frameRate / 1000000 + 0.5;
+        }
+        else if (frame.mediaType == AUDIO && prop.sampleRate > 0)
+        {
+            frameDuration = frame.numSamples * 1000000LL / prop.sampleRate;
+            if (frame.numSamples > 0)
+                frame.frameIndex = double(frame.timeStamp) / 1000000 * prop.sampleRate / frame.numSamples + 0.5;
+        }
+        endTimeStamp = FFMAX(endTimeStamp, frame.timeStamp + frameDuration);
+    }
+    return true;
+}
+
+bool AudioVideoPlaylistReader::Impl::seek(long long int timeStamp, int index)
+{
+    if (!isOpened)
+        return false;
+
+    // The prefetch thread may be filling in the start time and duration of the next file
+    waitPrefetch();
+
+    // Find the file covering timeStamp, probing the durations of the files not opened yet
+    int numFiles = fileNames.size();
+    int file = 0;
+    for (; file < numFiles - 1; file++)
+    {
+        long long int offset = getFileOffset(file);
+        long long int duration = offset >= 0 ? getFileDuration(file) : -1;
+        if (duration < 0)
+        {
+            lprintf("Error in %s, duration of file %s unknown\n", __FUNCTION__, fileNames[file].c_str());
+            return false;
+        }
+        if (timeStamp < offset + duration)
+            break;
+    }
+    if (getFileOffset(file) < 0)
+        return false;
+
+    if (file != fileIndex && !openFile(file))
+        return false;
+
+    long long int startTime = startTimes[file] < 0 ? 0 : startTimes[file];
+    endTimeStamp = timeStamp;
+    return reader.seek(timeStamp - offsets[file] + startTime, index);
+}
+
+void AudioVideoPlaylistReader::Impl::getProperties(int index, InputStreamProperties& prop)
+{
+    if (!isOpened || fileIndex < 0)
+    {
+        prop = InputStreamProperties();
+        return;
+    }
+    reader.getProperties(index, prop);
+}
+
+void AudioVideoPlaylistReader::Impl::close()
+{
+    waitPrefetch();
+    reader.close();
+    nextReader.close();
+    init();
+}
+
+AudioVideoPlaylistReader::AudioVideoPlaylistReader()
+{
+    ptrImpl.reset(new Impl);
+}
+
+bool AudioVideoPlaylistReader::open(const std::vector<std::string>& fileNames, const std::vector<int>& indexes,
+    int sampleType, int pixelType, const std::string& formatName, const std::vector<Option>& options)
+{
+    initFFMPEG();
+    return ptrImpl->open(fileNames, indexes, sampleType, pixelType, formatName, options);
+}
+
+bool AudioVideoPlaylistReader::openManifest(const std::string& manifestName, const std::vector<int>& indexes,
+    int sampleType, int pixelType, const std::string& formatName, const std::vector<Option>& options)
+{
+    std::vector<std::string> fileNames;
+    if (!parseManifest(manifestName, fileNames))
+        return false;
+    initFFMPEG();
+    return ptrImpl->open(fileNames, indexes, sampleType, pixelType, formatName, options);
+}
+
+bool AudioVideoPlaylistReader::read(AudioVideoFrame2& frame, int& index)
+{
+    return ptrImpl->read(frame, index);
+}
+
+bool AudioVideoPlaylistReader::seek(long long int timeStamp, int index)
+{
+    return ptrImpl->seek(timeStamp, index);
+}
+
+void AudioVideoPlaylistReader::getProperties(int index, InputStreamProperties& prop)
+{
+    ptrImpl->getProperties(index, prop);
+}
+
+int AudioVideoPlaylistReader::getFileIndex() const
+{
+    return ptrImpl->fileIndex;
+}
+
+void AudioVideoPlaylistReader::close()
+{
+    ptrImpl->close();
+}
+
+}
@@ -17,18 +17,35 @@ FFmpegLogCallbackFunc setFFmpegLogCallback(FFmpegLogCallbackFunc func);
 
 LogCallbackFunc setLogCallback(LogCallbackFunc func);
 
+// In async mode, log messages are formatted by the calling thread and passed to
+// the log callback by a background thread, repeated messages of a thread are folded.
+// Messages of different threads may reach the callback out of order.
+// If routeFFmpegLog is true, FFmpeg log goes through the log callback as well.
+void setAsyncLog(bool async, bool routeFFmpegLog = false);
+
 enum MediaType
 {
     UNKNOWN = -1, AUDIO, VIDEO
 };
 
+// Values equal AVPixelFormat of FFmpeg 2.8, 10 bit types are little endian.
+// PixelTypeP010 is only supported when built against FFmpeg 3.0 or later.
 enum PixelType
 {
     PixelTypeUnknown = -1,
     PixelTypeBGR24 = 3,
     PixelTypeBGR32 = 298,
     PixelTypeYUV420P = 0,
-    PixelTypeNV12 = 25
+    PixelTypeNV12 = 25,
+    PixelTypeYUV422P = 4,
+    PixelTypeYUV444P = 5,
+    PixelTypeGRAY8 = 8,
+    PixelTypeRGBA = 28,
+    PixelTypeBGRA = 30,
+    PixelTypeYUV420P10 = 72,
+    PixelTypeYUV422P10 = 74,
+    PixelTypeYUV444P10 = 78,
+    PixelTypeP010 = 1000
 };
 
 typedef std::pair<std::string, std::string> Option;
@@ -60,6 +77,142 @@ enum EncoderType
 
 bool supportsEncoder(int type);
 
+struct WriteMemoryStats
+{
+    long long int numPacketBufferAllocs;
+    long long int numPacketBufferGets;
+    long long int numFrameBufferAllocs;
+    // Rates are computed over the interval since the previous call of getWriteMemoryStats
+    double packetBufferAllocsPerSecond;
+    double frameBufferAllocsPerSecond;
+};
+
+// Process wide memory allocation counters of the encoding path
+void getWriteMemoryStats(WriteMemoryStats& stats);
+
+struct ConvertCacheStats
+{
+    long long int numSwsCreates;
+    long long int numSwsReuses;
+    long long int numSwrCreates;
+    long long int numSwrReuses;
+    int numIdleContexts;
+};
+
+// Scale and resample contexts of the stream readers and writers are returned to a process wide cache on close,
+// and leased again by readers and writers opened later with the same conversion parameters.
+// At most maxIdleContexts contexts of each kind are kept, 64 by default, 0 disables the cache.
+void setConvertCacheCapacity(int maxIdleContexts);
+
+void getConvertCacheStats(ConvertCacheStats& stats);
+
+// Record begin and end of every frame read and written, off by default.
+// Enabling tracing again drops the spans recorded before.
+void setTraceEnabled(bool enable);
+
+// Write the recorded spans as Chrome trace event JSON, which could be loaded in chrome://tracing
+bool dumpTraceEvents(const std::string& fileName);
+
+// Back frame buffers of 2 MB or more with huge pages where the system grants them, off by default
+void setUseHugePages(bool use);
+
+// Convert yuv420p and nv12 to and from bgr24 and bgr32 with dedicated AVX2 kernels instead of swscale,
+// other conversions always use swscale, off by default
+void setFastColorConvert(bool enable);
+
+enum PackagerType
+{
+    PackagerTypeHLS,
+    PackagerTypeDASH
+};
+
+// Snapshot of the always on counters of a stream, times are cumulative nano seconds spent in each stage
+struct StreamStats
+{
+    StreamStats() :
+        mediaType(UNKNOWN), numPackets(0), numBytes(0), numFrames(0), numDroppedFrames(0), queueDepth(0),
+        demuxNanoSec(0), decodeNanoSec(0), convertNanoSec(0), encodeNanoSec(0), muxNanoSec(0),
+        latencyNanoSec(0), maxLatencyNanoSec(0)
+    {}
+    int mediaType;
+    long long int numPackets;
+    long long int numBytes;
+    // Frames decoded by a reader, or encoded by a writer
+    long long int numFrames;
+    long long int numDroppedFrames;
+    // Number of samples or frames waiting to be encoded, or decoded frames waiting to be read
+    long long int queueDepth;
+    long long int demuxNanoSec;
+    long long int decodeNanoSec;
+    // Time in sws or swr
+    long long int convertNanoSec;
+    long long int encodeNanoSec;
+    long long int muxNanoSec;
+    // Video streams of a writer, time from a frame given to write to its packet handed to the muxer,
+    // summed over the numPackets packets and the largest one
+    long long int latencyNanoSec;
+    long long int maxLatencyNanoSec;
+};
+
+struct AudioVideoStats
+{
+    // Sum of all the streams, packets of the streams not opened are counted only here
+    StreamStats total;
+    std::vector<StreamStats> streams;
+};
+
+enum ResampleEngine
+{
+    ResampleEngineSwr,
+    // SoX resampler, available only if FFmpeg is built with libsoxr, 
+    // falls back to ResampleEngineSwr otherwise
+    ResampleEngineSoxr
+};
+
+enum ResampleQuality
+{
+    // Cheap interpolation for real time paths
+    ResampleQualityLinear,
+    ResampleQualityDefault,
+    ResampleQualityHigh
+};
+
+struct ResampleOptions
+{
+    ResampleOptions(int engine_ = ResampleEngineSwr, int quality_ = ResampleQualityDefault, int filterSize_ = 0) :
+        engine(engine_), quality(quality_), filterSize(filterSize_)
+    {}
+    int engine;
+    int quality;
+    // Length of the swr interpolation filter, 0 means decided by quality
+    int filterSize;
+};
+
+// Layout of the float tensors AudioVideoReader3::readTensor writes video frames to,
+// three planes of height x width floats
+struct TensorOptions
+{
+    TensorOptions(int width_ = 0, int height_ = 0) :
+        width(width_), height(height_), rgb(false), letterbox(false), padValue(0)
+    {
+        mean[0] = mean[1] = mean[2] = 0;
+        scale[0] = scale[1] = scale[2] = 1;
+    }
+    int width;
+    int height;
+    // Plane c holds (pixel value - mean[c]) * scale[c], planes are b, g, r or r, g, b if rgb is true
+    float mean[3];
+    float scale[3];
+    bool rgb;
+    // Keep the aspect ratio and center the picture, the border gets pixel value padValue
+    bool letterbox;
+    float padValue;
+};
+
+// Rectangle of the tensor the picture is resized into
+void getTensorRect(const TensorOptions& options, int srcWidth, int srcHeight,
+    int& x, int& y, int& width, int& height);
+
 struct AudioVideoFrame
 {
     AudioVideoFrame(unsigned char* data_ = 0, int step_ = 0, int mediaType_ = UNKNOWN, 
@@ -114,6 +267,12 @@ inline AudioVideoFrame videoFrame(unsigned char* data, int step, int pixelType,
     return frame;
 }
 
+enum FrameFlag
+{
+    // The decoded size or pixel format of the video stream changed with this frame
+    FrameFlagFormatChanged = 1
+};
+
 struct AudioVideoFrame2
 {
     AudioVideoFrame2(unsigned char** data = 0, int* steps = 0, int mediaType = UNKNOWN,
@@ -137,6 +296,13 @@ struct AudioVideoFrame2
 
     bool create(int pixelType, int width, int height, long long int timeStamp = -1LL, int frameIndex = -1);
 
+    // Allocate a video frame of any planar or packed pixel type with every step a multiple of stepAlign,
+    // which should be a power of two such as 16, 32, 64 or 128, and every plane starting at such a boundary.
+    // At least padCols pixels follow each row and padRows rows follow each plane, both zero filled.
+    // Calling create or copyTo with the same pixel type and size afterwards keeps this layout.
+    bool createAligned(int pixelType, int width, int height, int stepAlign, int padRows = 0, int padCols = 0,
+        long long int timeStamp = -1LL, int frameIndex = -1);
+
     bool copyTo(AudioVideoFrame2& frame) const;
 
     AudioVideoFrame2 clone() const;
@@ -155,6 +321,8 @@ struct AudioVideoFrame2
     int numSamples;
     long long int timeStamp;
     int frameIndex;
+    // Bits of FrameFlag
+    int flags;
 };
 
 struct StreamProperties
@@ -166,7 +334,7 @@ struct StreamProperties
     {};
     StreamProperties(int numFrames_, int sampleType_, int sampleRate_, int numChannels_, int channleLayout_, int numSamples_) :
         mediaType(AUDIO), numFrames(numFrames_),
-        sampleType(sampleType_), sampleRate(sampleRate_), numChannels(numChannels_), channelLayout(channelLayout), numSamples(numSamples_),
+        sampleType(sampleType_), sampleRate(sampleRate_), numChannels(numChannels_), channelLayout(channleLayout_), numSamples(numSamples_),
         pixelType(PixelTypeUnknown), width(0), height(0), frameRate(0)
     {};
     StreamProperties(int numFrames_, int pixelType_, int width_, int height_, double frameRate_) :
@@ -200,7 +368,7 @@ struct InputStreamProperties
     {};
     InputStreamProperties(int numFrames_, int sampleType_, int sampleRate_, int numChannels_, int channleLayout_, int numSamples_) :
         mediaType(AUDIO), numFrames(numFrames_),
-        sampleType(sampleType_), sampleRate(sampleRate_), numChannels(numChannels_), channelLayout(channelLayout), numSamples(numSamples_),
+        sampleType(sampleType_), sampleRate(sampleRate_), numChannels(numChannels_), channelLayout(channleLayout_), numSamples(numSamples_),
         pixelType(PixelTypeUnknown), width(0), height(0), frameRate(0)
     {};
     InputStreamProperties(int numFrames_, int pixelType_, int width_, int height_, double frameRate_) :
@@ -221,6 +389,79 @@ struct InputStreamProperties
     double frameRate;
 };
 
+enum RateControlMode
+{
+    // Average bit rate of OutputStreamProperties::bitRate, or one derived from the picture size if it is 0
+    RateControlDefault,
+    // Constant quality crf, bitRate is ignored
+    RateControlCRF,
+    // Constant bit rate, bitRate held by a vbv buffer of bufferSize bits
+    RateControlCBR,
+    // Variable bit rate averaging bitRate, peaks capped at maxBitRate by a vbv buffer of bufferSize bits
+    RateControlVBR
+};
+
+enum EncodeThreadMode
+{
+    EncodeThreadDefault,
+    // Frames are encoded in parallel, higher throughput, each thread adds one frame of delay
+    EncodeThreadFrame,
+    // Each frame is split into slices encoded in parallel, no extra delay
+    EncodeThreadSlice
+};
+
+// Encoder settings of a video stream. Negative or empty fields keep the choice of the encoder,
+// options passed to AudioVideoWriter3::open with the same names take precedence.
+// preset, tune and lookahead are options of libx264 and are ignored by other encoders.
+struct EncoderConfig
+{
+    EncoderConfig() :
+        numThreads(-1), threadMode(EncodeThreadDefault), rateControl(RateControlDefault), crf(23),
+        maxBitRate(0), bufferSize(0), lookahead(-1), maxBFrames(-1), gopLength(0)
+    {}
+    // Every frame leaves the encoder as soon as it is encoded,
+    // slice threads, no b frames and no lookahead
+    static EncoderConfig zeroLatency()
+    {
+        EncoderConfig config;
+        config.numThreads = 0;
+        config.threadMode = EncodeThreadSlice;
+        config.preset = "veryfast";
+        config.tune = "zerolatency";
+        config.lookahead = 0;
+        config.maxBFrames = 0;
+        return config;
+    }
+    // Most frames per second on all cores, frame threads and a fast preset with short lookahead
+    static EncoderConfig maxThroughput()
+    {
+        EncoderConfig config;
+        config.numThreads = 0;
+        config.threadMode = EncodeThreadFrame;
+        config.preset = "superfast";
+        config.lookahead = 10;
+        return config;
+    }
+    // 0 means one thread per core
+    int numThreads;
+    int threadMode;
+    std::string preset;
+    std::string tune;
+    int rateControl;
+    // Quality of RateControlCRF, lower is better
+    double crf;
+    // Bits per second, used by RateControlVBR, 0 means bitRate
+    int maxBitRate;
+    // Bits, used by RateControlCBR and RateControlVBR, 0 means one second of the maximum rate
+    int bufferSize;
+    // Frames the rate control looks ahead
+    int lookahead;
+    int maxBFrames;
+    // Frames between key frames, 0 means derived from the key frame interval given to open.
+    // If given, key frames forced by the writer, such as those at packager segment boundaries, follow it too.
+    int gopLength;
+};
+
 struct OutputStreamProperties
 {
     OutputStreamProperties() :
@@ -247,6 +488,10 @@ struct OutputStreamProperties
     int height;
     double frameRate;
     int bitRate;
+    // Used when input samples have to be converted to the format the audio encoder takes
+    ResampleOptions resampleOptions;
+    // Used by video streams
+    EncoderConfig encoderConfig;
 };
 
 class AudioVideoReader
@@ -306,6 +551,31 @@ private:
     std::shared_ptr<Impl> ptrImpl;
 };
 
+typedef void*(*DecodeAllocFunc)(void* userData, int numBytes, int alignment);
+typedef void(*DecodeFreeFunc)(void* userData, void* ptr);
+
+// Memory for decoded pictures supplied by the caller. alloc returns numBytes bytes aligned to alignment,
+// or null to let FFmpeg allocate the picture, free gives them back. Both may be called from decoder threads,
+// free is called for every block before the reader is closed.
+struct DecodeAllocator
+{
+    DecodeAllocator(DecodeAllocFunc alloc_ = 0, DecodeFreeFunc free_ = 0, void* userData_ = 0) :
+        alloc(alloc_), free(free_), userData(userData_)
+    {}
+    DecodeAllocFunc alloc;
+    DecodeFreeFunc free;
+    void* userData;
+};
+
+// Called by AudioVideoReader3::readTo before a frame of stream index is decoded,
+// buffer should be filled with a frame created to match the properties of the stream.
+// Returning false stops reading.
+typedef bool(*FrameBufferProviderFunc)(void* userData, int index, AudioVideoFrame2& buffer);
+
+// Called by AudioVideoReader3::readRange with each frame of stream index in the range,
+// the data of frame is only valid during the call. Returning false stops reading.
+typedef bool(*FrameCallbackFunc)(void* userData, int index, const AudioVideoFrame2& frame);
+
 class AudioVideoReader3
 {
 public:
@@ -316,9 +586,96 @@ public:
     bool open(const std::string& fileName, const std::vector<int>& indexes,
         int sampleType, int pixelType, const std::string& formatName = std::string(),
         const std::vector<Option>& options = std::vector<Option>());
+    // Audio streams are converted to sampleRate and channelLayout, 
+    // zero sampleRate or channelLayout keeps the one of the stream
+    bool open(const std::string& fileName, const std::vector<int>& indexes,
+        int sampleType, int sampleRate, int channelLayout, const ResampleOptions& resampleOptions,
+        int pixelType, const std::string& formatName = std::string(),
+        const std::vector<Option>& options = std::vector<Option>());
+    // Switch to another file with the same streams, such as the next segment of a recording, reading the
+    // streams given to open with the same parameters. The decoders and conversion contexts of the streams
+    // whose codec parameters match are kept and flushed, the others are opened again.
+    // The reader is closed if fileName could not be opened.
+    bool reopen(const std::string& fileName, const std::string& formatName = std::string(),
+        const std::vector<Option>& options = std::vector<Option>());
+    bool read(AudioVideoFrame2& frame, int& index);
+    // Same as read, but video frames are resized, converted and normalized straight from the decoded picture
+    // into tensor, which holds 3 * options.height * options.width floats. The video frame returned then
+    // has no data, its width and height are those of the decoded picture.
+    bool readTensor(AudioVideoFrame2& frame, int& index, float* tensor, const TensorOptions& options);
+    // Read at most maxFrames frames of video stream index into one contiguous buffer, frames[i].data[0]
+    // is i * frame size bytes after frames[0].data[0] and rows are not padded, so packed pixel types
+    // form an NHWC batch. The buffer is reused by the next call unless a frame of it is still held.
+    // Packets of the other streams are dropped. Fewer frames are returned at the end of the file,
+    // and false when no frame is left.
+    bool readBatch(std::vector<AudioVideoFrame2>& frames, int maxFrames, int index);
+    // Decode and convert the next frame straight into buffers[index], buffers holds one frame per stream
+    // of the file, those of the opened streams created to match the properties of the streams.
+    // Audio streams could only be read this way if their sample rate is not converted.
+    bool readTo(std::vector<AudioVideoFrame2>& buffers, int& index);
+    // Same as above, but the buffer of each frame comes from provider, frame is the filled buffer
+    bool readTo(FrameBufferProviderFunc provider, void* userData, AudioVideoFrame2& frame, int& index);
+    // Read the next frame of stream index, in serial mode the frames of the other streams are skipped
+    bool readStream(AudioVideoFrame2& frame, int index);
+    // Pass every frame of the opened streams with time stamp in [beginTimeStamp, endTimeStamp) to callback.
+    // Demuxing starts from the key frame of the first opened video stream before beginTimeStamp, the video
+    // frames before beginTimeStamp are decoded but not converted, and demuxing of a stream stops at its first
+    // packet at or past endTimeStamp. The read position is undefined afterwards, seek before reading again.
+    // Not supported in parallel decode mode.
+    bool readRange(long long int beginTimeStamp, long long int endTimeStamp, FrameCallbackFunc callback, void* userData);
+    // Takes effect at the next open. If maxQueuedFrames is positive, one thread demuxes and each opened stream
+    // is decoded on its own thread, with at most maxQueuedFrames frames per stream waiting to be read.
+    // read then returns the earliest of the frames ready and readStream waits only for its stream,
+    // both could be called from several threads, such as one thread per stream.
+    // Frames stay valid as long as the caller holds them. A stream which is not read stalls the others
+    // once its queue is full. readTensor, readBatch and readTo are not supported in this mode.
+    void setParallelDecode(int maxQueuedFrames);
+    // Takes effect at the next open. Video streams may change their decoded size or pixel format in the middle,
+    // the frame of the change then has FrameFlagFormatChanged in flags, and the frames keep the pixel type
+    // given to open. If keep is true they also keep the opened size, being scaled back to it, otherwise
+    // they take the new size, which getProperties reports from then on. Without keep, the frame of the change
+    // read by readTo is scaled to its buffer, and a batch of readBatch ends with it.
+    void setKeepVideoSize(bool keep);
+    bool seek(long long int timeStamp, int index);
+    void getProperties(int index, InputStreamProperties& prop);
+    // Start time and duration of the file in micro seconds, -1 if unknown
+    long long int getStartTime() const;
+    long long int getDuration() const;
+    // Could be called from any thread while the reader is opened
+    void getStats(AudioVideoStats& stats) const;
+    // Video decoders opened afterwards put their pictures in memory from allocator, if they support it.
+    // Frames read in the pixel type of the stream then point into this memory without any copy.
+    void setDecodeAllocator(const DecodeAllocator& allocator);
+    void close();
+
+private:
+    struct Impl;
+    std::shared_ptr<Impl> ptrImpl;
+};
+
+// Reads a list of files, such as the hourly parts of a recording, as one timeline.
+// Time stamps of each file are shifted to follow the end of the previous file, and the next file
+// is opened on a background thread while the current one is read. All the files should have
+// the streams of the first one.
+class AudioVideoPlaylistReader
+{
+public:
+    AudioVideoPlaylistReader();
+    bool open(const std::vector<std::string>& fileNames, const std::vector<int>& indexes,
+        int sampleType, int pixelType, const std::string& formatName = std::string(),
+        const std::vector<Option>& options = std::vector<Option>());
+    // The manifest lists one file name per line, or is an ffconcat script whose file lines are used.
+    // Relative names are relative to the directory of the manifest.
+    bool openManifest(const std::string& manifestName, const std::vector<int>& indexes,
+        int sampleType, int pixelType, const std::string& formatName = std::string(),
+        const std::vector<Option>& options = std::vector<Option>());
     bool read(AudioVideoFrame2& frame, int& index);
+    // timeStamp is on the timeline of the whole list
     bool seek(long long int timeStamp, int index);
+    // Properties of the streams of the file being read
     void getProperties(int index, InputStreamProperties& prop);
+    // Index in the list of the file being read
+    int getFileIndex() const;
     void close();
 
 private:
@@ -364,7 +721,56 @@ public:
     AudioVideoWriter3();
     bool open(const std::string& fileName, const std::string& formatName, bool useExternTimeStamp,
         const std::vector<OutputStreamProperties>& props, const std::vector<Option>& options = std::vector<Option>());
+    // Write HLS (TS segments and index.m3u8) or DASH (fragmented mp4 segments and manifest.mpd) 
+    // into directory dirName, segments are segmentDuration seconds long.
+    // The playlist or manifest is replaced by rename, readers never see a partially written one.
+    bool openPackager(const std::string& dirName, int packagerType, double segmentDuration, bool useExternTimeStamp,
+        const std::vector<OutputStreamProperties>& props, const std::vector<Option>& options = std::vector<Option>());
     bool write(const AudioVideoFrame2& frame, int index);
+    // Call before open or openPackager, takes effect until changed.
+    // Video encoders get the zerolatency tune with slice threads, no b frames and no lookahead,
+    // and the muxer writes every packet out at once instead of buffering to interleave streams.
+    // intraRefresh replaces key frames by a column of intra blocks moving across the pictures,
+    // so that no frame is much larger than the others. The key frames openPackager forces at segment
+    // boundaries are then not forced, segments no longer start with a key frame.
+    // StreamStats::latencyNanoSec and maxLatencyNanoSec given by getStats measure the delay.
+    void setLowLatency(bool lowLatency, bool intraRefresh = false);
+    // Whether frames of stream index are encoded without sample or pixel format conversion
+    bool isPassthrough(int index) const;
+    // Could be called from any thread while the writer is opened
+    void getStats(AudioVideoStats& stats) const;
+    void close();
+
+private:
+    struct Impl;
+    std::shared_ptr<Impl> ptrImpl;
+};
+
+// Lock free single producer single consumer fifo of audio samples,
+// planar sample types keep one ring per channel.
+// One thread may call write, getWriteSpan and commitWrite while
+// another thread calls read, peek and drain, init, clear and close are not thread safe.
+class AudioSampleFifo
+{
+public:
+    AudioSampleFifo();
+    bool init(int sampleType, int numChannels, int capacity);
+    // Copy at most numSamples samples into the fifo, return the number of samples written
+    int write(const unsigned char* const* data, int numSamples);
+    // Point data to the contiguous free space at the tail and return its length in samples,
+    // fill it and call commitWrite to make the samples visible to the reader
+    int getWriteSpan(unsigned char* data[8]);
+    void commitWrite(int numSamples);
+    // Copy at most numSamples samples out of the fifo, return the number of samples read
+    int read(unsigned char* data[8], int numSamples);
+    // Point data to the head of the fifo and return the number of contiguous samples
+    // available there, at most numSamples, call drain to release them after use
+    int peek(unsigned char* data[8], int numSamples);
+    void drain(int numSamples);
+    int size() const;
+    int space() const;
+    int capacity() const;
+    void clear();
     void close();
 
 private:
@@ -1,8 +1,114 @@
 #include "AudioVideoProcessorUtil.h"
 #include "FFmpegUtil.h"
 
+#include <atomic>
+#include <stdint.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
 namespace avp
 {
+
+static std::atomic<int> useHugePages(0);
+static const size_t hugePageSize = 2 * 1024 * 1024;
+
+void setUseHugePages(bool use)
+{
+    useHugePages.store(use ? 1 : 0, std::memory_order_relaxed);
+}
+
+// Stored right before the pointer returned by alignedMalloc,
+// mappedSize is zero if the block comes from malloc
+struct AlignedBlockHeader
+{
+    void* base;
+    size_t mappedSize;
+};
+
+static void* allocHugePages(size_t size, size_t* mappedSize)
+{
+#if defined(_WIN32)
+    // Requires the lock pages in memory privilege, fails otherwise
+    size_t largePageSize = GetLargePageMinimum();
+    if (!largePageSize)
+        return 0;
+    size = (size + largePageSize - 1) / largePageSize * largePageSize;
+    void* base = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+#elif defined(__linux__)
+    size = (size + hugePageSize - 1) / hugePageSize * hugePageSize;
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        // No huge pages reserved, ask for transparent huge pages instead
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            return 0;
+#ifdef MADV_HUGEPAGE
+        madvise(base, size, MADV_HUGEPAGE);
+#endif
+    }
+#else
+    void* base = 0;
+#endif
+    if (base)
+        *mappedSize = size;
+    return base;
+}
+
+void* alignedMalloc(size_t size, size_t alignment)
+{
+    if (!size || !alignment || (alignment & (alignment - 1)))
+        return 0;
+    if (alignment < sizeof(void*))
+        alignment = sizeof(void*);
+
+    size_t totalSize = size + alignment + sizeof(AlignedBlockHeader);
+    size_t mappedSize = 0;
+    void* base = 0;
+    if (useHugePages.load(std::memory_order_relaxed) && size >= hugePageSize)
+        base = allocHugePages(totalSize, &mappedSize);
+    if (!base)
+    {
+        base = malloc(totalSize);
+        if (!base)
+            return 0;
+    }
+
+    uintptr_t ptr = ((uintptr_t)base + sizeof(AlignedBlockHeader) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    AlignedBlockHeader* header = (AlignedBlockHeader*)ptr - 1;
+    header->base = base;
+    header->mappedSize = mappedSize;
+    return (void*)ptr;
+}
+
+void alignedFree(void* ptr)
+{
+    if (!ptr)
+        return;
+
+    AlignedBlockHeader* header = (AlignedBlockHeader*)ptr - 1;
+    if (!header->mappedSize)
+        free(header->base);
+    else
+    {
+#if defined(_WIN32)
+        VirtualFree(header->base, 0, MEM_RELEASE);
+#elif defined(__linux__)
+        munmap(header->base, header->mappedSize);
+#endif
+    }
+}
+
 AudioFrameAdaptor::AudioFrameAdaptor()
 {
     clear();
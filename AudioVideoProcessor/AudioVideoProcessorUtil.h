@@ -6,6 +6,12 @@
 namespace avp
 {
 
+// Portable replacement of _aligned_malloc, alignment should be a power of two.
+// Memory must be released by alignedFree.
+void* alignedMalloc(size_t size, size_t alignment);
+
+void alignedFree(void* ptr);
+
 struct AudioFrameAdaptor
 {
     AudioFrameAdaptor();
@@ -1,7 +1,9 @@
 #include "AudioVideoProcessor.h"
+#include "AudioVideoProcessorUtil.h"
 #include "AudioVideoGlobal.h"
 #include "AudioVideoStream.h"
 #include "FFmpegUtil.h"
+#include "AudioVideoTrace.h"
 
 #ifdef __cplusplus
 #define __STDC_CONSTANT_MACROS
@@ -17,6 +19,12 @@ extern "C"
 #ifdef __cplusplus
 }
 #endif
+#include <climits>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 
 static bool contains(const std::vector<int>& arr, int target)
 {
@@ -35,26 +43,120 @@ static bool contains(const std::vector<int>& arr, int target)
 namespace avp
 {
 
+// Where read puts the decoded frames, the internal buffers of the streams by default
+struct ReadTarget
+{
+    ReadTarget() : tensor(0), tensorOptions(0), buffers(0), provider(0), userData(0) {}
+    float* tensor;
+    const TensorOptions* tensorOptions;
+    std::vector<AudioVideoFrame2>* buffers;
+    FrameBufferProviderFunc provider;
+    void* userData;
+};
+
+// Queues of a stream decoded on its own thread, guarded by Impl::parallelMutex
+struct ParallelStream
+{
+    std::thread thread;
+    std::condition_variable decodeCond;
+    std::deque<AVPacket> packets;
+    std::deque<AudioVideoFrame2> frames;
+    // Frames are decoded into these in turn, one more than the queue could hold
+    std::vector<AudioVideoFrame2> pool;
+    int poolIndex;
+    int endOfPackets;
+    int endOfFrames;
+};
+
 struct AudioVideoReader3::Impl
 {
     Impl();
     ~Impl();
     void init();
     bool open(const std::string& fileName, const std::vector<int>& indexes,
-        int sampleType, int pixelType, const std::string& formatName = std::string(),
+        int sampleType, int sampleRate, int channelLayout, const ResampleOptions& resampleOptions,
+        int pixelType, const std::string& formatName = std::string(),
         const std::vector<Option>& options = std::vector<Option>());
-    bool read(AudioVideoFrame2& frame, int& index);
+    // Open fileName into newFmtCtx and check that the streams of indexes could be read
+    static bool openInput(const std::string& fileName, const std::vector<int>& indexes,
+        const std::string& formatName, const std::vector<Option>& options, AVFormatContext*& newFmtCtx);
+    // Open the reader of stream index of fmtCtx with the parameters given to open
+    bool openStream(int index, std::unique_ptr<StreamReader>& stream);
+    bool reopen(const std::string& fileName, const std::string& formatName, const std::vector<Option>& options);
+    bool read(AudioVideoFrame2& frame, int& index, const ReadTarget& target = ReadTarget());
+    // Demux and decode on the calling thread
+    bool readSequential(AudioVideoFrame2& frame, int& index, const ReadTarget& target = ReadTarget());
+    // Returns 1 if a frame of stream index is got, 0 if not yet, negative value on error
+    int decode(int index, AVPacket& pkt, AudioVideoFrame2& frame, const ReadTarget& target);
+    bool readBatch(std::vector<AudioVideoFrame2>& frames, int maxFrames, int index);
+    // Demux the next packet and count it, returns false at the end of the file
+    bool readPacket(AVPacket& pkt);
+    bool readStream(AudioVideoFrame2& frame, int index);
+    bool readRange(long long int beginTimeStamp, long long int endTimeStamp, FrameCallbackFunc callback, void* userData);
+    // Decode pkt of stream index and pass the frame to callback if it is in range, returns 1 if a frame is got,
+    // 0 if not, 2 if callback stops reading, negative value on error
+    int decodeInRange(int index, AVPacket& pkt, long long int beginTimeStamp, long long int endTimeStamp,
+        FrameCallbackFunc callback, void* userData);
     bool seek(long long int timeStamp, int index);
+    bool seekSequential(long long int timeStamp, int index);
     void getProperties(int index, InputStreamProperties& prop);
+    void getStats(AudioVideoStats& stats) const;
     void close();
 
+    void startParallelDecode();
+    void stopParallelDecode();
+    // Start and stop the threads without leaving parallel decode mode
+    void startParallelThreads();
+    void stopParallelThreads();
+    void demuxThreadProc();
+    void decodeThreadProc(int index);
+    // Pop the frame of stream wantedIndex, or of any stream if wantedIndex is negative
+    bool readParallel(AudioVideoFrame2& frame, int& index, int wantedIndex);
+
+    // Kept across close, used by the video streams of each open
+    DecodeAllocator decodeAllocator;
+    // Kept across close, parallel decode is on if positive
+    int maxQueuedFrames;
+    // Kept across close, video streams scale back to their opened size if the decoded size changes
+    int keepVideoSize;
+    int maxQueuedPackets;
+    // Parameters of open, reused by reopen
+    std::vector<int> openIndexes;
+    int openSampleType;
+    int openSampleRate;
+    int openChannelLayout;
+    ResampleOptions openResampleOptions;
+    int openPixelType;
     AVFormatContext* fmtCtx;
     std::vector<std::unique_ptr<StreamReader> > streams;
+    // Held by reopen while it replaces fmtCtx and streams, and by getStats which may run on another thread
+    mutable std::mutex statsMutex;
+    // Demuxed packets of all the streams, including the ones not opened
+    StreamCounters counters;
+    // Buffer of the last batch, reused while the caller holds no frame of it
+    std::shared_ptr<unsigned char> batchData;
+    size_t batchNumBytes;
+    // Buffers got from the provider which no frame has been decoded into yet
+    std::vector<AudioVideoFrame2> providedBuffers;
+    std::vector<int> hasProvidedBuffers;
+    // One demux thread feeds one decoding thread per opened stream
+    std::vector<std::unique_ptr<ParallelStream> > parallelStreams;
+    std::thread demuxThread;
+    std::mutex parallelMutex;
+    std::condition_variable demuxCond;
+    std::condition_variable readCond;
+    // Checked by read without locking, changed only by open, reopen and close
+    std::atomic<int> isParallel;
+    // Guarded by parallelMutex, restartParallel is set while seek restarts the threads
+    int stopParallel;
+    int restartParallel;
     int isOpened;
 };
 
-AudioVideoReader3::Impl::Impl()
+AudioVideoReader3::Impl::Impl() :
+    maxQueuedFrames(0), keepVideoSize(0), maxQueuedPackets(0)
 {
+    isParallel = 0;
     init();
 }
 
@@ -65,15 +167,30 @@ AudioVideoReader3::Impl::~Impl()
 
 void AudioVideoReader3::Impl::init()
 {
+    openIndexes.clear();
+    openSampleType = SampleTypeUnknown;
+    openSampleRate = 0;
+    openChannelLayout = 0;
+    openResampleOptions = ResampleOptions();
+    openPixelType = PixelTypeUnknown;
     fmtCtx = 0;
     streams.clear();
+    counters.clear();
+    batchData.reset();
+    batchNumBytes = 0;
+    providedBuffers.clear();
+    hasProvidedBuffers.clear();
+    parallelStreams.clear();
+    isParallel = 0;
+    stopParallel = 0;
+    restartParallel = 0;
     isOpened = 0;
 }
 
-bool AudioVideoReader3::Impl::open(const std::string& fileName, const std::vector<int>& indexes,
-    int sampleType, int pixelType, const std::string& formatName, const std::vector<Option>& options)
+bool AudioVideoReader3::Impl::openInput(const std::string& fileName, const std::vector<int>& indexes,
+    const std::string& formatName, const std::vector<Option>& options, AVFormatContext*& newFmtCtx)
 {
-    close();
+    newFmtCtx = NULL;
 
     AVInputFormat* inputFormat = av_find_input_format(formatName.c_str());
     if (inputFormat)
@@ -84,10 +201,10 @@ bool AudioVideoReader3::Impl::open(const std::string& fileName, const std::vecto
     AVDictionary* dict = NULL;
     cvtOptions(options, &dict);
 
-    int ret;
+    int numStreams, numIndexes;
 
     /* open input file, and allocate format context */
-    if (avformat_open_input(&fmtCtx, fileName.c_str(), inputFormat, &dict) < 0)
+    if (avformat_open_input(&newFmtCtx, fileName.c_str(), inputFormat, &dict) < 0)
     {
         lprintf("Could not open source file %s\n", fileName.c_str());
         av_dict_free(&dict);
@@ -96,14 +213,14 @@ bool AudioVideoReader3::Impl::open(const std::string& fileName, const std::vecto
     av_dict_free(&dict);
 
     /* retrieve stream information */
-    if (avformat_find_stream_info(fmtCtx, NULL) < 0)
+    if (avformat_find_stream_info(newFmtCtx, NULL) < 0)
     {
         lprintf("Could not find stream information\n");
         goto FAIL;
     }
 
-    int numStreams = fmtCtx->nb_streams;
-    int numIndexes = indexes.size();
+    numStreams = newFmtCtx->nb_streams;
+    numIndexes = indexes.size();
     for (int i = 0; i < numIndexes; i++)
     {
         if (indexes[i] < 0 || indexes[i] >= numStreams)
@@ -111,53 +228,78 @@ bool AudioVideoReader3::Impl::open(const std::string& fileName, const std::vecto
             lprintf("Index out of bound, cannot open corresponding stream\n");
             goto FAIL;
         }
-        int mediaType = fmtCtx->streams[indexes[i]]->codec->codec_type;
+        int mediaType = newFmtCtx->streams[indexes[i]]->codec->codec_type;
         if (mediaType != AVMEDIA_TYPE_VIDEO && mediaType != AVMEDIA_TYPE_AUDIO)
         {
             lprintf("Index corresponds to a non-audio or non-video stream, cannot open it\n");
             goto FAIL;
         }
     }
+    return true;
 
-    for (int i = 0; i < numStreams; i++)
+FAIL:
+    avformat_close_input(&newFmtCtx);
+    return false;
+}
+
+bool AudioVideoReader3::Impl::openStream(int index, std::unique_ptr<StreamReader>& stream)
+{
+    int mediaType = fmtCtx->streams[index]->codec->codec_type;
+    if (mediaType == AVMEDIA_TYPE_AUDIO)
     {
-        streams.push_back(std::unique_ptr<StreamReader>());
-        if (contains(indexes, i))
+        AudioStreamReader* audioStream = new AudioStreamReader;
+        stream.reset((StreamReader*)audioStream);
+        if (!audioStream->open(fmtCtx, index, openSampleType, openSampleRate, openChannelLayout, openResampleOptions))
         {
-            int mediaType = fmtCtx->streams[i]->codec->codec_type;
-            if (mediaType == AVMEDIA_TYPE_AUDIO)
-            {
-                AudioStreamReader* stream = new AudioStreamReader;
-                if (stream->open(fmtCtx, i, sampleType))
-                {
-                    streams.back().reset((StreamReader*)stream);
-                }
-                else
-                {
-                    lprintf("Could not open audio stream for reading.\n");
-                    goto FAIL;
-                }
-            }
-            else if (mediaType == AVMEDIA_TYPE_VIDEO)
-            {
-                VideoStreamReader* stream = new BuiltinCodecVideoStreamReader;
-                if (stream->open(fmtCtx, i, pixelType))
-                {
-                    streams.back().reset((StreamReader*)stream);
-                }
-                else
-                {
-                    lprintf("Could not open video stream for reading.\n");
-                    goto FAIL;
-                }
-            }
+            lprintf("Could not open audio stream for reading.\n");
+            stream.reset();
+            return false;
         }
     }
+    else if (mediaType == AVMEDIA_TYPE_VIDEO)
+    {
+        VideoStreamReader* videoStream = new BuiltinCodecVideoStreamReader;
+        stream.reset((StreamReader*)videoStream);
+        if (!videoStream->open(fmtCtx, index, openPixelType, decodeAllocator, keepVideoSize != 0))
+        {
+            lprintf("Could not open video stream for reading.\n");
+            stream.reset();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool AudioVideoReader3::Impl::open(const std::string& fileName, const std::vector<int>& indexes,
+    int sampleType, int sampleRate, int channelLayout, const ResampleOptions& resampleOptions,
+    int pixelType, const std::string& formatName, const std::vector<Option>& options)
+{
+    close();
+
+    if (!openInput(fileName, indexes, formatName, options, fmtCtx))
+        return false;
+
+    openIndexes = indexes;
+    openSampleType = sampleType;
+    openSampleRate = sampleRate;
+    openChannelLayout = channelLayout;
+    openResampleOptions = resampleOptions;
+    openPixelType = pixelType;
+
+    int numStreams = fmtCtx->nb_streams;
+    for (int i = 0; i < numStreams; i++)
+    {
+        streams.push_back(std::unique_ptr<StreamReader>());
+        if (contains(indexes, i) && !openStream(i, streams.back()))
+            goto FAIL;
+    }
     
     /* dump input information to stderr */
     av_dump_format(fmtCtx, 0, fileName.c_str(), 0);
     
     isOpened = 1;
+    if (maxQueuedFrames > 0)
+        startParallelDecode();
     return true;
 
 FAIL:
@@ -165,13 +307,102 @@ FAIL:
     return false;
 }
 
-bool AudioVideoReader3::Impl::read(AudioVideoFrame2& frame, int& index)
+bool AudioVideoReader3::Impl::reopen(const std::string& fileName, const std::string& formatName,
+    const std::vector<Option>& options)
 {
     if (!isOpened)
+    {
+        lprintf("Error in %s, reader not opened\n", __FUNCTION__);
+        return false;
+    }
+
+    stopParallelDecode();
+
+    AVFormatContext* newFmtCtx = NULL;
+    if (!openInput(fileName, openIndexes, formatName, options, newFmtCtx))
+    {
+        close();
         return false;
+    }
+
+    // Keep the stream readers whose codec parameters match, only the others are opened again
+    int numStreams = newFmtCtx->nb_streams;
+    int numKept = 0, numOpened = 0;
+    std::vector<std::unique_ptr<StreamReader> > newStreams(numStreams);
+    std::unique_lock<std::mutex> statsLock(statsMutex);
+    AVFormatContext* oldFmtCtx = fmtCtx;
+    fmtCtx = newFmtCtx;
+    for (int i = 0; i < numStreams; i++)
+    {
+        if (!contains(openIndexes, i))
+            continue;
+        if (i < (int)streams.size() && streams[i] && streams[i]->switchInput(fmtCtx, i))
+        {
+            newStreams[i] = std::move(streams[i]);
+            numKept++;
+        }
+        else
+        {
+            if (!openStream(i, newStreams[i]))
+            {
+                for (int j = 0; j < numStreams; j++)
+                {
+                    if (newStreams[j])
+                        newStreams[j]->close();
+                }
+                newStreams.clear();
+                fmtCtx = oldFmtCtx;
+                avformat_close_input(&newFmtCtx);
+                statsLock.unlock();
+                close();
+                return false;
+            }
+            numOpened++;
+        }
+    }
+
+    for (int i = 0; i < (int)streams.size(); i++)
+    {
+        if (streams[i])
+            streams[i]->close();
+    }
+    streams.swap(newStreams);
+    avformat_close_input(&oldFmtCtx);
+    statsLock.unlock();
+    // Buffers given to readTo are per stream index of the old file
+    providedBuffers.clear();
+    hasProvidedBuffers.clear();
 
+    lprintf("Reopened with file %s, %d streams kept, %d streams opened again\n", fileName.c_str(), numKept, numOpened);
+    av_dump_format(fmtCtx, 0, fileName.c_str(), 0);
+
+    if (maxQueuedFrames > 0)
+        startParallelDecode();
+    return true;
+}
+
+bool AudioVideoReader3::Impl::read(AudioVideoFrame2& frame, int& index, const ReadTarget& target)
+{
+    if (!isOpened)
+        return false;
+
+    if (isParallel)
+    {
+        if (target.tensor || target.buffers || target.provider)
+        {
+            lprintf("Error in %s, only plain read is supported in parallel decode mode\n", __FUNCTION__);
+            return false;
+        }
+        return readParallel(frame, index, -1);
+    }
+    return readSequential(frame, index, target);
+}
+
+bool AudioVideoReader3::Impl::readSequential(AudioVideoFrame2& frame, int& index, const ReadTarget& target)
+{
+    TraceScope trace("AudioVideoReader3::read");
     AVPacket pkt;
-    int ret, gotFrame;
+    int ret;
     int pktIndex = -1;
 
     /* initialize packet, set data to NULL, let the demuxer fill it */
@@ -182,15 +413,21 @@ bool AudioVideoReader3::Impl::read(AudioVideoFrame2& frame, int& index)
     /* read frames from the file */
     while (true)
     {
-        int readPacketOK = (av_read_frame(fmtCtx, &pkt) >= 0);
-        if (readPacketOK)
+        if (readPacket(pkt))
         {
             pktIndex = pkt.stream_index;
             index = pktIndex;
             if (streams[pktIndex])
             {
-                if (streams[pktIndex]->readFrame(pkt, frame))
+                ret = decode(pktIndex, pkt, frame, target);
+                if (ret < 0)
+                    return false;
+                if (ret > 0)
+                {
+                    trace.streamIndex = pktIndex;
+                    trace.pts = frame.timeStamp;
                     return true;
+                }
             }
             else
                 av_free_packet(&pkt);
@@ -206,8 +443,15 @@ bool AudioVideoReader3::Impl::read(AudioVideoFrame2& frame, int& index)
                 index = i;
                 if (streams[i])
                 {
-                    if (streams[i]->readFrame(pkt, frame))
+                    ret = decode(i, pkt, frame, target);
+                    if (ret < 0)
+                        return false;
+                    if (ret > 0)
+                    {
+                        trace.streamIndex = i;
+                        trace.pts = frame.timeStamp;
                         return true;
+                    }
                 }
             }
             return false;
@@ -217,11 +461,617 @@ bool AudioVideoReader3::Impl::read(AudioVideoFrame2& frame, int& index)
     return false;
 }
 
+int AudioVideoReader3::Impl::decode(int index, AVPacket& pkt, AudioVideoFrame2& frame, const ReadTarget& target)
+{
+    StreamReader* stream = streams[index].get();
+    if (target.tensor)
+        return stream->readTensor(pkt, target.tensor, *target.tensorOptions, frame) ? 1 : 0;
+
+    if (target.buffers)
+    {
+        AudioVideoFrame2& buffer = (*target.buffers)[index];
+        // A buffer which does not fit fails the read instead of looking like a packet without frame
+        if (!stream->fitsBuffer(buffer))
+        {
+            lprintf("Error in %s, buffer does not fit stream %d\n", __FUNCTION__, index);
+            av_free_packet(&pkt);
+            return -1;
+        }
+        if (!stream->readTo(pkt, buffer))
+            return 0;
+        frame = buffer;
+        return 1;
+    }
+
+    if (target.provider)
+    {
+        // A buffer is asked for only when the previous one of the stream has been filled,
+        // packets which give no frame keep it
+        if (!hasProvidedBuffers[index])
+        {
+            if (!target.provider(target.userData, index, providedBuffers[index]))
+            {
+                lprintf("Error in %s, no buffer provided for stream %d\n", __FUNCTION__, index);
+                av_free_packet(&pkt);
+                return -1;
+            }
+            hasProvidedBuffers[index] = 1;
+        }
+        if (!stream->fitsBuffer(providedBuffers[index]))
+        {
+            lprintf("Error in %s, provided buffer does not fit stream %d\n", __FUNCTION__, index);
+            av_free_packet(&pkt);
+            return -1;
+        }
+        if (!stream->readTo(pkt, providedBuffers[index]))
+            return 0;
+        frame = providedBuffers[index];
+        providedBuffers[index] = AudioVideoFrame2();
+        hasProvidedBuffers[index] = 0;
+        return 1;
+    }
+
+    return stream->readFrame(pkt, frame) ? 1 : 0;
+}
+
+bool AudioVideoReader3::Impl::readPacket(AVPacket& pkt)
+{
+    long long int beginTime = getNanoSecCount();
+    int readPacketOK = (av_read_frame(fmtCtx, &pkt) >= 0);
+    long long int demuxTime = getNanoSecCount() - beginTime;
+    addCounter(counters.demuxNanoSec, demuxTime);
+    if (!readPacketOK)
+        return false;
+
+    addCounter(counters.numPackets, 1);
+    addCounter(counters.numBytes, pkt.size);
+    if (streams[pkt.stream_index])
+    {
+        StreamCounters& streamCounters = streams[pkt.stream_index]->counters;
+        addCounter(streamCounters.demuxNanoSec, demuxTime);
+        addCounter(streamCounters.numPackets, 1);
+        addCounter(streamCounters.numBytes, pkt.size);
+    }
+    return true;
+}
+
+bool AudioVideoReader3::Impl::readBatch(std::vector<AudioVideoFrame2>& frames, int maxFrames, int index)
+{
+    // Release the frames of the previous batch first, so that its buffer could be reused
+    frames.clear();
+    if (!isOpened)
+        return false;
+
+    if (isParallel)
+    {
+        lprintf("Error in %s, batches are not supported in parallel decode mode\n", __FUNCTION__);
+        return false;
+    }
+
+    int numStreams = fmtCtx->nb_streams;
+    if (index < 0 || index >= numStreams || !streams[index] ||
+        fmtCtx->streams[index]->codec->codec_type != AVMEDIA_TYPE_VIDEO || maxFrames <= 0)
+    {
+        lprintf("Error in %s, stream %d is not an opened video stream\n", __FUNCTION__, index);
+        return false;
+    }
+
+    TraceScope trace("AudioVideoReader3::readBatch", index);
+    InputStreamProperties prop;
+    streams[index]->getProperties(prop);
+    AVPixelFormat pixFmt = getAVPixelFormat(prop.pixelType);
+    int frameNumBytes = av_image_get_buffer_size(pixFmt, prop.width, prop.height, 1);
+    if (frameNumBytes <= 0)
+    {
+        lprintf("Error in %s, could not compute frame size\n", __FUNCTION__);
+        return false;
+    }
+
+    // A large maxFrames must not wrap the size around to a small buffer the frames overrun
+    long long int totalNumBytes = (long long int)frameNumBytes * maxFrames;
+    if (totalNumBytes > INT_MAX)
+    {
+        lprintf("Error in %s, batch of %d frames of %d bytes is too large\n", __FUNCTION__, maxFrames, frameNumBytes);
+        return false;
+    }
+    size_t numBytes = (size_t)totalNumBytes;
+    if (!batchData || batchData.use_count() > 1 || batchNumBytes < numBytes)
+    {
+        batchData.reset((unsigned char*)alignedMalloc(numBytes, 64), alignedFree);
+        batchNumBytes = batchData ? numBytes : 0;
+        if (!batchData)
+        {
+            lprintf("Error in %s, could not allocate batch buffer\n", __FUNCTION__);
+            return false;
+        }
+    }
+
+    frames.reserve(maxFrames);
+    AudioVideoFrame2 frame;
+    frame.sdata = batchData;
+    frame.mediaType = VIDEO;
+    frame.pixelType = prop.pixelType;
+    frame.width = prop.width;
+    frame.height = prop.height;
+
+    AVPacket pkt;
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+    int reachEnd = 0;
+    while (frames.size() < (size_t)maxFrames)
+    {
+        av_image_fill_arrays(frame.data, frame.steps, batchData.get() + frames.size() * frameNumBytes,
+            pixFmt, prop.width, prop.height, 1);
+        if (!reachEnd && readPacket(pkt))
+        {
+            // NOTICE!!!
+            // Packets of the other streams are dropped
+            if (pkt.stream_index != index)
+            {
+                av_free_packet(&pkt);
+                continue;
+            }
+            if (streams[index]->readTo(pkt, frame))
+            {
+                frames.push_back(frame);
+                // Frames after a change of size do not fit in this batch
+                if (frame.flags & FrameFlagFormatChanged)
+                    break;
+            }
+        }
+        else
+        {
+            // Drain the frames the decoder holds
+            reachEnd = 1;
+            av_init_packet(&pkt);
+            pkt.data = NULL;
+            pkt.size = 0;
+            if (!streams[index]->readTo(pkt, frame))
+                break;
+            frames.push_back(frame);
+            if (frame.flags & FrameFlagFormatChanged)
+                break;
+        }
+    }
+
+    if (!frames.empty())
+        trace.pts = frames[0].timeStamp;
+    return !frames.empty();
+}
+
+bool AudioVideoReader3::Impl::readStream(AudioVideoFrame2& frame, int index)
+{
+    if (!isOpened || index < 0 || index >= (int)streams.size() || !streams[index])
+        return false;
+
+    int streamIndex;
+    if (isParallel)
+        return readParallel(frame, streamIndex, index);
+
+    while (read(frame, streamIndex))
+    {
+        if (streamIndex == index)
+            return true;
+    }
+    return false;
+}
+
+void AudioVideoReader3::Impl::startParallelDecode()
+{
+    startParallelThreads();
+    isParallel = 1;
+}
+
+void AudioVideoReader3::Impl::stopParallelDecode()
+{
+    if (!isParallel)
+        return;
+
+    stopParallelThreads();
+    isParallel = 0;
+}
+
+void AudioVideoReader3::Impl::startParallelThreads()
+{
+    int numStreams = streams.size();
+    std::vector<std::unique_ptr<ParallelStream> > newStreams(numStreams);
+    for (int i = 0; i < numStreams; i++)
+    {
+        if (!streams[i])
+            continue;
+        ParallelStream* ps = new ParallelStream;
+        ps->pool.resize(maxQueuedFrames + 1);
+        ps->poolIndex = 0;
+        ps->endOfPackets = 0;
+        ps->endOfFrames = 0;
+        newStreams[i].reset(ps);
+    }
+    {
+        // Readers of other threads may be waiting in readParallel
+        std::lock_guard<std::mutex> lg(parallelMutex);
+        parallelStreams.swap(newStreams);
+        // Packets are small, more of them are allowed so that a decoder is rarely starved
+        maxQueuedPackets = FFMAX(maxQueuedFrames * 2, 16);
+        stopParallel = 0;
+    }
+    for (int i = 0; i < numStreams; i++)
+    {
+        if (parallelStreams[i])
+            parallelStreams[i]->thread = std::thread(&Impl::decodeThreadProc, this, i);
+    }
+    demuxThread = std::thread(&Impl::demuxThreadProc, this);
+}
+
+void AudioVideoReader3::Impl::stopParallelThreads()
+{
+    {
+        std::lock_guard<std::mutex> lg(parallelMutex);
+        stopParallel = 1;
+    }
+    demuxCond.notify_all();
+    readCond.notify_all();
+    // Only this thread changes parallelStreams, so it is read here without locking
+    int numStreams = parallelStreams.size();
+    for (int i = 0; i < numStreams; i++)
+    {
+        if (parallelStreams[i])
+            parallelStreams[i]->decodeCond.notify_all();
+    }
+
+    if (demuxThread.joinable())
+        demuxThread.join();
+    for (int i = 0; i < numStreams; i++)
+    {
+        ParallelStream* ps = parallelStreams[i].get();
+        if (!ps)
+            continue;
+        if (ps->thread.joinable())
+            ps->thread.join();
+        while (!ps->packets.empty())
+        {
+            av_free_packet(&ps->packets.front());
+            ps->packets.pop_front();
+        }
+        streams[i]->counters.queueDepth.store(0, std::memory_order_relaxed);
+    }
+
+    std::lock_guard<std::mutex> lg(parallelMutex);
+    parallelStreams.clear();
+}
+
+void AudioVideoReader3::Impl::demuxThreadProc()
+{
+    while (true)
+    {
+        AVPacket pkt;
+        av_init_packet(&pkt);
+        pkt.data = NULL;
+        pkt.size = 0;
+        if (!readPacket(pkt))
+            break;
+
+        int index = pkt.stream_index;
+        if (!streams[index])
+        {
+            av_free_packet(&pkt);
+            continue;
+        }
+        // The demuxer may reuse the data of the packet at the next av_read_frame
+        if (av_dup_packet(&pkt) < 0)
+        {
+            lprintf("Error in %s, could not keep packet of stream %d\n", __FUNCTION__, index);
+            av_free_packet(&pkt);
+            continue;
+        }
+
+        ParallelStream* ps = parallelStreams[index].get();
+        std::unique_lock<std::mutex> ul(parallelMutex);
+        demuxCond.wait(ul, [&] { return stopParallel || ps->packets.size() < (size_t)maxQueuedPackets; });
+        if (stopParallel)
+        {
+            av_free_packet(&pkt);
+            return;
+        }
+        ps->packets.push_back(pkt);
+        ps->decodeCond.notify_one();
+    }
+
+    std::lock_guard<std::mutex> lg(parallelMutex);
+    int numStreams = parallelStreams.size();
+    for (int i = 0; i < numStreams; i++)
+    {
+        if (parallelStreams[i])
+        {
+            parallelStreams[i]->endOfPackets = 1;
+            parallelStreams[i]->decodeCond.notify_one();
+        }
+    }
+}
+
+void AudioVideoReader3::Impl::decodeThreadProc(int index)
+{
+    ParallelStream* ps = parallelStreams[index].get();
+    StreamReader* stream = streams[index].get();
+    InputStreamProperties prop;
+    stream->getProperties(prop);
+    int isVideo = prop.mediaType == VIDEO;
+    while (true)
+    {
+        AVPacket pkt;
+        av_init_packet(&pkt);
+        pkt.data = NULL;
+        pkt.size = 0;
+        int flush = 0;
+        AudioVideoFrame2* slot;
+        {
+            // Wait for room in the frame queue before taking a packet, so that at most
+            // maxQueuedFrames frames of this stream are held besides the ones the caller keeps
+            std::unique_lock<std::mutex> ul(parallelMutex);
+            ps->decodeCond.wait(ul, [&] { return stopParallel ||
+                (ps->frames.size() < (size_t)maxQueuedFrames && (!ps->packets.empty() || ps->endOfPackets)); });
+            if (stopParallel)
+                return;
+            if (!ps->packets.empty())
+            {
+                pkt = ps->packets.front();
+                ps->packets.pop_front();
+                demuxCond.notify_one();
+            }
+            else
+                flush = 1;
+
+            // The oldest frame of the pool is not in the queue, a new one is made if the caller still holds it
+            slot = &ps->pool[ps->poolIndex];
+            ps->poolIndex = (ps->poolIndex + 1) % ps->pool.size();
+            if (slot->sdata.use_count() > 1)
+                *slot = AudioVideoFrame2();
+        }
+
+        TraceScope trace("AudioVideoReader3::decode", index);
+        bool gotFrame;
+        if (isVideo)
+        {
+            // Decode and convert straight into the slot
+            slot->create(prop.pixelType, prop.width, prop.height);
+            gotFrame = stream->readTo(pkt, *slot);
+            // Later slots take the size after the change
+            if (gotFrame && (slot->flags & FrameFlagFormatChanged))
+                stream->getProperties(prop);
+        }
+        else
+        {
+            AudioVideoFrame2 header;
+            gotFrame = stream->readFrame(pkt, header) && header.copyTo(*slot);
+        }
+
+        std::lock_guard<std::mutex> lg(parallelMutex);
+        if (gotFrame)
+        {
+            trace.pts = slot->timeStamp;
+            ps->frames.push_back(*slot);
+            stream->counters.queueDepth.store(ps->frames.size(), std::memory_order_relaxed);
+            readCond.notify_all();
+        }
+        else
+        {
+            // The slot is not used
+            ps->poolIndex = (ps->poolIndex + ps->pool.size() - 1) % ps->pool.size();
+            if (flush)
+            {
+                ps->endOfFrames = 1;
+                readCond.notify_all();
+                return;
+            }
+        }
+    }
+}
+
+bool AudioVideoReader3::Impl::readParallel(AudioVideoFrame2& frame, int& index, int wantedIndex)
+{
+    std::unique_lock<std::mutex> ul(parallelMutex);
+    while (true)
+    {
+        // A seek of another thread restarts the decoding threads, the frames after it are read
+        if (stopParallel || restartParallel)
+        {
+            if (!restartParallel)
+                return false;
+            readCond.wait(ul);
+            continue;
+        }
+
+        // Among the streams with frames ready, take the earliest one
+        int readyIndex = -1, numRunning = 0;
+        int numStreams = parallelStreams.size();
+        for (int i = 0; i < numStreams; i++)
+        {
+            ParallelStream* ps = parallelStreams[i].get();
+            if (!ps || (wantedIndex >= 0 && i != wantedIndex))
+                continue;
+            if (!ps->frames.empty())
+            {
+                if (readyIndex < 0 ||
+                    ps->frames.front().timeStamp < parallelStreams[readyIndex]->frames.front().timeStamp)
+                    readyIndex = i;
+            }
+            else if (!ps->endOfFrames)
+                numRunning++;
+        }
+
+        if (readyIndex >= 0)
+        {
+            ParallelStream* ps = parallelStreams[readyIndex].get();
+            frame = ps->frames.front();
+            ps->frames.pop_front();
+            streams[readyIndex]->counters.queueDepth.store(ps->frames.size(), std::memory_order_relaxed);
+            ps->decodeCond.notify_one();
+            index = readyIndex;
+            return true;
+        }
+        if (!numRunning)
+            return false;
+        readCond.wait(ul);
+    }
+}
+
+int AudioVideoReader3::Impl::decodeInRange(int index, AVPacket& pkt, long long int beginTimeStamp, long long int endTimeStamp,
+    FrameCallbackFunc callback, void* userData)
+{
+    StreamReader* stream = streams[index].get();
+    AudioVideoFrame2 frame;
+    if (fmtCtx->streams[index]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+    {
+        long long int timeStamp;
+        int ret = stream->decodeOnly(pkt, timeStamp);
+        if (ret <= 0)
+            return ret;
+        // Frames from the key frame up to beginTimeStamp, and frames reordered past endTimeStamp
+        if (timeStamp >= 0 && (timeStamp < beginTimeStamp || timeStamp >= endTimeStamp))
+            return 1;
+        if (!stream->convertDecoded(frame))
+            return -1;
+    }
+    else
+    {
+        // Audio frames are converted while decoding, and the one before beginTimeStamp is needed
+        // by codecs whose frames overlap, so they are decoded as usual and trimmed here
+        if (!stream->readFrame(pkt, frame))
+            return 0;
+        InputStreamProperties prop;
+        stream->getProperties(prop);
+        long long int frameEndTimeStamp = frame.timeStamp + 
+            (prop.sampleRate > 0 ? frame.numSamples * 1000000LL / prop.sampleRate : 0);
+        if (frame.timeStamp >= 0 && (frameEndTimeStamp <= beginTimeStamp || frame.timeStamp >= endTimeStamp))
+            return 1;
+    }
+    return callback(userData, index, frame) ? 1 : 2;
+}
+
+bool AudioVideoReader3::Impl::readRange(long long int beginTimeStamp, long long int endTimeStamp,
+    FrameCallbackFunc callback, void* userData)
+{
+    if (!isOpened)
+        return false;
+
+    if (isParallel)
+    {
+        lprintf("Error in %s, ranges are not supported in parallel decode mode\n", __FUNCTION__);
+        return false;
+    }
+
+    if (!callback || endTimeStamp <= beginTimeStamp)
+    {
+        lprintf("Error in %s, invalid callback or range\n", __FUNCTION__);
+        return false;
+    }
+
+    TraceScope trace("AudioVideoReader3::readRange", -1, beginTimeStamp);
+    int numStreams = fmtCtx->nb_streams;
+    int numOpened = 0, seekIndex = -1;
+    for (int i = 0; i < numStreams; i++)
+    {
+        if (!streams[i])
+            continue;
+        numOpened++;
+        if (seekIndex < 0 && fmtCtx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+            seekIndex = i;
+    }
+
+    // Land on the key frame of the video stream before beginTimeStamp, so that it is decoded only once
+    long long int seekTimeStamp = seekIndex < 0 ? beginTimeStamp :
+        av_rescale_q(beginTimeStamp, avrational(1, AV_TIME_BASE), fmtCtx->streams[seekIndex]->time_base);
+    if (av_seek_frame(fmtCtx, seekIndex, seekTimeStamp, AVSEEK_FLAG_BACKWARD) < 0)
+    {
+        lprintf("Error in %s, could not seek to %lld\n", __FUNCTION__, beginTimeStamp);
+        return false;
+    }
+    for (int i = 0; i < numStreams; i++)
+    {
+        if (streams[i])
+            streams[i]->flushBuffer();
+    }
+
+    AVPacket pkt;
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+    std::vector<int> ended(numStreams, 0);
+    int numEnded = 0;
+    int ret = 1;
+    while (numEnded < numOpened && readPacket(pkt))
+    {
+        int index = pkt.stream_index;
+        if (!streams[index] || ended[index])
+        {
+            av_free_packet(&pkt);
+            continue;
+        }
+
+        // Decoding time stamps only grow, so no later packet of the stream has a frame in range
+        AVStream* stream = fmtCtx->streams[index];
+        long long int pktTimeStamp = pkt.dts != AV_NOPTS_VALUE ? pkt.dts : pkt.pts;
+        if (pktTimeStamp != AV_NOPTS_VALUE &&
+            av_rescale_q(pktTimeStamp, stream->time_base, avrational(1, AV_TIME_BASE)) >= endTimeStamp)
+        {
+            ended[index] = 1;
+            numEnded++;
+            av_free_packet(&pkt);
+            continue;
+        }
+
+        ret = decodeInRange(index, pkt, beginTimeStamp, endTimeStamp, callback, userData);
+        if (ret < 0 || ret == 2)
+            return ret == 2;
+    }
+
+    // Frames of the range may still be held by the decoders
+    for (int i = 0; i < numStreams; i++)
+    {
+        if (!streams[i])
+            continue;
+        do
+        {
+            av_init_packet(&pkt);
+            pkt.data = NULL;
+            pkt.size = 0;
+            ret = decodeInRange(i, pkt, beginTimeStamp, endTimeStamp, callback, userData);
+            if (ret < 0 || ret == 2)
+                return ret == 2;
+        } while (ret > 0);
+        // The decoder has been drained, it takes new packets only after flushing
+        streams[i]->flushBuffer();
+    }
+    return true;
+}
+
 bool AudioVideoReader3::Impl::seek(long long int timeStamp, int index)
 {
     if (!isOpened)
         return false;
 
+    // Seek with the threads stopped, the decoders are flushed anyway
+    if (isParallel)
+    {
+        {
+            std::lock_guard<std::mutex> lg(parallelMutex);
+            restartParallel = 1;
+        }
+        stopParallelThreads();
+        bool ok = seekSequential(timeStamp, index);
+        startParallelThreads();
+        {
+            std::lock_guard<std::mutex> lg(parallelMutex);
+            restartParallel = 0;
+        }
+        readCond.notify_all();
+        return ok;
+    }
+    return seekSequential(timeStamp, index);
+}
+
+bool AudioVideoReader3::Impl::seekSequential(long long int timeStamp, int index)
+{
     int numStreams = fmtCtx->nb_streams;
     if (index < 0 || index >= numStreams)
         return false;
@@ -236,7 +1086,7 @@ bool AudioVideoReader3::Impl::seek(long long int timeStamp, int index)
     // that whether a single frame has been read from a specific stream
     int streamIndex;
     AudioVideoFrame2 frame;
-    while (read(frame, streamIndex))
+    while (readSequential(frame, streamIndex))
     {
         if (index == streamIndex)
             break;
@@ -263,7 +1113,7 @@ bool AudioVideoReader3::Impl::seek(long long int timeStamp, int index)
     for (int i = 0; i < numStreams; i++)
     {
         if (streams[i])
-            avcodec_flush_buffers(fmtCtx->streams[i]->codec);
+            streams[i]->flushBuffer();
     }
 
     if (stream->codec->codec_type == AVMEDIA_TYPE_AUDIO)
@@ -281,7 +1131,7 @@ bool AudioVideoReader3::Impl::seek(long long int timeStamp, int index)
         {
             AudioVideoFrame2 frame;
             int streamIndex;
-            if (!read(frame, streamIndex))
+            if (!readSequential(frame, streamIndex))
             {
                 lprintf("Error, seeking in video stream failed, maybe cannot find target frame when file end met\n");
                 return false;
@@ -308,7 +1158,7 @@ bool AudioVideoReader3::Impl::seek(long long int timeStamp, int index)
             for (int i = 0; i < numStreams; i++)
             {
                 if (streams[i])
-                    avcodec_flush_buffers(fmtCtx->streams[i]->codec);
+                    streams[i]->flushBuffer();
             }
             // NOTICE!!!
             // After calling av_seek_frame, the file handle may not directly point to video stream.
@@ -318,7 +1168,7 @@ bool AudioVideoReader3::Impl::seek(long long int timeStamp, int index)
             {
                 AudioVideoFrame2 frame;
                 int streamIndex;
-                read(frame, streamIndex);
+                readSequential(frame, streamIndex);
                 if (frame.mediaType == VIDEO && streamIndex == index)
                     i++;
             }
@@ -353,8 +1203,37 @@ void AudioVideoReader3::Impl::getProperties(int index, InputStreamProperties& pr
     streams[index]->getProperties(prop);
 }
 
+void AudioVideoReader3::Impl::getStats(AudioVideoStats& stats) const
+{
+    stats = AudioVideoStats();
+    if (!isOpened)
+        return;
+
+    counters.get(stats.total);
+    std::lock_guard<std::mutex> lg(statsMutex);
+    int numStreams = streams.size();
+    stats.streams.resize(numStreams);
+    for (int i = 0; i < numStreams; i++)
+    {
+        StreamStats& curr = stats.streams[i];
+        int mediaType = fmtCtx->streams[i]->codec->codec_type;
+        curr.mediaType = mediaType == AVMEDIA_TYPE_AUDIO ? AUDIO : (mediaType == AVMEDIA_TYPE_VIDEO ? VIDEO : UNKNOWN);
+        if (!streams[i])
+            continue;
+
+        streams[i]->counters.get(curr);
+        stats.total.numFrames += curr.numFrames;
+        stats.total.numDroppedFrames += curr.numDroppedFrames;
+        stats.total.queueDepth += curr.queueDepth;
+        stats.total.decodeNanoSec += curr.decodeNanoSec;
+        stats.total.convertNanoSec += curr.convertNanoSec;
+    }
+}
+
 void AudioVideoReader3::Impl::close()
 {
+    stopParallelDecode();
+
     int size = streams.size();
     for (int i = 0; i < size; i++)
     {
@@ -386,6 +1265,7 @@ void AudioVideoReader3::getStreamProperties(const std::string& fileName, std::ve
     cvtOptions(options, &dict);
 
     AVFormatContext* fmtCtx = NULL;
+    int numStreams;
     /* open input file, and allocate format context */
     if (avformat_open_input(&fmtCtx, fileName.c_str(), inputFormat, &dict) < 0)
     {
@@ -400,7 +1280,7 @@ void AudioVideoReader3::getStreamProperties(const std::string& fileName, std::ve
         goto END;
     }
 
-    int numStreams = fmtCtx->nb_streams;
+    numStreams = fmtCtx->nb_streams;
     for (int i = 0; i < numStreams; i++)
     {
         AVStream* s = fmtCtx->streams[i];
@@ -412,7 +1292,7 @@ void AudioVideoReader3::getStreamProperties(const std::string& fileName, std::ve
         }
         else if (c->codec_type == AVMEDIA_TYPE_VIDEO)
         {
-            props.push_back(InputStreamProperties(s->nb_frames, c->pix_fmt, c->width, c->height,
+            props.push_back(InputStreamProperties(s->nb_frames, getPixelType(c->pix_fmt), c->width, c->height,
                 av_q2d(s->r_frame_rate)));
         }
         else
@@ -432,7 +1312,23 @@ AudioVideoReader3::AudioVideoReader3()
 bool AudioVideoReader3::open(const std::string& fileName, const std::vector<int>& indexes, int sampleType, int pixelType,
     const std::string& formatName, const std::vector<Option>& options)
 {
-    return ptrImpl->open(fileName, indexes, sampleType, pixelType, formatName, options);
+    initFFMPEG();
+    return ptrImpl->open(fileName, indexes, sampleType, 0, 0, ResampleOptions(), pixelType, formatName, options);
+}
+
+bool AudioVideoReader3::open(const std::string& fileName, const std::vector<int>& indexes,
+    int sampleType, int sampleRate, int channelLayout, const ResampleOptions& resampleOptions,
+    int pixelType, const std::string& formatName, const std::vector<Option>& options)
+{
+    initFFMPEG();
+    return ptrImpl->open(fileName, indexes, sampleType, sampleRate, channelLayout, resampleOptions, 
+        pixelType, formatName, options);
+}
+
+bool AudioVideoReader3::reopen(const std::string& fileName, const std::string& formatName,
+    const std::vector<Option>& options)
+{
+    return ptrImpl->reopen(fileName, formatName, options);
 }
 
 bool AudioVideoReader3::read(AudioVideoFrame2& frame, int& index)
@@ -440,6 +1336,74 @@ bool AudioVideoReader3::read(AudioVideoFrame2& frame, int& index)
     return ptrImpl->read(frame, index);
 }
 
+bool AudioVideoReader3::readTensor(AudioVideoFrame2& frame, int& index, float* tensor, const TensorOptions& options)
+{
+    if (!tensor || options.width <= 0 || options.height <= 0)
+    {
+        lprintf("Error in %s, tensor not satisfied\n", __FUNCTION__);
+        return false;
+    }
+    ReadTarget target;
+    target.tensor = tensor;
+    target.tensorOptions = &options;
+    return ptrImpl->read(frame, index, target);
+}
+
+bool AudioVideoReader3::readTo(std::vector<AudioVideoFrame2>& buffers, int& index)
+{
+    if (!ptrImpl->isOpened || buffers.size() != ptrImpl->streams.size())
+    {
+        lprintf("Error in %s, one buffer per stream of the file required\n", __FUNCTION__);
+        return false;
+    }
+    ReadTarget target;
+    target.buffers = &buffers;
+    AudioVideoFrame2 frame;
+    return ptrImpl->read(frame, index, target);
+}
+
+bool AudioVideoReader3::readTo(FrameBufferProviderFunc provider, void* userData, AudioVideoFrame2& frame, int& index)
+{
+    if (!ptrImpl->isOpened || !provider)
+        return false;
+    size_t numStreams = ptrImpl->streams.size();
+    if (ptrImpl->providedBuffers.size() != numStreams)
+    {
+        ptrImpl->providedBuffers.assign(numStreams, AudioVideoFrame2());
+        ptrImpl->hasProvidedBuffers.assign(numStreams, 0);
+    }
+    ReadTarget target;
+    target.provider = provider;
+    target.userData = userData;
+    return ptrImpl->read(frame, index, target);
+}
+
+bool AudioVideoReader3::readBatch(std::vector<AudioVideoFrame2>& frames, int maxFrames, int index)
+{
+    return ptrImpl->readBatch(frames, maxFrames, index);
+}
+
+bool AudioVideoReader3::readStream(AudioVideoFrame2& frame, int index)
+{
+    return ptrImpl->readStream(frame, index);
+}
+
+bool AudioVideoReader3::readRange(long long int beginTimeStamp, long long int endTimeStamp,
+    FrameCallbackFunc callback, void* userData)
+{
+    return ptrImpl->readRange(beginTimeStamp, endTimeStamp, callback, userData);
+}
+
+void AudioVideoReader3::setParallelDecode(int maxQueuedFrames)
+{
+    ptrImpl->maxQueuedFrames = maxQueuedFrames > 0 ? maxQueuedFrames : 0;
+}
+
+void AudioVideoReader3::setKeepVideoSize(bool keep)
+{
+    ptrImpl->keepVideoSize = keep ? 1 : 0;
+}
+
 bool AudioVideoReader3::seek(long long int timeStamp, int index)
 {
     return ptrImpl->seek(timeStamp, index);
@@ -450,6 +1414,30 @@ void AudioVideoReader3::getProperties(int index, InputStreamProperties& prop)
     ptrImpl->getProperties(index, prop);
 }
 
+long long int AudioVideoReader3::getStartTime() const
+{
+    if (!ptrImpl->isOpened || ptrImpl->fmtCtx->start_time == AV_NOPTS_VALUE)
+        return -1;
+    return ptrImpl->fmtCtx->start_time;
+}
+
+long long int AudioVideoReader3::getDuration() const
+{
+    if (!ptrImpl->isOpened || ptrImpl->fmtCtx->duration == AV_NOPTS_VALUE)
+        return -1;
+    return ptrImpl->fmtCtx->duration;
+}
+
+void AudioVideoReader3::getStats(AudioVideoStats& stats) const
+{
+    ptrImpl->getStats(stats);
+}
+
+void AudioVideoReader3::setDecodeAllocator(const DecodeAllocator& allocator)
+{
+    ptrImpl->decodeAllocator = allocator;
+}
+
 void AudioVideoReader3::close()
 {
     ptrImpl->close();
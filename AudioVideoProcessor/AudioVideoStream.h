@@ -2,13 +2,16 @@
 
 #include "AudioVideoProcessor.h"
 #include "AudioVideoProcessorUtil.h"
+#include "FFmpegUtil.h"
 
 #ifdef __cplusplus
 #define __STDC_CONSTANT_MACROS
 extern "C"
 {
 #endif
+#ifdef _WIN32
 #define snprintf sprintf_s
+#endif
 #include <libavutil/error.h>
 #include <libavutil/imgutils.h>
 #include <libavutil/samplefmt.h>
@@ -21,6 +24,7 @@ extern "C"
 #endif
 #include <memory>
 #include <thread>
+#include <deque>
 
 namespace avp
 {
@@ -30,9 +34,24 @@ struct StreamReader
     virtual ~StreamReader() {};
     virtual bool readFrame(AVPacket& packet, AudioVideoFrame2& frame) { return false; };
     virtual bool readTo(AVPacket& packet, AudioVideoFrame2& frame) { return false; };
+    // Whether readTo can write into frame, streams without readTo fit no buffer
+    virtual bool fitsBuffer(const AudioVideoFrame2& frame) { return false; };
+    // Video streams write the picture into tensor, other streams read frames as readFrame
+    virtual bool readTensor(AVPacket& packet, float* tensor, const TensorOptions& options, AudioVideoFrame2& frame)
+    { return readFrame(packet, frame); };
+    // Decode without converting, timeStamp is that of the decoded frame. Returns 1 if a frame is got, 0 if not,
+    // and -1 if the stream could not decode without converting.
+    virtual int decodeOnly(AVPacket& packet, long long int& timeStamp);
+    // Convert the frame got by decodeOnly, frame is as readFrame gives it
+    virtual bool convertDecoded(AudioVideoFrame2& frame) { return false; };
     virtual void flushBuffer() {};
+    // Go on with stream index of another file, keeping the decoder and the conversion contexts.
+    // Returns false and leaves the reader as it is if the codec parameters of the stream differ.
+    virtual bool switchInput(AVFormatContext* fmtCtx, int index) { return false; };
     virtual void getProperties(InputStreamProperties& prop) { prop = InputStreamProperties(); };
     virtual void close() {};
+
+    StreamCounters counters;
 };
 
 struct AudioStreamReader : public StreamReader
@@ -40,52 +59,72 @@ struct AudioStreamReader : public StreamReader
     AudioStreamReader();
     ~AudioStreamReader();
     void init();
-    bool open(AVFormatContext* fmtCtx, int index, int sampleType);
+    bool open(AVFormatContext* fmtCtx, int index, int sampleType, int sampleRate = 0, int channelLayout = 0,
+        const ResampleOptions& resampleOptions = ResampleOptions());
     bool readFrame(AVPacket& packet, AudioVideoFrame2& frame);
     bool readTo(AVPacket& packet, AudioVideoFrame2& frame);
+    bool fitsBuffer(const AudioVideoFrame2& frame);
     void flushBuffer();
+    bool switchInput(AVFormatContext* fmtCtx, int index);
     void getProperties(InputStreamProperties& prop);
     void close();
 
     AVFormatContext* fmtCtx;
     AVStream* stream;
     int streamIndex;
+    // Copied from stream->codec, so that it can outlive fmtCtx
     AVCodecContext* decCtx;
     AVFrame* frame;
     int numFrames;
     int numSamples;
     AVSampleFormat origSampleFormat;
+    int origSampleRate;
+    int origNumChannels;
+    int origChannelLayout;
     int sampleType;
     int numChannels;
     int channelLayout;
     int sampleRate;
     unsigned char* sampleData[8];
     int sampleLineSize;
+    int sampleCapacity;
     SwrContext* swrCtx;
 };
 
 struct VideoStreamReader : public StreamReader
 {
     virtual ~VideoStreamReader() {};
-    virtual bool open(AVFormatContext* fmtCtx, int index, int pixelType) { return false; };
+    virtual bool open(AVFormatContext* fmtCtx, int index, int pixelType,
+        const DecodeAllocator& allocator = DecodeAllocator(), bool keepSize = false) { return false; };
     virtual bool readFrame(AVPacket& packet, AudioVideoFrame2& frame) { return false; };
     virtual bool readTo(AVPacket& packet, AudioVideoFrame2& frame) { return false; };
     virtual void flushBuffer() {};
+    virtual bool switchInput(AVFormatContext* fmtCtx, int index) { return false; };
     virtual void getProperties(InputStreamProperties& prop) {};
     virtual void close() {};
 
     AVFormatContext* fmtCtx;
     AVStream* stream;
     int streamIndex;
+    // Copied from stream->codec, so that it can outlive fmtCtx
     AVCodecContext* decCtx;
+    // Size of the output pictures
     int width, height;
+    // Size and format of the decoded pictures, which may change in the middle of the stream
+    int origWidth, origHeight;
     AVPixelFormat origPixelFormat;
+    // Scale the pictures back to width and height when the decoded size changes
+    int keepSize;
     int pixelType;
     double frameRate;
     int numFrames;
     unsigned char* pixelData[4];
     int pixelLinesize[4];
     SwsContext* swsCtx;
+    // Convert with fastColorConvert instead of swsCtx
+    int fastConvert;
+    int colorMatrix;
+    int colorFullRange;
 };
 
 struct BuiltinCodecVideoStreamReader : public VideoStreamReader
@@ -93,21 +132,52 @@ struct BuiltinCodecVideoStreamReader : public VideoStreamReader
     BuiltinCodecVideoStreamReader();
     ~BuiltinCodecVideoStreamReader();
     void init();
-    bool open(AVFormatContext* fmtCtx, int index, int pixelType);
+    bool open(AVFormatContext* fmtCtx, int index, int pixelType,
+        const DecodeAllocator& allocator = DecodeAllocator(), bool keepSize = false);
     bool readFrame(AVPacket& packet, AudioVideoFrame2& frame);
     bool readTo(AVPacket& packet, AudioVideoFrame2& frame);
+    bool fitsBuffer(const AudioVideoFrame2& frame);
+    bool readTensor(AVPacket& packet, float* tensor, const TensorOptions& options, AudioVideoFrame2& frame);
+    int decodeOnly(AVPacket& packet, long long int& timeStamp);
+    bool convertDecoded(AudioVideoFrame2& frame);
     void flushBuffer();
+    bool switchInput(AVFormatContext* fmtCtx, int index);
     void getProperties(InputStreamProperties& prop);
     void close();
+    // Time stamp and index of the decoded frame
+    void getFrameTimeStamp(long long int& timeStamp, int& index) const;
+    // Build the conversion from origWidth x origHeight of origPixelFormat to width x height of pixelType
+    bool initConversion();
+    // Take the size and format of the decoded frame and rebuild the conversion for them
+    bool changeFormat();
+    // Convert the decoded frame to pixelType at dstWidth x dstHeight, which decodeVideoPacket
+    // leaves undone for the frame whose format changed
+    bool convertFrame(unsigned char** dstData, int* dstLinesize, int dstWidth, int dstHeight);
 
     AVFrame* frame;
+    // Resize to gbrp for readTensor, used if the decoded format has no fast tensor kernel
+    SwsContext* tensorSwsCtx;
+    unsigned char* tensorData[4];
+    int tensorLinesize[4];
+    int tensorWidth, tensorHeight;
+    // Set as decCtx->get_buffer2 if the decoder supports custom buffers
+    DecodeAllocator decodeAllocator;
+    // A frame got by decodeOnly changed the format, the next frame of convertDecoded is flagged
+    int formatChangePending;
 };
 
 struct StreamWriter
 {
+    StreamWriter() : numKeyPackets(0) {};
     virtual ~StreamWriter() {};
     virtual bool writeFrame(const AudioVideoFrame2& frame) { return false; };
+    // Whether input frames reach the encoder without sample or pixel format conversion
+    virtual bool isPassthrough() const { return false; }
     virtual void close() {};
+
+    StreamCounters counters;
+    // Video key packets handed to the muxer, a segmenting muxer may cut a segment at each of them
+    long long int numKeyPackets;
 };
 
 struct AudioStreamWriter : public StreamWriter
@@ -116,15 +186,18 @@ struct AudioStreamWriter : public StreamWriter
     ~AudioStreamWriter();
     void init();
     bool open(AVFormatContext* fmtCtx, const std::string& format, int useExternTS, long long int* ptrFirstTS,
-        int sampleType, int channelLayout, int sampleRate, int audioBPS, const std::vector<Option>& options);
+        int sampleType, int channelLayout, int sampleRate, int audioBPS, const std::vector<Option>& options,
+        const ResampleOptions& resampleOptions = ResampleOptions());
     bool writeFrame(const AudioVideoFrame2& frame);
+    bool writeFifoFrames();
+    bool writeEncoderFrame(AVFrame* frame);
+    bool isPassthrough() const;
     void close();
     
     AVFormatContext* fmtCtx;
     AVStream* stream;
-    AVFrame* audioFrameSrc;
     AVFrame* audioFrameDst;
-    int numSamplesSrc;
+    AVFrame* audioFrameSpan;
     int numSamplesDst;
     SwrContext* swrCtx;
     int sampleTypeRequested;
@@ -138,7 +211,10 @@ struct AudioStreamWriter : public StreamWriter
     long long int inputSampleCount;
     long long int swrSampleCount;
     long long int sampleCount;
-    AudioFrameAdaptor adaptor;
+    AudioSampleFifo fifo;
+    long long int fifoTimeStamp;
+    long long int fifoTimeStampSampleCount;
+    PacketBufferPool* pktPool;
 
     int useExternTimeStamp;
     long long int* firstTimeStamp;
@@ -149,7 +225,8 @@ struct VideoStreamWriter : public StreamWriter
 {
     virtual ~VideoStreamWriter() {}
     virtual bool open(AVFormatContext* fmtCtx, const std::string& format, int useExternTS, long long int* ptrFirstTS,
-        int pixelType, int width, int height, double fps, int bps, const std::vector<Option>& options) { return false; }
+        int pixelType, int width, int height, double fps, int bps, const std::vector<Option>& options,
+        double keyFrameInterval = 0, const EncoderConfig& encoderConfig = EncoderConfig()) { return false; }
     virtual bool writeFrame(const AudioVideoFrame2& frame) { return false; }
     virtual void close() {};
 };
@@ -158,22 +235,34 @@ struct BuiltinCodecVideoStreamWriter : public VideoStreamWriter
 {
     ~BuiltinCodecVideoStreamWriter();
     bool open(AVFormatContext* fmtCtx, const std::string& format, int externTimeStamp, long long int* firstTimeStamp,
-        int pixelType, int width, int height, double fps, int bps, const std::vector<Option>& options);
+        int pixelType, int width, int height, double fps, int bps, const std::vector<Option>& options,
+        double keyFrameInterval = 0, const EncoderConfig& encoderConfig = EncoderConfig());
     bool writeFrame(const AudioVideoFrame2& frame);
+    bool isPassthrough() const;
     void close();
 
     BuiltinCodecVideoStreamWriter();
     void init();
+    // Count the latency of the frame whose packet of pts has just been written
+    void countLatency(long long int pts);
 
     AVFormatContext* fmtCtx;
     AVStream* stream;
     AVFrame* yuvFrame;
     SwsContext* swsCtx;
+    // Convert with fastColorConvert instead of swsCtx
+    int fastConvert;
+    PacketBufferPool* pktPool;
     int framePixelTypeRequested;
     AVPixelFormat framePixelFormatAcquired;
     int frameWidth, frameHeight;
     int frameCount;
     double frameRate;
+    // Key frames are forced every keyFrameIntervalInFrames frames, 0 means encoder default
+    double keyFrameIntervalInFrames;
+    double nextKeyFramePts;
+    // Pts and time of the frames handed to the encoder whose packets have not come out
+    std::deque<std::pair<long long int, long long int> > pendingFrames;
 
     int useExternTimeStamp;
     long long int* firstTimeStamp;
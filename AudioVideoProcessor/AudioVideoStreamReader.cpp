@@ -1,6 +1,8 @@
 #include "AudioVideoGlobal.h"
 #include "AudioVideoStream.h"
 #include "FFmpegUtil.h"
+#include "AudioVideoTrace.h"
+#include "AudioVideoColorConvert.h"
 
 #ifdef __cplusplus
 #define __STDC_CONSTANT_MACROS
@@ -9,6 +11,7 @@ extern "C"
 #endif
 #include <libavutil/error.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/samplefmt.h>
 #include <libavutil/timestamp.h>
 #include <libavformat/avformat.h>
@@ -36,6 +39,7 @@ void getStreamProperties(const std::string& fileName, std::vector<StreamProperti
     cvtOptions(options, &dict);
 
     AVFormatContext* fmtCtx = NULL;
+    int numStreams;
     /* open input file, and allocate format context */
     if (avformat_open_input(&fmtCtx, fileName.c_str(), inputFormat, &dict) < 0)
     {
@@ -50,7 +54,7 @@ void getStreamProperties(const std::string& fileName, std::vector<StreamProperti
         goto END;
     }
 
-    int numStreams = fmtCtx->nb_streams;
+    numStreams = fmtCtx->nb_streams;
     for (int i = 0; i < numStreams; i++)
     {
         AVStream* s = fmtCtx->streams[i];
@@ -62,7 +66,7 @@ void getStreamProperties(const std::string& fileName, std::vector<StreamProperti
         }
         else if (c->codec_type == AVMEDIA_TYPE_VIDEO)
         {
-            props.push_back(StreamProperties(s->nb_frames, c->pix_fmt, c->width, c->height,
+            props.push_back(StreamProperties(s->nb_frames, getPixelType(c->pix_fmt), c->width, c->height,
                 av_q2d(s->r_frame_rate)));
         }
         else
@@ -74,6 +78,13 @@ END:
     avformat_close_input(&fmtCtx);
 }
 
+int StreamReader::decodeOnly(AVPacket& packet, long long int& timeStamp)
+{
+    lprintf("Error in %s, stream does not support decoding without converting\n", __FUNCTION__);
+    av_free_packet(&packet);
+    return -1;
+}
+
 AudioStreamReader::AudioStreamReader()
 {
     init();
@@ -84,6 +95,13 @@ AudioStreamReader::~AudioStreamReader()
     close();
 }
 
+// Whether a decoder opened with the codec private data of a can go on with the packets of b
+static bool sameExtradata(const AVCodecContext* a, const AVCodecContext* b)
+{
+    return a->extradata_size == b->extradata_size &&
+        (a->extradata_size == 0 || memcmp(a->extradata, b->extradata, a->extradata_size) == 0);
+}
+
 void AudioStreamReader::init()
 {
     fmtCtx = 0;
@@ -94,15 +112,21 @@ void AudioStreamReader::init()
     numFrames = 0;
     numSamples = 0;
     origSampleFormat = AV_SAMPLE_FMT_NONE;
+    origSampleRate = 0;
+    origNumChannels = 0;
+    origChannelLayout = 0;
     sampleType = SampleTypeUnknown;
     numChannels = 0;
+    channelLayout = 0;
     sampleRate = 0;
     memset(sampleData, 0, sizeof(sampleData));
     sampleLineSize = 0;
+    sampleCapacity = 0;
     swrCtx = 0;
 }
 
-bool AudioStreamReader::open(AVFormatContext* outFmtCtx, int index, int splType)
+bool AudioStreamReader::open(AVFormatContext* outFmtCtx, int index, int splType, int splRate, int chLayout,
+    const ResampleOptions& resampleOptions)
 {
     close();
 
@@ -110,8 +134,7 @@ bool AudioStreamReader::open(AVFormatContext* outFmtCtx, int index, int splType)
     stream = fmtCtx->streams[index];
     streamIndex = index;
 
-    decCtx = stream->codec;
-    AVCodec* dec = avcodec_find_decoder(decCtx->codec_id);
+    AVCodec* dec = avcodec_find_decoder(stream->codec->codec_id);
     if (!dec)
     {
         lprintf("Error in %s, failed to find %s codec\n",
@@ -119,6 +142,14 @@ bool AudioStreamReader::open(AVFormatContext* outFmtCtx, int index, int splType)
         goto FAIL;
     }
 
+    decCtx = avcodec_alloc_context3(dec);
+    if (!decCtx || avcodec_copy_context(decCtx, stream->codec) < 0)
+    {
+        lprintf("Error in %s, could not copy %s codec context\n",
+            __FUNCTION__, av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
+        goto FAIL;
+    }
+
     int ret;
     if ((ret = avcodec_open2(decCtx, dec, 0)) < 0)
     {
@@ -129,31 +160,23 @@ bool AudioStreamReader::open(AVFormatContext* outFmtCtx, int index, int splType)
 
     numFrames = stream->nb_frames;
     numSamples = decCtx->frame_size;
-    sampleRate = decCtx->sample_rate;
+    origSampleRate = decCtx->sample_rate;
     origSampleFormat = decCtx->sample_fmt;
-    numChannels = decCtx->channels;
-    channelLayout = decCtx->channel_layout;
+    origNumChannels = decCtx->channels;
+    origChannelLayout = decCtx->channel_layout;
+    if (origChannelLayout == 0)
+        origChannelLayout = av_get_default_channel_layout(origNumChannels);
     sampleType = (isInterfaceSampleType(splType) && (splType != origSampleFormat)) ? splType : origSampleFormat;
-    if (channelLayout == 0)
-        channelLayout = av_get_default_channel_layout(numChannels);
-    if (sampleType != origSampleFormat)
+    sampleRate = splRate > 0 ? splRate : origSampleRate;
+    channelLayout = chLayout ? chLayout : origChannelLayout;
+    numChannels = av_get_channel_layout_nb_channels(channelLayout);
+    if (sampleRate != origSampleRate)
+        numSamples = av_rescale_rnd(numSamples, sampleRate, origSampleRate, AV_ROUND_UP);
+    if (sampleType != origSampleFormat || sampleRate != origSampleRate || channelLayout != origChannelLayout)
     {
-        swrCtx = swr_alloc();
+        swrCtx = leaseSwrContext(origChannelLayout, origSampleRate, origSampleFormat,
+            channelLayout, sampleRate, (AVSampleFormat)sampleType, resampleOptions);
         if (!swrCtx)
-        {
-            lprintf("Error in %s, could not allocate resampler context\n", __FUNCTION__);
-            goto FAIL;
-        }
-
-        av_opt_set_int(swrCtx, "in_channel_layout", channelLayout, 0);
-        av_opt_set_int(swrCtx, "in_sample_rate", sampleRate, 0);
-        av_opt_set_sample_fmt(swrCtx, "in_sample_fmt", origSampleFormat, 0);
-
-        av_opt_set_int(swrCtx, "out_channel_layout", channelLayout, 0);
-        av_opt_set_int(swrCtx, "out_sample_rate", sampleRate, 0);
-        av_opt_set_sample_fmt(swrCtx, "out_sample_fmt", (AVSampleFormat)sampleType, 0);
-
-        if ((ret = swr_init(swrCtx)) < 0)
         {
             lprintf("Error in %s, failed to initialize the resampling context\n", __FUNCTION__);
             goto FAIL;
@@ -165,6 +188,7 @@ bool AudioStreamReader::open(AVFormatContext* outFmtCtx, int index, int splType)
             //    numSamples, (AVSampleFormat)sampleType, 0);
             //sampleData = (unsigned char*)av_malloc(bufSize);
             av_samples_alloc(sampleData, &sampleLineSize, numChannels, numSamples, (AVSampleFormat)sampleType, 0);
+            sampleCapacity = numSamples;
         }
     }
 
@@ -185,9 +209,26 @@ FAIL:
 
 bool AudioStreamReader::readFrame(AVPacket& packet, AudioVideoFrame2& header)
 {
+    TraceScope trace("AudioStreamReader::readFrame", streamIndex);
     int gotFrame;
-    int ret = decodeAudioPacket(&packet, decCtx, frame, sampleRate, origSampleFormat, numChannels,
-        &numSamples, swrCtx, (AVSampleFormat)sampleType, sampleData, &sampleLineSize, &gotFrame);
+    int ret;
+    int numFrameSamples = 0;
+    bool sampleRateChanged = sampleRate != origSampleRate;
+    if (sampleRateChanged || channelLayout != origChannelLayout)
+    {
+        ret = decodeAudioPacket(&packet, decCtx, frame, origSampleRate, origSampleFormat, origNumChannels,
+            swrCtx, sampleRate, (AVSampleFormat)sampleType, numChannels, 
+            sampleData, &sampleLineSize, &sampleCapacity, &numFrameSamples, &gotFrame, &counters);
+        // The resampler may hold back all the samples of the first frames
+        if (gotFrame && numFrameSamples == 0)
+            gotFrame = 0;
+    }
+    else
+    {
+        ret = decodeAudioPacket(&packet, decCtx, frame, sampleRate, origSampleFormat, numChannels,
+            &numSamples, swrCtx, (AVSampleFormat)sampleType, sampleData, &sampleLineSize, &gotFrame, &counters);
+        numFrameSamples = numSamples;
+    }
     av_free_packet(&packet);
 
     if (ret < 0)
@@ -208,10 +249,17 @@ bool AudioStreamReader::readFrame(AVPacket& packet, AudioVideoFrame2& header)
                 stream->time_base, avrational(1, AV_TIME_BASE));
             index = double(ptsAbsolute) / 1000000 * sampleRate / numSamples + 0.5;
         }
+        if (sampleRateChanged && ptsMicroSec >= 0)
+        {
+            // The converted samples end where the input frame ends minus what the resampler still holds
+            ptsMicroSec += double(frame->nb_samples) / origSampleRate * 1000000 -
+                double(swr_get_delay(swrCtx, 1000000)) - double(numFrameSamples) / sampleRate * 1000000 + 0.5;
+        }
+        trace.pts = ptsMicroSec;
         if (swrCtx)
         {
             header = AudioVideoFrame2(sampleData, sampleLineSize, 
-                sampleType, numChannels, channelLayout, numSamples, ptsMicroSec, index);
+                sampleType, numChannels, channelLayout, numFrameSamples, ptsMicroSec, index);
         }
         else
         {
@@ -224,7 +272,7 @@ bool AudioStreamReader::readFrame(AVPacket& packet, AudioVideoFrame2& header)
     return false;
 }
 
-bool AudioStreamReader::readTo(AVPacket& packet, AudioVideoFrame2& buffer)
+bool AudioStreamReader::fitsBuffer(const AudioVideoFrame2& buffer)
 {
     if (!buffer.data || buffer.mediaType != AUDIO || buffer.sampleType != sampleType ||
         buffer.numChannels != numChannels || buffer.channelLayout != channelLayout ||
@@ -234,9 +282,28 @@ bool AudioStreamReader::readTo(AVPacket& packet, AudioVideoFrame2& buffer)
         return false;
     }
 
+    // NOTICE!!!
+    // The number of samples per frame is not constant after sample rate conversion,
+    // so it could not fit into a fixed size buffer
+    if (sampleRate != origSampleRate)
+    {
+        lprintf("Error in %s, reading into buffer is not supported when sample rate is converted\n", __FUNCTION__);
+        return false;
+    }
+    return true;
+}
+
+bool AudioStreamReader::readTo(AVPacket& packet, AudioVideoFrame2& buffer)
+{
+    if (!fitsBuffer(buffer))
+    {
+        av_free_packet(&packet);
+        return false;
+    }
+
     int gotFrame;
-    int ret = decodeAudioPacket(&packet, decCtx, frame, sampleRate, origSampleFormat, numChannels,
-        numSamples, swrCtx, (AVSampleFormat)sampleType, buffer.data, &gotFrame);
+    int ret = decodeAudioPacket(&packet, decCtx, frame, sampleRate, origSampleFormat, origNumChannels,
+        numSamples, swrCtx, (AVSampleFormat)sampleType, buffer.data, &gotFrame, &counters);
     av_free_packet(&packet);
 
     if (ret < 0)
@@ -271,6 +338,31 @@ void AudioStreamReader::flushBuffer()
 {
     if (decCtx)
         avcodec_flush_buffers(decCtx);
+
+    // Drop the samples the resampler holds from before seeking, swr_init keeps the options
+    if (swrCtx && sampleRate != origSampleRate)
+        swr_init(swrCtx);
+}
+
+bool AudioStreamReader::switchInput(AVFormatContext* inFmtCtx, int index)
+{
+    if (!decCtx || index < 0 || index >= (int)inFmtCtx->nb_streams)
+        return false;
+
+    AVCodecContext* c = inFmtCtx->streams[index]->codec;
+    int layout = c->channel_layout ? c->channel_layout : av_get_default_channel_layout(c->channels);
+    if (c->codec_type != AVMEDIA_TYPE_AUDIO || c->codec_id != decCtx->codec_id ||
+        c->sample_rate != origSampleRate || c->sample_fmt != origSampleFormat ||
+        c->channels != origNumChannels || layout != origChannelLayout || !sameExtradata(c, decCtx))
+        return false;
+
+    fmtCtx = inFmtCtx;
+    stream = fmtCtx->streams[index];
+    streamIndex = index;
+    numFrames = stream->nb_frames;
+    decCtx->pkt_timebase = stream->time_base;
+    flushBuffer();
+    return true;
 }
 
 void AudioStreamReader::getProperties(InputStreamProperties& prop)
@@ -281,7 +373,7 @@ void AudioStreamReader::getProperties(InputStreamProperties& prop)
 void AudioStreamReader::close()
 {
     if (swrCtx)
-        swr_free(&swrCtx);
+        releaseSwrContext(&swrCtx);
 
     if (frame)
         av_frame_free(&frame);
@@ -290,7 +382,7 @@ void AudioStreamReader::close()
         av_free(sampleData[0]);
 
     if (decCtx)
-        avcodec_close(decCtx);
+        avcodec_free_context(&decCtx);
 
     init();
 }
@@ -314,16 +406,85 @@ void BuiltinCodecVideoStreamReader::init()
     frame = 0;
     width = 0;
     height = 0;
+    origWidth = 0;
+    origHeight = 0;
     origPixelFormat = AV_PIX_FMT_NONE;
+    keepSize = 0;
     pixelType = PixelTypeUnknown;
     frameRate = 0;
     numFrames = 0;
     memset(pixelData, 0, sizeof(pixelData));
     memset(pixelLinesize, 0, sizeof(pixelLinesize));
     swsCtx = 0;
+    fastConvert = 0;
+    colorMatrix = ColorMatrixBT601;
+    colorFullRange = 0;
+    tensorSwsCtx = 0;
+    memset(tensorData, 0, sizeof(tensorData));
+    memset(tensorLinesize, 0, sizeof(tensorLinesize));
+    tensorWidth = 0;
+    tensorHeight = 0;
+    decodeAllocator = DecodeAllocator();
+    formatChangePending = 0;
+}
+
+// Keeps the allocator of a block until the decoder drops its last reference
+struct DecodeBufferOwner
+{
+    DecodeFreeFunc free;
+    void* userData;
+};
+
+static void freeDecodeBuffer(void* opaque, uint8_t* data)
+{
+    DecodeBufferOwner* owner = (DecodeBufferOwner*)opaque;
+    owner->free(owner->userData, data);
+    delete owner;
+}
+
+static int getDecodeBuffer(AVCodecContext* ctx, AVFrame* frame, int flags)
+{
+    const DecodeAllocator& allocator = ((BuiltinCodecVideoStreamReader*)ctx->opaque)->decodeAllocator;
+    AVPixelFormat pixFmt = (AVPixelFormat)frame->format;
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(pixFmt);
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)))
+        return avcodec_default_get_buffer2(ctx, frame, flags);
+
+    // The decoder may write past the visible picture up to the aligned size,
+    // and reads up to 16 bytes over the end of each row
+    const int alignment = 64;
+    int width = frame->width, height = frame->height;
+    int strideAlign[AV_NUM_DATA_POINTERS];
+    avcodec_align_dimensions2(ctx, &width, &height, strideAlign);
+    if (av_image_fill_linesizes(frame->linesize, pixFmt, width) < 0)
+        return avcodec_default_get_buffer2(ctx, frame, flags);
+    for (int i = 0; i < 4; i++)
+        frame->linesize[i] = FFALIGN(frame->linesize[i], alignment);
+    int numBytes = av_image_fill_pointers(frame->data, pixFmt, height, NULL, frame->linesize);
+    if (numBytes < 0)
+        return avcodec_default_get_buffer2(ctx, frame, flags);
+    numBytes += alignment;
+
+    unsigned char* data = (unsigned char*)allocator.alloc(allocator.userData, numBytes, alignment);
+    if (!data)
+        return avcodec_default_get_buffer2(ctx, frame, flags);
+    DecodeBufferOwner* owner = new DecodeBufferOwner;
+    owner->free = allocator.free;
+    owner->userData = allocator.userData;
+    frame->buf[0] = av_buffer_create(data, numBytes, freeDecodeBuffer, owner, 0);
+    if (!frame->buf[0])
+    {
+        allocator.free(allocator.userData, data);
+        delete owner;
+        return AVERROR(ENOMEM);
+    }
+    av_image_fill_pointers(frame->data, pixFmt, height, data, frame->linesize);
+    frame->extended_data = frame->data;
+    return 0;
 }
 
-bool BuiltinCodecVideoStreamReader::open(AVFormatContext* outFmtCtx, int index, int pixType)
+bool BuiltinCodecVideoStreamReader::open(AVFormatContext* outFmtCtx, int index, int pixType,
+    const DecodeAllocator& allocator, bool keep)
 {
     close();
 
@@ -331,8 +492,7 @@ bool BuiltinCodecVideoStreamReader::open(AVFormatContext* outFmtCtx, int index,
     stream = fmtCtx->streams[index];
     streamIndex = index;
 
-    decCtx = stream->codec;
-    AVCodec* dec = avcodec_find_decoder(decCtx->codec_id);
+    AVCodec* dec = avcodec_find_decoder(stream->codec->codec_id);
     if (!dec)
     {
         lprintf("Error in %s, failed to find %s codec\n", __FUNCTION__, 
@@ -340,6 +500,21 @@ bool BuiltinCodecVideoStreamReader::open(AVFormatContext* outFmtCtx, int index,
         goto FAIL;
     }
 
+    decCtx = avcodec_alloc_context3(dec);
+    if (!decCtx || avcodec_copy_context(decCtx, stream->codec) < 0)
+    {
+        lprintf("Error in %s, could not copy %s codec context\n", __FUNCTION__,
+            av_get_media_type_string(AVMEDIA_TYPE_VIDEO));
+        goto FAIL;
+    }
+
+    if (allocator.alloc && allocator.free && (dec->capabilities & AV_CODEC_CAP_DR1))
+    {
+        decodeAllocator = allocator;
+        decCtx->opaque = this;
+        decCtx->get_buffer2 = getDecodeBuffer;
+    }
+
     int ret;
     if ((ret = avcodec_open2(decCtx, dec, 0)) < 0)
     {
@@ -351,29 +526,25 @@ bool BuiltinCodecVideoStreamReader::open(AVFormatContext* outFmtCtx, int index,
     /* allocate image where the decoded image will be put */
     width = decCtx->width;
     height = decCtx->height;
+    origWidth = width;
+    origHeight = height;
     origPixelFormat = decCtx->pix_fmt;
+    keepSize = keep;
     frameRate = av_q2d(stream->r_frame_rate);
     numFrames = stream->nb_frames;
-    pixelType = (isInterfacePixelType(pixType) && (pixType != origPixelFormat)) ? pixType : origPixelFormat;
-    if (pixelType != origPixelFormat)
+    pixelType = (isInterfacePixelType(pixType) && (getAVPixelFormat(pixType) != origPixelFormat)) ?
+        pixType : getPixelType(origPixelFormat);
+    if (pixelType == PixelTypeUnknown)
     {
-        ret = av_image_alloc(pixelData, pixelLinesize,
-            width, height, (AVPixelFormat)pixelType, 16);
-        if (ret < 0)
-        {
-            lprintf("Error in %s, could not allocate raw video buffer\n", __FUNCTION__);
-            goto FAIL;
-        }
-
-        swsCtx = sws_getContext(width, height, origPixelFormat,
-            width, height, (AVPixelFormat)pixelType,
-            SWS_BICUBIC, NULL, NULL, NULL);
-        if (!swsCtx)
-        {
-            lprintf("Error in %s, could not allocate scale context\n", __FUNCTION__);
-            goto FAIL;
-        }
+        // Such as yuvj420p of mjpeg, frames could not be described by a PixelType as they are
+        lprintf("Warning in %s, decoded pixel format %s has no pixel type, converted to yuv420p\n",
+            __FUNCTION__, av_get_pix_fmt_name(origPixelFormat));
+        pixelType = PixelTypeYUV420P;
     }
+    colorMatrix = decCtx->colorspace == AVCOL_SPC_BT709 ? ColorMatrixBT709 : ColorMatrixBT601;
+    colorFullRange = decCtx->color_range == AVCOL_RANGE_JPEG;
+    if (!initConversion())
+        goto FAIL;
 
     frame = av_frame_alloc();
     if (!frame)
@@ -392,12 +563,17 @@ FAIL:
 
 bool BuiltinCodecVideoStreamReader::readFrame(AVPacket& packet, AudioVideoFrame2& header)
 {
+    TraceScope trace("VideoStreamReader::readFrame", streamIndex);
     int index, gotFrame;
-    int ret = decodeVideoPacket(&packet, decCtx, frame, width, height, origPixelFormat,
-        swsCtx, pixelData, pixelLinesize, &index, &gotFrame);
+    int ret = decodeVideoPacket(&packet, decCtx, frame, origWidth, origHeight, origPixelFormat,
+        swsCtx, pixelData, pixelLinesize, &index, &gotFrame, &counters);
     av_free_packet(&packet);
 
-    if (ret < 0)
+    int formatChanged = ret == AVERROR_INPUT_CHANGED && gotFrame;
+    if (formatChanged && !changeFormat())
+        return false;
+
+    if (ret < 0 && !formatChanged)
     {
         lprintf("Error in %s, decoding video packet failed\n", __FUNCTION__);
         return false;
@@ -405,17 +581,22 @@ bool BuiltinCodecVideoStreamReader::readFrame(AVPacket& packet, AudioVideoFrame2
     
     if (gotFrame)
     {
-        long long int streamPts = av_frame_get_best_effort_timestamp(frame);
-        long long int ptsMicroSec =
-            (streamPts == AV_NOPTS_VALUE) ? -1 : av_rescale_q(streamPts, stream->time_base, avrational(1, AV_TIME_BASE));
-        int index = -1;
-        if (streamPts != AV_NOPTS_VALUE)
+        long long int ptsMicroSec;
+        getFrameTimeStamp(ptsMicroSec, index);
+        trace.pts = ptsMicroSec;
+        if (formatChanged)
         {
-            long long int ptsAbsolute = av_rescale_q(streamPts - (stream->start_time == AV_NOPTS_VALUE ? 0 : stream->start_time),
-                stream->time_base, avrational(1, AV_TIME_BASE));
-            index = double(ptsAbsolute) / 1000000 * frameRate + 0.5;
+            if ((swsCtx || fastConvert) && !convertFrame(pixelData, pixelLinesize, width, height))
+                return false;
+        }
+        else if (fastConvert)
+        {
+            long long int beginTime = getNanoSecCount();
+            fastColorConvert(frame->data, frame->linesize, origPixelFormat,
+                pixelData, pixelLinesize, getAVPixelFormat(pixelType), width, height, colorMatrix, colorFullRange);
+            addCounter(counters.convertNanoSec, getNanoSecCount() - beginTime);
         }
-        if (swsCtx)
+        if (swsCtx || fastConvert)
         {
             header = AudioVideoFrame2(pixelData, pixelLinesize, 
                 pixelType, width, height, ptsMicroSec, index);
@@ -425,13 +606,14 @@ bool BuiltinCodecVideoStreamReader::readFrame(AVPacket& packet, AudioVideoFrame2
             header = AudioVideoFrame2(frame->data, frame->linesize,
                 pixelType, width, height, ptsMicroSec, index);
         }
+        header.flags = formatChanged ? FrameFlagFormatChanged : 0;
         return true;
     }
 
     return false;
 }
 
-bool BuiltinCodecVideoStreamReader::readTo(AVPacket& packet, AudioVideoFrame2& buffer)
+bool BuiltinCodecVideoStreamReader::fitsBuffer(const AudioVideoFrame2& buffer)
 {
     if (!buffer.data[0] || buffer.mediaType != VIDEO || buffer.pixelType != pixelType ||
         buffer.width != width || buffer.height != height)
@@ -439,13 +621,27 @@ bool BuiltinCodecVideoStreamReader::readTo(AVPacket& packet, AudioVideoFrame2& b
         lprintf("Error in %s, buffer not satisfied\n", __FUNCTION__);
         return false;
     }
+    return true;
+}
+
+bool BuiltinCodecVideoStreamReader::readTo(AVPacket& packet, AudioVideoFrame2& buffer)
+{
+    if (!fitsBuffer(buffer))
+    {
+        av_free_packet(&packet);
+        return false;
+    }
 
     int index, gotFrame;
-    int ret = decodeVideoPacket(&packet, decCtx, frame, width, height, origPixelFormat,
-        swsCtx, buffer.data, buffer.steps, &index, &gotFrame);
+    int ret = decodeVideoPacket(&packet, decCtx, frame, origWidth, origHeight, origPixelFormat,
+        swsCtx, buffer.data, buffer.steps, &index, &gotFrame, &counters);
     av_free_packet(&packet);
 
-    if (ret < 0)
+    int formatChanged = ret == AVERROR_INPUT_CHANGED && gotFrame;
+    if (formatChanged && !changeFormat())
+        return false;
+
+    if (ret < 0 && !formatChanged)
     {
         lprintf("Error in %s, decoding video packet failed\n", __FUNCTION__);
         return false;
@@ -453,30 +649,302 @@ bool BuiltinCodecVideoStreamReader::readTo(AVPacket& packet, AudioVideoFrame2& b
 
     if (gotFrame)
     {
-        long long int streamPts = av_frame_get_best_effort_timestamp(frame);
-        long long int ptsMicroSec =
-            (streamPts == AV_NOPTS_VALUE) ? -1 : av_rescale_q(streamPts, stream->time_base, avrational(1, AV_TIME_BASE));
-        int index = -1;
-        if (streamPts != AV_NOPTS_VALUE)
+        long long int ptsMicroSec;
+        getFrameTimeStamp(ptsMicroSec, index);
+        if (formatChanged)
         {
-            long long int ptsAbsolute = av_rescale_q(streamPts - (stream->start_time == AV_NOPTS_VALUE ? 0 : stream->start_time),
-                stream->time_base, avrational(1, AV_TIME_BASE));
-            index = double(ptsAbsolute) / 1000000 * frameRate + 0.5;
+            // The buffer still has the size from before the change if the size is not kept
+            if (!convertFrame(buffer.data, buffer.steps, buffer.width, buffer.height))
+                return false;
         }
-        if (!swsCtx)
-            av_image_copy(buffer.data, buffer.steps, (const unsigned char**)frame->data, frame->linesize, (AVPixelFormat)pixelType, width, height);
+        else if (fastConvert)
+        {
+            long long int beginTime = getNanoSecCount();
+            fastColorConvert(frame->data, frame->linesize, origPixelFormat,
+                buffer.data, buffer.steps, getAVPixelFormat(pixelType), width, height, colorMatrix, colorFullRange);
+            addCounter(counters.convertNanoSec, getNanoSecCount() - beginTime);
+        }
+        else if (!swsCtx)
+            av_image_copy(buffer.data, buffer.steps, (const unsigned char**)frame->data, frame->linesize, getAVPixelFormat(pixelType), width, height);
         buffer.timeStamp = ptsMicroSec;
         buffer.frameIndex = index;
+        buffer.flags = formatChanged ? FrameFlagFormatChanged : 0;
+        return true;
+    }
+
+    return false;
+}
+
+bool BuiltinCodecVideoStreamReader::readTensor(AVPacket& packet, float* tensor, const TensorOptions& options,
+    AudioVideoFrame2& header)
+{
+    if (!tensor || options.width <= 0 || options.height <= 0)
+    {
+        lprintf("Error in %s, tensor not satisfied\n", __FUNCTION__);
+        av_free_packet(&packet);
+        return false;
+    }
+
+    TraceScope trace("VideoStreamReader::readTensor", streamIndex);
+    // Only decode here, the decoded picture is converted once into the tensor
+    int index, gotFrame;
+    int ret = decodeVideoPacket(&packet, decCtx, frame, origWidth, origHeight, origPixelFormat,
+        NULL, NULL, NULL, &index, &gotFrame, &counters);
+    av_free_packet(&packet);
+
+    int formatChanged = ret == AVERROR_INPUT_CHANGED && gotFrame;
+    if (formatChanged && !changeFormat())
+        return false;
+
+    if (ret < 0 && !formatChanged)
+    {
+        lprintf("Error in %s, decoding video packet failed\n", __FUNCTION__);
+        return false;
+    }
+
+    if (gotFrame)
+    {
+        long long int ptsMicroSec;
+        getFrameTimeStamp(ptsMicroSec, index);
+        trace.pts = ptsMicroSec;
+        long long int beginTime = getNanoSecCount();
+        if (supportsFastTensorConvert(origPixelFormat))
+        {
+            fastTensorConvert(frame->data, frame->linesize, origPixelFormat, origWidth, origHeight,
+                colorMatrix, colorFullRange, tensor, options);
+        }
+        else
+        {
+            int rectX, rectY, rectWidth, rectHeight;
+            getTensorRect(options, origWidth, origHeight, rectX, rectY, rectWidth, rectHeight);
+            if (rectWidth != tensorWidth || rectHeight != tensorHeight)
+            {
+                releaseSwsContext(&tensorSwsCtx);
+                if (tensorData[0])
+                    av_freep(&tensorData[0]);
+                tensorWidth = 0;
+                tensorHeight = 0;
+                if (av_image_alloc(tensorData, tensorLinesize, rectWidth, rectHeight, AV_PIX_FMT_GBRP, 16) < 0)
+                {
+                    lprintf("Error in %s, could not allocate tensor buffer\n", __FUNCTION__);
+                    return false;
+                }
+                tensorWidth = rectWidth;
+                tensorHeight = rectHeight;
+            }
+            if (!tensorSwsCtx)
+                tensorSwsCtx = leaseSwsContext(origWidth, origHeight, origPixelFormat,
+                    rectWidth, rectHeight, AV_PIX_FMT_GBRP, SWS_BILINEAR);
+            if (!tensorSwsCtx)
+            {
+                lprintf("Error in %s, could not allocate scale context\n", __FUNCTION__);
+                return false;
+            }
+            sws_scale(tensorSwsCtx, (const uint8_t * const *)frame->data, frame->linesize,
+                0, origHeight, tensorData, tensorLinesize);
+            gbrpToTensor(tensorData, tensorLinesize, rectX, rectY, rectWidth, rectHeight, tensor, options);
+        }
+        addCounter(counters.convertNanoSec, getNanoSecCount() - beginTime);
+        header = AudioVideoFrame2(NULL, NULL, pixelType, origWidth, origHeight, ptsMicroSec, index);
+        header.flags = formatChanged ? FrameFlagFormatChanged : 0;
         return true;
     }
 
     return false;
 }
 
+bool BuiltinCodecVideoStreamReader::initConversion()
+{
+    releaseSwsContext(&swsCtx);
+    releaseSwsContext(&tensorSwsCtx);
+    if (pixelData[0])
+        av_freep(&pixelData[0]);
+    memset(pixelData, 0, sizeof(pixelData));
+    memset(pixelLinesize, 0, sizeof(pixelLinesize));
+    fastConvert = 0;
+
+    AVPixelFormat pixFmt = getAVPixelFormat(pixelType);
+    if (pixFmt == origPixelFormat && width == origWidth && height == origHeight)
+        return true;
+
+    if (av_image_alloc(pixelData, pixelLinesize, width, height, pixFmt, 16) < 0)
+    {
+        lprintf("Error in %s, could not allocate raw video buffer\n", __FUNCTION__);
+        return false;
+    }
+
+    fastConvert = fastColorConvertEnabled.load(std::memory_order_relaxed) &&
+        width == origWidth && height == origHeight && supportsFastColorConvert(origPixelFormat, pixFmt);
+    if (!fastConvert)
+    {
+        // Use the same color matrix as the fast kernels, so that both give the same picture
+        int matrix = supportsFastColorConvert(origPixelFormat, pixFmt) ? colorMatrix : -1;
+        swsCtx = leaseSwsContext(origWidth, origHeight, origPixelFormat,
+            width, height, pixFmt, SWS_BICUBIC, matrix, colorFullRange);
+        if (!swsCtx)
+        {
+            lprintf("Error in %s, could not allocate scale context\n", __FUNCTION__);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BuiltinCodecVideoStreamReader::changeFormat()
+{
+    origWidth = frame->width;
+    origHeight = frame->height;
+    origPixelFormat = (AVPixelFormat)frame->format;
+    colorMatrix = frame->colorspace == AVCOL_SPC_BT709 ? ColorMatrixBT709 : ColorMatrixBT601;
+    colorFullRange = frame->color_range == AVCOL_RANGE_JPEG;
+    if (!keepSize)
+    {
+        width = origWidth;
+        height = origHeight;
+    }
+    // decodeVideoPacket does not count the frame it returns unconverted
+    addCounter(counters.numFrames, 1);
+    if (!initConversion())
+    {
+        lprintf("Error in %s, could not convert video of %d x %d %s\n", __FUNCTION__,
+            origWidth, origHeight, av_get_pix_fmt_name(origPixelFormat));
+        return false;
+    }
+    return true;
+}
+
+bool BuiltinCodecVideoStreamReader::convertFrame(unsigned char** dstData, int* dstLinesize,
+    int dstWidth, int dstHeight)
+{
+    long long int beginTime = getNanoSecCount();
+    AVPixelFormat pixFmt = getAVPixelFormat(pixelType);
+    if (pixFmt == origPixelFormat && dstWidth == origWidth && dstHeight == origHeight)
+    {
+        av_image_copy(dstData, dstLinesize, (const unsigned char**)frame->data, frame->linesize,
+            pixFmt, dstWidth, dstHeight);
+    }
+    else if (fastConvert && dstWidth == width && dstHeight == height)
+    {
+        fastColorConvert(frame->data, frame->linesize, origPixelFormat,
+            dstData, dstLinesize, pixFmt, dstWidth, dstHeight, colorMatrix, colorFullRange);
+    }
+    else if (swsCtx && dstWidth == width && dstHeight == height)
+    {
+        sws_scale(swsCtx, (const uint8_t * const *)frame->data, frame->linesize,
+            0, origHeight, dstData, dstLinesize);
+    }
+    else
+    {
+        // Such as a buffer made for the size before the change
+        int matrix = supportsFastColorConvert(origPixelFormat, pixFmt) ? colorMatrix : -1;
+        SwsContext* ctx = leaseSwsContext(origWidth, origHeight, origPixelFormat,
+            dstWidth, dstHeight, pixFmt, SWS_BICUBIC, matrix, colorFullRange);
+        if (!ctx)
+        {
+            lprintf("Error in %s, could not allocate scale context\n", __FUNCTION__);
+            return false;
+        }
+        sws_scale(ctx, (const uint8_t * const *)frame->data, frame->linesize,
+            0, origHeight, dstData, dstLinesize);
+        releaseSwsContext(&ctx);
+    }
+    addCounter(counters.convertNanoSec, getNanoSecCount() - beginTime);
+    return true;
+}
+
+void BuiltinCodecVideoStreamReader::getFrameTimeStamp(long long int& timeStamp, int& index) const
+{
+    long long int streamPts = av_frame_get_best_effort_timestamp(frame);
+    timeStamp = (streamPts == AV_NOPTS_VALUE) ? -1 : av_rescale_q(streamPts, stream->time_base, avrational(1, AV_TIME_BASE));
+    index = -1;
+    if (streamPts != AV_NOPTS_VALUE)
+    {
+        long long int ptsAbsolute = av_rescale_q(streamPts - (stream->start_time == AV_NOPTS_VALUE ? 0 : stream->start_time),
+            stream->time_base, avrational(1, AV_TIME_BASE));
+        index = double(ptsAbsolute) / 1000000 * frameRate + 0.5;
+    }
+}
+
+int BuiltinCodecVideoStreamReader::decodeOnly(AVPacket& packet, long long int& timeStamp)
+{
+    TraceScope trace("VideoStreamReader::decodeOnly", streamIndex);
+    int index, gotFrame;
+    int ret = decodeVideoPacket(&packet, decCtx, frame, origWidth, origHeight, origPixelFormat,
+        NULL, NULL, NULL, &index, &gotFrame, &counters);
+    av_free_packet(&packet);
+
+    int formatChanged = ret == AVERROR_INPUT_CHANGED && gotFrame;
+    if (formatChanged)
+    {
+        if (!changeFormat())
+            return 0;
+        formatChangePending = 1;
+    }
+
+    if (ret < 0 && !formatChanged)
+    {
+        lprintf("Error in %s, decoding video packet failed\n", __FUNCTION__);
+        return 0;
+    }
+
+    if (!gotFrame)
+        return 0;
+
+    getFrameTimeStamp(timeStamp, index);
+    trace.pts = timeStamp;
+    return 1;
+}
+
+bool BuiltinCodecVideoStreamReader::convertDecoded(AudioVideoFrame2& header)
+{
+    long long int ptsMicroSec;
+    int index;
+    getFrameTimeStamp(ptsMicroSec, index);
+    if (swsCtx || fastConvert)
+    {
+        if (!convertFrame(pixelData, pixelLinesize, width, height))
+            return false;
+        header = AudioVideoFrame2(pixelData, pixelLinesize,
+            pixelType, width, height, ptsMicroSec, index);
+    }
+    else
+    {
+        header = AudioVideoFrame2(frame->data, frame->linesize,
+            pixelType, width, height, ptsMicroSec, index);
+    }
+    header.flags = formatChangePending ? FrameFlagFormatChanged : 0;
+    formatChangePending = 0;
+    return true;
+}
+
 void BuiltinCodecVideoStreamReader::flushBuffer()
 {
     if (decCtx)
         avcodec_flush_buffers(decCtx);
+    formatChangePending = 0;
+}
+
+bool BuiltinCodecVideoStreamReader::switchInput(AVFormatContext* inFmtCtx, int index)
+{
+    if (!decCtx || index < 0 || index >= (int)inFmtCtx->nb_streams)
+        return false;
+
+    AVCodecContext* c = inFmtCtx->streams[index]->codec;
+    int matrix = c->colorspace == AVCOL_SPC_BT709 ? ColorMatrixBT709 : ColorMatrixBT601;
+    int fullRange = c->color_range == AVCOL_RANGE_JPEG;
+    if (c->codec_type != AVMEDIA_TYPE_VIDEO || c->codec_id != decCtx->codec_id ||
+        c->width != origWidth || c->height != origHeight || c->pix_fmt != origPixelFormat ||
+        matrix != colorMatrix || fullRange != colorFullRange || !sameExtradata(c, decCtx))
+        return false;
+
+    fmtCtx = inFmtCtx;
+    stream = fmtCtx->streams[index];
+    streamIndex = index;
+    frameRate = av_q2d(stream->r_frame_rate);
+    numFrames = stream->nb_frames;
+    decCtx->pkt_timebase = stream->time_base;
+    flushBuffer();
+    return true;
 }
 
 void BuiltinCodecVideoStreamReader::getProperties(InputStreamProperties& prop)
@@ -487,16 +955,10 @@ void BuiltinCodecVideoStreamReader::getProperties(InputStreamProperties& prop)
 void BuiltinCodecVideoStreamReader::close()
 {
     if (swsCtx)
-    {
-        sws_freeContext(swsCtx);
-        swsCtx = 0;
-    }
+        releaseSwsContext(&swsCtx);
 
     if (decCtx)
-    {
-        avcodec_close(decCtx);
-        decCtx = 0;
-    }
+        avcodec_free_context(&decCtx);
 
     if (frame)
         av_frame_free(&frame);
@@ -504,6 +966,12 @@ void BuiltinCodecVideoStreamReader::close()
     if (pixelData[0])
         av_free(pixelData[0]);
 
+    if (tensorSwsCtx)
+        releaseSwsContext(&tensorSwsCtx);
+
+    if (tensorData[0])
+        av_free(tensorData[0]);
+
     init();
 }
 
@@ -2,8 +2,13 @@
 #include "AudioVideoGlobal.h"
 #include "AudioVideoProcessor.h"
 #include "FFmpegUtil.h"
+#include "AudioVideoTrace.h"
+#include "AudioVideoColorConvert.h"
 #include "boost/algorithm/string.hpp"
 
+static char err_buf[AV_ERROR_MAX_STRING_SIZE];
+#define av_err2str_new(errnum) \
+    av_make_error_string(err_buf, AV_ERROR_MAX_STRING_SIZE, errnum)
 
 namespace avp
 {
@@ -22,9 +27,8 @@ void AudioStreamWriter::init()
 {
     fmtCtx = 0;
     stream = 0;
-    audioFrameSrc = 0;
     audioFrameDst = 0;
-    numSamplesSrc = 0;
+    audioFrameSpan = 0;
     numSamplesDst = 0;
     swrCtx = 0;
     sampleTypeRequested = SampleTypeUnknown;
@@ -38,7 +42,10 @@ void AudioStreamWriter::init()
     sampleCount = 0;
     inputSampleCount = 0;
     swrSampleCount = 0;
-    adaptor.clear();
+    fifo.close();
+    fifoTimeStamp = 0;
+    fifoTimeStampSampleCount = 0;
+    pktPool = 0;
 
     useExternTimeStamp = 0;
     firstTimeStamp = 0;
@@ -46,10 +53,12 @@ void AudioStreamWriter::init()
 }
 
 bool AudioStreamWriter::open(AVFormatContext* outFmtCtx, const std::string& format, int useExternTS, long long int* ptrFirstTS,
-    int sampleType, int channelLayout, int sampleRate, int bps, const std::vector<Option>& options)
+    int sampleType, int channelLayout, int sampleRate, int bps, const std::vector<Option>& options,
+    const ResampleOptions& resampleOptions)
 {
     close();
 
+    AVCodecContext* codecCtx = 0;
     AVCodecID codecID = AV_CODEC_ID_NONE;
     if (format == "aac")
         codecID = AV_CODEC_ID_AAC;
@@ -75,35 +84,24 @@ bool AudioStreamWriter::open(AVFormatContext* outFmtCtx, const std::string& form
         lprintf("Error in %s, ould not add audio stream.\n", __FUNCTION__);
         goto FAIL;
     }
-    AVCodecContext* codecCtx = stream->codec;
+    codecCtx = stream->codec;
     sampleTypeAcquired = codecCtx->sample_fmt;
     sampleRateAcquired = codecCtx->sample_rate;
     numChannelsAcquired = codecCtx->channels;
     channelLayoutAcquired = codecCtx->channel_layout;
 
-    /* create resampler context */
-    swrCtx = swr_alloc();
-    if (!swrCtx)
-    {
-        lprintf("Error in %s, ould not allocate resampler context\n", __FUNCTION__);
-        goto FAIL;
-    }
-
-    /* set options */
-    av_opt_set_int(swrCtx, "in_channel_layout", channelLayoutRequested, 0);
-    av_opt_set_int(swrCtx, "in_sample_rate", sampleRateRequested, 0);
-    av_opt_set_sample_fmt(swrCtx, "in_sample_fmt", (enum AVSampleFormat)sampleTypeRequested, 0);
-
-    av_opt_set_int(swrCtx, "out_channel_layout", channelLayoutAcquired, 0);
-    av_opt_set_int(swrCtx, "out_sample_rate", sampleRateAcquired, 0);
-    av_opt_set_sample_fmt(swrCtx, "out_sample_fmt", (enum AVSampleFormat)sampleTypeAcquired, 0);
-
-    int ret = 0;
-    /* initialize the resampling context */
-    if ((ret = swr_init(swrCtx)) < 0)
+    // Samples go to the encoder untouched if the encoder accepts the requested format
+    if (sampleTypeRequested != sampleTypeAcquired || sampleRateRequested != sampleRateAcquired ||
+        channelLayoutRequested != channelLayoutAcquired)
     {
-        lprintf("Error in %s, failed to initialize the resampling context\n", __FUNCTION__);
-        goto FAIL;
+        /* lease an initialized resampler context */
+        swrCtx = leaseSwrContext(channelLayoutRequested, sampleRateRequested, (enum AVSampleFormat)sampleTypeRequested,
+            channelLayoutAcquired, sampleRateAcquired, (enum AVSampleFormat)sampleTypeAcquired, resampleOptions);
+        if (!swrCtx)
+        {
+            lprintf("Error in %s, failed to initialize the resampling context\n", __FUNCTION__);
+            goto FAIL;
+        }
     }
 
     numSamplesDst = codecCtx->frame_size;
@@ -115,20 +113,39 @@ bool AudioStreamWriter::open(AVFormatContext* outFmtCtx, const std::string& form
         goto FAIL;
     }
 
-    adaptor.setDstInfo(audioFrameDst->data, sampleRateAcquired,
-        sampleTypeAcquired, numChannelsAcquired, numSamplesDst);
-
-    // At this time we are not sure the input audio frame size, 
-    // we just make audioFrameSrc frame size sufficiently large. 
-    // See the comment in function AudioVideoWriter::Impl::write()
-    numSamplesSrc = 2 * numSamplesDst;
-    audioFrameSrc = allocAudioFrame((enum AVSampleFormat)sampleTypeAcquired,
-        sampleRateAcquired, channelLayoutAcquired, numSamplesSrc);
-    if (!audioFrameSrc)
+    // Full encoder frames are normally encoded in place from the fifo,
+    // audioFrameSpan only carries the pointers, it owns no memory
+    audioFrameSpan = av_frame_alloc();
+    if (!audioFrameSpan)
     {
         lprintf("Error in %s, could not allocate audio frame\n", __FUNCTION__);
         goto FAIL;
     }
+    audioFrameSpan->format = sampleTypeAcquired;
+    audioFrameSpan->channel_layout = channelLayoutAcquired;
+    av_frame_set_channels(audioFrameSpan, numChannelsAcquired);
+    audioFrameSpan->sample_rate = sampleRateAcquired;
+    audioFrameSpan->nb_samples = numSamplesDst;
+    audioFrameSpan->linesize[0] = audioFrameDst->linesize[0];
+
+    // NOTICE!!!
+    // Capacity is a multiple of the encoder frame size and the reader always takes
+    // whole encoder frames, so a full frame never wraps around the end of the ring.
+    if (!fifo.init(sampleTypeAcquired, numChannelsAcquired, numSamplesDst * 8))
+    {
+        lprintf("Error in %s, could not init audio sample fifo\n", __FUNCTION__);
+        goto FAIL;
+    }
+
+    // Encoded audio packets are small, aac asks for at most 8192 bytes per channel
+    pktPool = allocPacketBufferPool(FFMAX(8192 * numChannelsAcquired,
+        av_samples_get_buffer_size(NULL, numChannelsAcquired, numSamplesDst, (AVSampleFormat)sampleTypeAcquired, 1)) +
+        AV_INPUT_BUFFER_MIN_SIZE);
+    if (!pktPool)
+    {
+        lprintf("Error in %s, could not allocate packet buffer pool\n", __FUNCTION__);
+        goto FAIL;
+    }
 
     audioIncrementUnit = 1.0 / sampleRateAcquired * 1000000;
     useExternTimeStamp = useExternTS;
@@ -143,6 +160,7 @@ FAIL:
 
 bool AudioStreamWriter::writeFrame(const AudioVideoFrame2& frame)
 {
+    TraceScope trace("AudioStreamWriter::writeFrame", stream ? stream->index : -1, frame.timeStamp);
     if (!frame.data[0] || frame.mediaType != AUDIO ||
         frame.numChannels != numChannelsRequested ||
         frame.channelLayout != channelLayoutRequested ||
@@ -156,58 +174,134 @@ bool AudioStreamWriter::writeFrame(const AudioVideoFrame2& frame)
         return false;
     }
 
-    // NOTICE!!!!!
-    // Each time this function av_rescale_rnd is called, the returned value may change,
-    // so it is not wise to allocate audioFrameSrc according to the returned value.
-    // It would be better to allocate a audioFrameSrc with sufficient large memory.
-    // When the return of av_rescale_rnd is larger then audioFrameSrc frame size, reallocate audioFrameSrc.
-    // Before reallocation, DO REMEMBER TO CALL av_frame_free to free current audioFrameSrc.
-    int currNumSamplesSrc = av_rescale_rnd(swr_get_delay(swrCtx, sampleRateRequested) + frame.numSamples,
-        sampleRateAcquired, sampleRateRequested, AV_ROUND_UP);
-    if (currNumSamplesSrc > numSamplesSrc)
-    {
-        av_frame_free(&audioFrameSrc);
-        audioFrameSrc = allocAudioFrame((enum AVSampleFormat)sampleTypeAcquired,
-            sampleRateAcquired, channelLayoutAcquired, currNumSamplesSrc + 32);
-        if (!audioFrameSrc)
+    // Timestamp of the first sample swr outputs for this frame,
+    // notice that it is actually not the first sample of this frame because of the swr delay.
+    fifoTimeStamp = frame.timeStamp + (double(swrSampleCount) / sampleRateAcquired - double(inputSampleCount) / sampleRateRequested) * 1000000 + 0.5;
+    fifoTimeStampSampleCount = swrSampleCount;
+    inputSampleCount += frame.numSamples;
+
+    unsigned char* spanData[8];
+    if (!swrCtx)
+    {
+        // Passthrough, while nothing is pending in the fifo, full encoder frames
+        // are taken from the input frame directly, only the remainder is queued.
+        bool isPlanar = av_sample_fmt_is_planar((AVSampleFormat)sampleTypeAcquired);
+        int numPlanes = isPlanar ? numChannelsAcquired : 1;
+        int sampleNumBytes = getSampleTypeNumBytes(sampleTypeAcquired) * (isPlanar ? 1 : numChannelsAcquired);
+        int pos = 0;
+        while (fifo.size() == 0 && frame.numSamples - pos >= numSamplesDst)
         {
-            lprintf("Error in %s, could not allocate audio frame\n", __FUNCTION__);
-            return false;
+            for (int i = 0; i < 8; i++)
+                audioFrameSpan->data[i] = i < numPlanes ? frame.data[i] + pos * sampleNumBytes : 0;
+            audioFrameSpan->extended_data = audioFrameSpan->data;
+            pos += numSamplesDst;
+            swrSampleCount += numSamplesDst;
+            if (!writeEncoderFrame(audioFrameSpan))
+                return false;
         }
-        numSamplesSrc = currNumSamplesSrc + 32;
+        while (pos < frame.numSamples)
+        {
+            const unsigned char* data[8];
+            for (int i = 0; i < 8; i++)
+                data[i] = i < numPlanes ? frame.data[i] + pos * sampleNumBytes : 0;
+            int numWritten = fifo.write(data, frame.numSamples - pos);
+            pos += numWritten;
+            swrSampleCount += numWritten;
+            if (!writeFifoFrames())
+                return false;
+        }
+        counters.queueDepth.store(fifo.size(), std::memory_order_relaxed);
+        return true;
     }
-    int actualNumSamplesSrc = swr_convert(swrCtx, audioFrameSrc->data, currNumSamplesSrc,
-        (const unsigned char**)frame.data, frame.numSamples);
-    if (actualNumSamplesSrc < 0)
+
+    // swr converts straight into the free span of the fifo. If the span is exhausted,
+    // swr buffers the rest of the output, which is fetched by calling swr_convert with zero input samples.
+    // NOTICE!!!
+    // DO NOT pass NULL input to swr_convert here, it flushes the resampler.
+    const unsigned char** inData = (const unsigned char**)frame.data;
+    int inNumSamples = frame.numSamples;
+    while (true)
     {
-        lprintf("Error in %s, could not convert audio samples\n", __FUNCTION__);
-        return false;
+        int spanNumSamples = fifo.getWriteSpan(spanData);
+        if (spanNumSamples == 0)
+        {
+            if (!writeFifoFrames())
+                return false;
+            continue;
+        }
+        long long int beginTime = getNanoSecCount();
+        int actualNumSamples = swr_convert(swrCtx, spanData, spanNumSamples, inData, inNumSamples);
+        addCounter(counters.convertNanoSec, getNanoSecCount() - beginTime);
+        if (actualNumSamples < 0)
+        {
+            lprintf("Error in %s, could not convert audio samples\n", __FUNCTION__);
+            return false;
+        }
+        fifo.commitWrite(actualNumSamples);
+        swrSampleCount += actualNumSamples;
+        inNumSamples = 0;
+        if (actualNumSamples < spanNumSamples)
+            break;
     }
-    adaptor.setSrcInfo(audioFrameSrc->data, sampleRateAcquired, sampleTypeAcquired, numChannelsAcquired, actualNumSamplesSrc,
-        frame.timeStamp + (double(swrSampleCount) / sampleRateAcquired - double(inputSampleCount) / sampleRateRequested) * 1000000 + 0.5);
-    inputSampleCount += frame.numSamples;
-    swrSampleCount += actualNumSamplesSrc;
 
-    int ret = 0;
-    while (adaptor.getFullDstFrame())
+    bool ok = writeFifoFrames();
+    counters.queueDepth.store(fifo.size(), std::memory_order_relaxed);
+    return ok;
+}
+
+bool AudioStreamWriter::writeFifoFrames()
+{
+    unsigned char* spanData[8];
+    while (fifo.size() >= numSamplesDst)
     {
-        if (useExternTimeStamp)
-            audioFrameDst->pts = double(adaptor.getLastFullDstFrameTimeStamp() - *firstTimeStamp) / audioIncrementUnit + 0.5;
+        if (fifo.peek(spanData, numSamplesDst) == numSamplesDst)
+        {
+            for (int i = 0; i < 8; i++)
+                audioFrameSpan->data[i] = spanData[i];
+            audioFrameSpan->extended_data = audioFrameSpan->data;
+            bool ok = writeEncoderFrame(audioFrameSpan);
+            // The encoder has copied the samples when writeAudioFrame returns
+            fifo.drain(numSamplesDst);
+            if (!ok)
+                return false;
+        }
         else
-            audioFrameDst->pts = sampleCount;
-        //lprintf("audio frame ts = %lld\n", audioFrameDst->pts);
-        ret = writeAudioFrame(fmtCtx, stream, audioFrameDst);
-        if (ret != 0)
         {
-            lprintf("Error in %s, could not write audio frame, sampleCount = %d\n", __FUNCTION__, sampleCount);
-            sampleCount += numSamplesDst;
-            return false;
+            fifo.read(audioFrameDst->data, numSamplesDst);
+            if (!writeEncoderFrame(audioFrameDst))
+                return false;
         }
+    }
+    return true;
+}
+
+bool AudioStreamWriter::writeEncoderFrame(AVFrame* frame)
+{
+    if (useExternTimeStamp)
+    {
+        long long int timeStamp = fifoTimeStamp + 
+            double(sampleCount - fifoTimeStampSampleCount) / sampleRateAcquired * 1000000 + 0.5;
+        frame->pts = double(timeStamp - *firstTimeStamp) / audioIncrementUnit + 0.5;
+    }
+    else
+        frame->pts = sampleCount;
+    //lprintf("audio frame ts = %lld\n", frame->pts);
+    int ret = writeAudioFrame(fmtCtx, stream, frame, pktPool, &counters);
+    if (ret != 0)
+    {
+        lprintf("Error in %s, could not write audio frame, sampleCount = %lld\n", __FUNCTION__, sampleCount);
         sampleCount += numSamplesDst;
+        return false;
     }
+    sampleCount += numSamplesDst;
     return true;
 }
 
+bool AudioStreamWriter::isPassthrough() const
+{
+    return stream && !swrCtx;
+}
+
 void AudioStreamWriter::close()
 {
     // NOTICE!!!
@@ -217,15 +311,11 @@ void AudioStreamWriter::close()
         int ret = 0;
         while (ret == 0)
         {
-            ret = writeAudioFrame(fmtCtx, stream, NULL);
+            ret = writeAudioFrame(fmtCtx, stream, NULL, pktPool, &counters);
         }
     }
 
-    if (audioFrameSrc)
-    {
-        av_frame_free(&audioFrameSrc);
-        audioFrameSrc = 0;
-    }
+    freePacketBufferPool(&pktPool);
 
     if (audioFrameDst)
     {
@@ -233,12 +323,17 @@ void AudioStreamWriter::close()
         audioFrameDst = 0;
     }
 
-    if (swrCtx)
+    if (audioFrameSpan)
     {
-        swr_free(&swrCtx);
-        swrCtx = 0;
+        av_frame_free(&audioFrameSpan);
+        audioFrameSpan = 0;
     }
 
+    fifo.close();
+
+    if (swrCtx)
+        releaseSwrContext(&swrCtx);
+
     if (stream && stream->codec)
     {
         avcodec_close(stream->codec);
@@ -264,6 +359,8 @@ void BuiltinCodecVideoStreamWriter::init()
     stream = 0;
     yuvFrame = 0;
     swsCtx = 0;
+    fastConvert = 0;
+    pktPool = 0;
 
     framePixelTypeRequested = PixelTypeUnknown;
     framePixelFormatAcquired = AV_PIX_FMT_NONE;
@@ -271,31 +368,81 @@ void BuiltinCodecVideoStreamWriter::init()
     frameHeight = 0;
     frameCount = 0;
     frameRate = 0;
+    keyFrameIntervalInFrames = 0;
+    nextKeyFramePts = 0;
+    pendingFrames.clear();
 
     useExternTimeStamp = 0;
     firstTimeStamp = 0;
     videoIncrementUnit = 0;
 }
 
+// Codec context fields are set directly, encoder private options go to dict unless already given
+static void applyEncoderConfig(const EncoderConfig& config, AVCodecContext* codecCtx, AVDictionary** dict)
+{
+    char buf[32];
+    if (config.numThreads >= 0)
+        codecCtx->thread_count = config.numThreads;
+    if (config.threadMode == EncodeThreadFrame)
+        codecCtx->thread_type = FF_THREAD_FRAME;
+    else if (config.threadMode == EncodeThreadSlice)
+        codecCtx->thread_type = FF_THREAD_SLICE;
+    if (config.maxBFrames >= 0)
+        codecCtx->max_b_frames = config.maxBFrames;
+
+    if (config.rateControl == RateControlCRF)
+    {
+        // libx264 takes a nonzero bit rate as average bit rate mode
+        codecCtx->bit_rate = 0;
+        sprintf(buf, "%f", config.crf);
+        av_dict_set(dict, "crf", buf, AV_DICT_DONT_OVERWRITE);
+    }
+    else if (config.rateControl == RateControlCBR)
+    {
+        codecCtx->rc_min_rate = codecCtx->bit_rate;
+        codecCtx->rc_max_rate = codecCtx->bit_rate;
+        codecCtx->rc_buffer_size = config.bufferSize > 0 ? config.bufferSize : codecCtx->bit_rate;
+    }
+    else if (config.rateControl == RateControlVBR)
+    {
+        codecCtx->rc_max_rate = config.maxBitRate > 0 ? config.maxBitRate : codecCtx->bit_rate;
+        codecCtx->rc_buffer_size = config.bufferSize > 0 ? config.bufferSize : codecCtx->rc_max_rate;
+    }
+
+    if (config.preset.size())
+        av_dict_set(dict, "preset", config.preset.c_str(), AV_DICT_DONT_OVERWRITE);
+    if (config.tune.size())
+        av_dict_set(dict, "tune", config.tune.c_str(), AV_DICT_DONT_OVERWRITE);
+    if (config.lookahead >= 0)
+    {
+        sprintf(buf, "%d", config.lookahead);
+        av_dict_set(dict, "rc-lookahead", buf, AV_DICT_DONT_OVERWRITE);
+    }
+}
+
 bool BuiltinCodecVideoStreamWriter::open(AVFormatContext* outFmtCtx, const std::string& format, 
     int useExternTS, long long int* ptrFirstTS, int pixelType, int width, int height, 
-    double fps, int bps, const std::vector<Option>& options)
+    double fps, int bps, const std::vector<Option>& options, double keyFrameInterval, 
+    const EncoderConfig& encoderConfig)
 {
     close();
 
+    AVCodecID codecID = AV_CODEC_ID_NONE;
+    AVDictionary* dict = NULL;
+    AVCodec* codec = NULL;
+    AVPixelFormat pixFmt = getAVPixelFormat(pixelType);
+    AVPixelFormat encodePixFmt = AV_PIX_FMT_YUV420P;
+    int fpsNum, fpsDen, gop, ret;
     if (!isInterfacePixelType(pixelType))
     {
         lprintf("Error in %s, unsupported pixel type %d\n", __FUNCTION__, pixelType);
         goto FAIL;
     }
 
-    AVCodecID codecID = AV_CODEC_ID_NONE;
     if (format == "h264")
         codecID = AV_CODEC_ID_H264;
     
-    AVDictionary* dict = NULL;
     cvtOptions(options, &dict);
-    int fpsNum, fpsDen;
     cvtFrameRate(fps, &fpsNum, &fpsDen);
     if (fpsDen != 1 && fpsDen != 1001)
     {
@@ -303,31 +450,66 @@ bool BuiltinCodecVideoStreamWriter::open(AVFormatContext* outFmtCtx, const std::
             "denominator should be 1 or 1001, add video stream failed.\n", __FUNCTION__, fpsNum, fpsDen);
         goto FAIL;
     }
+    gop = keyFrameInterval > 0 ? keyFrameInterval * fps + 0.5 : fps + 0.5;
+    if (encoderConfig.gopLength > 0)
+        gop = encoderConfig.gopLength;
+
+    // Encode in the input pixel format if the encoder takes it, so that no conversion is needed
+    codec = avcodec_find_encoder(codecID != AV_CODEC_ID_NONE ? codecID : outFmtCtx->oformat->video_codec);
+    if (!codec)
+    {
+        lprintf("Error in %s, could not find video encoder\n", __FUNCTION__);
+        goto FAIL;
+    }
+    if (codec->pix_fmts)
+    {
+        for (int i = 0; codec->pix_fmts[i] != AV_PIX_FMT_NONE; i++)
+        {
+            if (codec->pix_fmts[i] == pixFmt)
+            {
+                encodePixFmt = pixFmt;
+                break;
+            }
+        }
+    }
+
+    // The codec is opened here after the encoder config is applied on top of the defaults addVideoStream sets
     stream = addVideoStream(outFmtCtx, NULL, codecID, dict, 
-        AV_PIX_FMT_YUV420P, width, height, fpsNum, fpsDen, fps + 0.5, bps, 1);
-    av_dict_free(&dict);
+        encodePixFmt, width, height, fpsNum, fpsDen, gop > 0 ? gop : 1, bps, 0);
     if (!stream)
     {
         lprintf("Error in %s, could not add video stream.\n", __FUNCTION__);
         goto FAIL;
     }
+    applyEncoderConfig(encoderConfig, stream->codec, &dict);
+    ret = avcodec_open2(stream->codec, codec, &dict);
+    av_dict_free(&dict);
+    if (ret < 0)
+    {
+        lprintf("Error in %s, could not open video codec: %s\n", __FUNCTION__, av_err2str_new(ret));
+        goto FAIL;
+    }
 
-    if (pixelType != AV_PIX_FMT_YUV420P)
+    if (pixFmt != encodePixFmt)
     {
-        yuvFrame = allocPicture(AV_PIX_FMT_YUV420P, width, height);
+        yuvFrame = allocPicture(encodePixFmt, width, height);
         if (!yuvFrame)
         {
             lprintf("Error in %s, could not allocate frame\n", __FUNCTION__);
             goto FAIL;
         }
 
-        swsCtx = sws_getContext(width, height, (AVPixelFormat)pixelType,
-            width, height, AV_PIX_FMT_YUV420P,
-            SWS_BICUBIC, NULL, NULL, NULL);
-        if (!swsCtx)
+        fastConvert = fastColorConvertEnabled.load(std::memory_order_relaxed) &&
+            supportsFastColorConvert(pixFmt, encodePixFmt);
+        if (!fastConvert)
         {
-            lprintf("Error in %s, could not initialize the conversion context\n", __FUNCTION__);
-            goto FAIL;
+            swsCtx = leaseSwsContext(width, height, pixFmt,
+                width, height, encodePixFmt, SWS_BICUBIC);
+            if (!swsCtx)
+            {
+                lprintf("Error in %s, could not initialize the conversion context\n", __FUNCTION__);
+                goto FAIL;
+            }
         }
     }
     else
@@ -340,12 +522,25 @@ bool BuiltinCodecVideoStreamWriter::open(AVFormatContext* outFmtCtx, const std::
         }
     }
 
+    // Only the scratch buffer the encoder writes into takes this upper bound, an encoded picture hardly
+    // exceeds twice the yuv420p size plus space for stream headers. Muxed packets get buffers of their own size.
+    pktPool = allocPacketBufferPool(FFMAX(width * height * 2, av_image_get_buffer_size(encodePixFmt, width, height, 1)) + 65536);
+    if (!pktPool)
+    {
+        lprintf("Error in %s, could not allocate packet buffer pool\n", __FUNCTION__);
+        goto FAIL;
+    }
+
     fmtCtx = outFmtCtx;
     framePixelTypeRequested = pixelType;
-    framePixelFormatAcquired = AV_PIX_FMT_YUV420P;
+    framePixelFormatAcquired = encodePixFmt;
     frameWidth = width;
     frameHeight = height;
     frameRate = fps;
+    // Forced key frames keep to gopLength if it is given, so that they fall on the gops of the encoder
+    keyFrameIntervalInFrames = keyFrameInterval <= 0 ? 0 :
+        (encoderConfig.gopLength > 0 ? encoderConfig.gopLength : keyFrameInterval * fps);
+    nextKeyFramePts = 0;
 
     videoIncrementUnit = 1.0 / fps * 1000000;
     useExternTimeStamp = useExternTS;
@@ -360,6 +555,9 @@ FAIL:
 
 bool BuiltinCodecVideoStreamWriter::writeFrame(const AudioVideoFrame2& frame)
 {
+    TraceScope trace("VideoStreamWriter::writeFrame", stream ? stream->index : -1, frame.timeStamp);
+    // Latency includes the conversion below
+    long long int writeBeginTime = getNanoSecCount();
     if (!frame.data[0] || frame.mediaType != VIDEO ||
         frame.width != frameWidth || frame.height != frameHeight ||
         frame.pixelType != framePixelTypeRequested)
@@ -375,9 +573,20 @@ bool BuiltinCodecVideoStreamWriter::writeFrame(const AudioVideoFrame2& frame)
     int ret = 0;
     if (swsCtx)
     {
+        long long int beginTime = getNanoSecCount();
         sws_scale(swsCtx,
             (const uint8_t * const *)frame.data, frame.steps,
             0, frame.height, yuvFrame->data, yuvFrame->linesize);
+        addCounter(counters.convertNanoSec, getNanoSecCount() - beginTime);
+    }
+    else if (fastConvert)
+    {
+        // Same matrix and range as the default of swscale
+        long long int beginTime = getNanoSecCount();
+        fastColorConvert(frame.data, frame.steps, getAVPixelFormat(framePixelTypeRequested),
+            yuvFrame->data, yuvFrame->linesize, framePixelFormatAcquired,
+            frameWidth, frameHeight, ColorMatrixBT601, 0);
+        addCounter(counters.convertNanoSec, getNanoSecCount() - beginTime);
     }
     else
     {
@@ -401,14 +610,32 @@ bool BuiltinCodecVideoStreamWriter::writeFrame(const AudioVideoFrame2& frame)
                 "which may cause video encoder warning, skip writing this frame, "
                 "more info, first pts = %lld, frame pts = %lld, inc unit %f\n", 
                 __FUNCTION__, newPts, yuvFrame->pts, *firstTimeStamp, frame.timeStamp, videoIncrementUnit);
+            addCounter(counters.numDroppedFrames, 1);
             return true;
         }
         yuvFrame->pts = newPts;
     }
     else
         yuvFrame->pts = frameCount;
+
+    // Force a key frame on every interval boundary, so that segments cut by
+    // the muxer start exactly at the same time in every output stream.
+    yuvFrame->pict_type = AV_PICTURE_TYPE_NONE;
+    if (keyFrameIntervalInFrames > 0 && yuvFrame->pts >= nextKeyFramePts - 0.001)
+    {
+        yuvFrame->pict_type = AV_PICTURE_TYPE_I;
+        nextKeyFramePts = (floor(yuvFrame->pts / keyFrameIntervalInFrames + 0.001) + 1) * keyFrameIntervalInFrames;
+    }
     //lprintf("video frame pts = %lld\n", yuvFrame->pts);
-    ret = writeVideoFrame(fmtCtx, stream, yuvFrame);
+    long long int packetPts;
+    // No encoder holds this many frames, the oldest ones were dropped by the encoder
+    if (pendingFrames.size() >= 256)
+        pendingFrames.pop_front();
+    pendingFrames.push_back(std::make_pair((long long int)yuvFrame->pts, writeBeginTime));
+    int keyPacket;
+    ret = writeVideoFrame(fmtCtx, stream, yuvFrame, pktPool, &counters, &packetPts, &keyPacket);
+    countLatency(packetPts);
+    numKeyPackets += keyPacket;
     if (ret != 0)
     {
         lprintf("Error in %s, could not write video frame, frameCount = %d\n", __FUNCTION__, frameCount);
@@ -419,17 +646,49 @@ bool BuiltinCodecVideoStreamWriter::writeFrame(const AudioVideoFrame2& frame)
     return true;
 }
 
+void BuiltinCodecVideoStreamWriter::countLatency(long long int pts)
+{
+    if (pts == AV_NOPTS_VALUE)
+        return;
+
+    // Packets leave in decoding order, pts is not in order if there are b frames
+    for (std::deque<std::pair<long long int, long long int> >::iterator itr = pendingFrames.begin();
+        itr != pendingFrames.end(); ++itr)
+    {
+        if (itr->first == pts)
+        {
+            long long int latency = getNanoSecCount() - itr->second;
+            addCounter(counters.latencyNanoSec, latency);
+            if (latency > counters.maxLatencyNanoSec.load(std::memory_order_relaxed))
+                counters.maxLatencyNanoSec.store(latency, std::memory_order_relaxed);
+            pendingFrames.erase(itr);
+            return;
+        }
+    }
+}
+
+bool BuiltinCodecVideoStreamWriter::isPassthrough() const
+{
+    return stream && !swsCtx && !fastConvert;
+}
+
 void BuiltinCodecVideoStreamWriter::close()
 {
     if (fmtCtx && fmtCtx->pb && stream)
     {
         int ret = 0;
+        long long int packetPts;
+        int keyPacket;
         while (ret == 0)
         {
-            ret = writeVideoFrame(fmtCtx, stream, NULL);
+            ret = writeVideoFrame(fmtCtx, stream, NULL, pktPool, &counters, &packetPts, &keyPacket);
+            countLatency(packetPts);
+            numKeyPackets += keyPacket;
         }
     }
 
+    freePacketBufferPool(&pktPool);
+
     if (yuvFrame)
     {
         av_frame_free(&yuvFrame);
@@ -437,10 +696,7 @@ void BuiltinCodecVideoStreamWriter::close()
     }
 
     if (swsCtx)
-    {
-        sws_freeContext(swsCtx);
-        swsCtx = 0;
-    }
+        releaseSwsContext(&swsCtx);
 
     if (stream && stream->codec)
     {
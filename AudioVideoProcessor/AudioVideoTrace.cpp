@@ -0,0 +1,156 @@
+#include "AudioVideoTrace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <stdio.h>
+
+namespace avp
+{
+
+std::atomic<int> traceEnabled(0);
+
+long long int getTraceNanoSecCount()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct TraceEvent
+{
+    const char* name;
+    long long int beginNanoSec;
+    long long int endNanoSec;
+    long long int pts;
+    int streamIndex;
+    // Rings are reused by later threads, so each event keeps the thread that recorded it
+    int threadIndex;
+};
+
+// Single producer ring, the owner thread writes events and only advances writeCount,
+// the dumping thread copies events without taking them out of the ring.
+struct TraceBuffer
+{
+    enum { Capacity = 16384 };
+    TraceEvent events[Capacity];
+    std::atomic<long long int> writeCount;
+    // Events before startCount are discarded, guarded by traceMutex
+    long long int startCount;
+    int threadIndex;
+};
+
+static std::mutex traceMutex;
+// A buffer is only allocated for a thread recording spans while tracing is enabled.
+// When the thread exits, its buffer goes to freeTraceBuffers and is taken by the next
+// thread needing one, the spans recorded so far are kept until they are overwritten.
+static std::vector<TraceBuffer*> traceBuffers;
+static std::vector<TraceBuffer*> freeTraceBuffers;
+static int numTraceThreads = 0;
+static long long int traceOriginNanoSec = 0;
+static AVP_THREAD_LOCAL TraceBuffer* threadTraceBuffer = 0;
+
+static void releaseThreadTraceBuffer(void* data)
+{
+    std::lock_guard<std::mutex> lg(traceMutex);
+    freeTraceBuffers.push_back((TraceBuffer*)data);
+}
+
+static TraceBuffer* getThreadTraceBuffer()
+{
+    if (!threadTraceBuffer)
+    {
+        TraceBuffer* buffer = 0;
+        {
+            std::lock_guard<std::mutex> lg(traceMutex);
+            if (!freeTraceBuffers.empty())
+            {
+                buffer = freeTraceBuffers.back();
+                freeTraceBuffers.pop_back();
+            }
+            else
+            {
+                buffer = new TraceBuffer;
+                buffer->writeCount = 0;
+                buffer->startCount = 0;
+                traceBuffers.push_back(buffer);
+            }
+            buffer->threadIndex = numTraceThreads++;
+        }
+        threadTraceBuffer = buffer;
+        callAtThreadExit(releaseThreadTraceBuffer, buffer);
+    }
+    return threadTraceBuffer;
+}
+
+void recordTraceEvent(const char* name, long long int beginNanoSec, long long int endNanoSec,
+    int streamIndex, long long int pts)
+{
+    TraceBuffer* buffer = getThreadTraceBuffer();
+    long long int w = buffer->writeCount.load(std::memory_order_relaxed);
+    TraceEvent& event = buffer->events[w % TraceBuffer::Capacity];
+    event.name = name;
+    event.beginNanoSec = beginNanoSec;
+    event.endNanoSec = endNanoSec;
+    event.pts = pts;
+    event.streamIndex = streamIndex;
+    event.threadIndex = buffer->threadIndex;
+    buffer->writeCount.store(w + 1, std::memory_order_release);
+}
+
+void setTraceEnabled(bool enable)
+{
+    std::lock_guard<std::mutex> lg(traceMutex);
+    if (enable && !traceEnabled.load(std::memory_order_relaxed))
+    {
+        // Start a new trace, spans of the previous session are dropped
+        int numBuffers = traceBuffers.size();
+        for (int i = 0; i < numBuffers; i++)
+            traceBuffers[i]->startCount = traceBuffers[i]->writeCount.load(std::memory_order_acquire);
+        traceOriginNanoSec = getTraceNanoSecCount();
+    }
+    traceEnabled.store(enable ? 1 : 0, std::memory_order_relaxed);
+}
+
+bool dumpTraceEvents(const std::string& fileName)
+{
+    FILE* file = fopen(fileName.c_str(), "w");
+    if (!file)
+    {
+        lprintf("Error in %s, could not open file %s\n", __FUNCTION__, fileName.c_str());
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lg(traceMutex);
+    std::vector<TraceEvent> events(TraceBuffer::Capacity);
+    bool first = true;
+    fprintf(file, "{\"traceEvents\":[\n");
+    int numBuffers = traceBuffers.size();
+    for (int i = 0; i < numBuffers; i++)
+    {
+        TraceBuffer* buffer = traceBuffers[i];
+        long long int end = buffer->writeCount.load(std::memory_order_acquire);
+        long long int begin = std::max(buffer->startCount, end - TraceBuffer::Capacity);
+        for (long long int j = begin; j < end; j++)
+            events[j - begin] = buffer->events[j % TraceBuffer::Capacity];
+        // The owner thread may have overwritten the oldest events while copying, drop them,
+        // including the slot of event writeCount it may be writing right now
+        std::atomic_thread_fence(std::memory_order_acquire);
+        long long int overwritten = buffer->writeCount.load(std::memory_order_relaxed) - TraceBuffer::Capacity + 1;
+        for (long long int j = std::max(begin, overwritten); j < end; j++)
+        {
+            const TraceEvent& event = events[j - begin];
+            fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                "\"args\":{\"stream\":%d,\"pts\":%lld}}",
+                first ? "" : ",\n", event.name, event.threadIndex,
+                (event.beginNanoSec - traceOriginNanoSec) / 1000.0, (event.endNanoSec - event.beginNanoSec) / 1000.0,
+                event.streamIndex, event.pts);
+            first = false;
+        }
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(file);
+    return true;
+}
+
+}
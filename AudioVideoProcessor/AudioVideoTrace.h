@@ -0,0 +1,43 @@
+#pragma once
+
+#include "AudioVideoProcessor.h"
+#include "AudioVideoGlobal.h"
+
+#include <atomic>
+
+namespace avp
+{
+
+extern std::atomic<int> traceEnabled;
+
+long long int getTraceNanoSecCount();
+
+// Append one span to the ring buffer of the calling thread,
+// the oldest spans are overwritten when the ring is full
+void recordTraceEvent(const char* name, long long int beginNanoSec, long long int endNanoSec,
+    int streamIndex, long long int pts);
+
+// Records a span from construction to destruction if tracing is enabled at construction,
+// name should be a string literal since only the pointer is kept
+struct TraceScope
+{
+    TraceScope(const char* name_, int streamIndex_ = -1, long long int pts_ = -1) :
+        name(traceEnabled.load(std::memory_order_relaxed) ? name_ : 0),
+        streamIndex(streamIndex_), pts(pts_), beginNanoSec(name ? getTraceNanoSecCount() : 0)
+    {}
+    ~TraceScope()
+    {
+        if (name)
+            recordTraceEvent(name, beginNanoSec, getTraceNanoSecCount(), streamIndex, pts);
+    }
+    const char* name;
+    int streamIndex;
+    long long int pts;
+    long long int beginNanoSec;
+
+private:
+    TraceScope(const TraceScope&);
+    TraceScope& operator=(const TraceScope&);
+};
+
+}
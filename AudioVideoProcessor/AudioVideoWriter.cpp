@@ -173,6 +173,7 @@ bool AudioVideoWriter::Impl::open(const char* fileName, const char* formatName,
     //}
 
     int ret;
+    AVDictionary* dict = NULL;
 
     const char* theFormatName = NULL;
     if (formatName && strlen(formatName))
@@ -190,7 +191,6 @@ bool AudioVideoWriter::Impl::open(const char* fileName, const char* formatName,
 
     fmt = fmtCtx->oformat;
 
-    AVDictionary* dict = NULL;
     cvtOptions(options, &dict);
 
     if (openAudio)
@@ -1,6 +1,7 @@
 #include "AudioVideoProcessor.h"
 #include "AudioVideoGlobal.h"
 #include "AudioVideoStream.h"
+#include "FFmpegUtil.h"
 //#include "CheckRTSPConnect.h"
 #include "boost/algorithm/string.hpp"
 
@@ -20,6 +21,22 @@ extern "C"
 }
 #endif
 
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#define makeDir(dirName) _mkdir(dirName)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#define makeDir(dirName) mkdir(dirName, 0755)
+#endif
+#include <stdio.h>
+
 static char err_buf[AV_ERROR_MAX_STRING_SIZE];
 #define av_err2str_new(errnum) \
     av_make_error_string(err_buf, AV_ERROR_MAX_STRING_SIZE, errnum)
@@ -31,15 +48,30 @@ static char time_str_buf[AV_TS_MAX_STRING_SIZE];
 namespace avp
 {
 
+// Writes after a possible segment cut which look at the hls playlist, the muxer passes on
+// the packet of the cut within a few writes of the other streams
+static const int maxPlaylistChecks = 16;
+
 struct AudioVideoWriter3::Impl
 {
     Impl();
     ~Impl();
 
     void initAll();
+    // videoOptions are added to options for the video encoders only
     bool open(const std::string& fileName, const std::string& formatName, bool useExternTimeStamp,
+        const std::vector<OutputStreamProperties>& props, const std::vector<Option>& options = std::vector<Option>(),
+        const std::vector<Option>& muxerOptions = std::vector<Option>(), double keyFrameInterval = 0,
+        const std::vector<Option>& videoOptions = std::vector<Option>());
+    bool openPackager(const std::string& dirName, int packagerType, double segmentDuration, bool useExternTimeStamp,
         const std::vector<OutputStreamProperties>& props, const std::vector<Option>& options = std::vector<Option>());
     bool write(const AudioVideoFrame2& frame, int index);
+    // Replace playlistName by a copy of the playlist the hls muxer rewrites in place,
+    // returns true if it has grown and is replaced
+    bool publishPlaylist();
+    void setLowLatency(bool lowLatency, bool intraRefresh);
+    bool isPassthrough(int index) const;
+    void getStats(AudioVideoStats& stats) const;
     void close();
 
     AVFormatContext* fmtCtx;
@@ -48,10 +80,23 @@ struct AudioVideoWriter3::Impl
     long long int firstTimeStamp;
 	int firstTimeStampSet;
     int isOpened;
+    // HLS packager only, the muxer writes workPlaylistName, players read playlistName
+    std::string playlistName;
+    std::string workPlaylistName;
+    long long int publishedPlaylistSize;
+    // The playlist is looked at by the next playlistChecks writes, after a possible segment cut
+    int playlistChecks;
+    long long int segmentDurationMicroSec;
+    long long int nextSegmentTimeStamp;
+    // Kept across close
+    int lowLatency;
+    int intraRefresh;
 };
 
 AudioVideoWriter3::Impl::Impl()
 {
+    lowLatency = 0;
+    intraRefresh = 0;
     initAll();
 }
 
@@ -68,10 +113,17 @@ void AudioVideoWriter3::Impl::initAll()
     firstTimeStamp = -1LL;
 	firstTimeStampSet = 0;
     isOpened = 0;
+    playlistName.clear();
+    workPlaylistName.clear();
+    publishedPlaylistSize = -1;
+    playlistChecks = 0;
+    segmentDurationMicroSec = 0;
+    nextSegmentTimeStamp = 0;
 }
 
 bool AudioVideoWriter3::Impl::open(const std::string& fileName, const std::string& formatName, bool externTimeStamp,
-    const std::vector<OutputStreamProperties>& props, const std::vector<Option>& options)
+    const std::vector<OutputStreamProperties>& props, const std::vector<Option>& options,
+    const std::vector<Option>& muxerOptions, double keyFrameInterval, const std::vector<Option>& videoOptions)
 {
     close();
 
@@ -87,7 +139,7 @@ bool AudioVideoWriter3::Impl::open(const std::string& fileName, const std::strin
         else if (prop.mediaType == VIDEO)
         {
             if (prop.width < 0 || prop.width & 1 || prop.height < 0 || prop.height & 1 ||
-                (prop.pixelType != PixelTypeBGR24 && prop.pixelType != PixelTypeBGR32))
+                !isInterfacePixelType(prop.pixelType))
                 return false;
         }
     }
@@ -102,6 +154,31 @@ bool AudioVideoWriter3::Impl::open(const std::string& fileName, const std::strin
     //}
 
     int ret;
+    AVDictionary* muxerDict = NULL;
+
+    // Overrides are applied to copies, the caller's properties and options are not changed
+    std::vector<OutputStreamProperties> streamProps(props);
+    std::vector<Option> videoCodecOptions(options);
+    videoCodecOptions.insert(videoCodecOptions.end(), videoOptions.begin(), videoOptions.end());
+    if (lowLatency)
+    {
+        for (int i = 0; i < numStreams; i++)
+        {
+            if (streamProps[i].mediaType != VIDEO)
+                continue;
+            EncoderConfig& config = streamProps[i].encoderConfig;
+            if (config.numThreads < 0)
+                config.numThreads = 0;
+            config.threadMode = EncodeThreadSlice;
+            config.tune = "zerolatency";
+            config.lookahead = 0;
+            config.maxBFrames = 0;
+        }
+        if (intraRefresh)
+            videoCodecOptions.push_back(std::make_pair("intra-refresh", "1"));
+    }
+    // A forced key frame would be a full intra picture again, which intra refresh is there to avoid
+    double videoKeyFrameInterval = (lowLatency && intraRefresh) ? 0 : keyFrameInterval;
 
     const char* theFormatName = NULL;
     if (formatName.size())
@@ -117,12 +194,12 @@ bool AudioVideoWriter3::Impl::open(const std::string& fileName, const std::strin
 
     for (int i = 0; i < numStreams; i++)
     {
-        const OutputStreamProperties& prop = props[i];
+        const OutputStreamProperties& prop = streamProps[i];
         if (prop.mediaType == AUDIO)
         {
             AudioStreamWriter* audioStream = new AudioStreamWriter;
             if (!audioStream->open(fmtCtx, prop.format, externTimeStamp, &firstTimeStamp,
-                prop.sampleType, prop.channelLayout, prop.sampleRate, prop.bitRate, options))
+                prop.sampleType, prop.channelLayout, prop.sampleRate, prop.bitRate, options, prop.resampleOptions))
             {
                 lprintf("Error open audio stream.\n");
                 goto FAIL;
@@ -138,7 +215,8 @@ bool AudioVideoWriter3::Impl::open(const std::string& fileName, const std::strin
             //else
                 videoStream = new BuiltinCodecVideoStreamWriter;
             if (!videoStream->open(fmtCtx, prop.format, externTimeStamp, &firstTimeStamp,
-                prop.pixelType, prop.width, prop.height, prop.frameRate, prop.bitRate, options))
+                prop.pixelType, prop.width, prop.height, prop.frameRate, prop.bitRate, videoCodecOptions, videoKeyFrameInterval,
+                prop.encoderConfig))
             {
                 lprintf("Error open video stream.\n");
                 goto FAIL;
@@ -162,8 +240,19 @@ bool AudioVideoWriter3::Impl::open(const std::string& fileName, const std::strin
         }
     }
 
+    if (lowLatency)
+    {
+        // Zero means waiting for a packet of every stream before writing, the smallest positive value
+        // writes a packet as soon as a later one of another stream comes, and the io buffer is
+        // flushed after every packet
+        fmtCtx->max_interleave_delta = 1;
+        fmtCtx->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+    }
+
     /* Write the stream header, if any. */
-    ret = avformat_write_header(fmtCtx, NULL);
+    cvtOptions(muxerOptions, &muxerDict);
+    ret = avformat_write_header(fmtCtx, &muxerDict);
+    av_dict_free(&muxerDict);
     if (ret < 0)
     {
         lprintf("Error occurred when opening output file: %s\n",
@@ -179,6 +268,66 @@ FAIL:
     return false;
 }
 
+bool AudioVideoWriter3::Impl::openPackager(const std::string& dirName, int packagerType, double segmentDuration,
+    bool externTimeStamp, const std::vector<OutputStreamProperties>& props, const std::vector<Option>& options)
+{
+    if (dirName.empty() || segmentDuration <= 0 ||
+        (packagerType != PackagerTypeHLS && packagerType != PackagerTypeDASH))
+    {
+        lprintf("Error in %s, invalid packager arguments, dir name %s, packager type %d, segment duration %f\n",
+            __FUNCTION__, dirName.c_str(), packagerType, segmentDuration);
+        return false;
+    }
+
+    // The directory may already exist, failure here is reported when the muxer opens the first segment.
+    makeDir(dirName.c_str());
+
+    // Every video stream gets a closed GOP exactly one segment long,
+    // scene cut detection must not insert extra key frames between segment boundaries.
+    std::vector<Option> videoOptions;
+    videoOptions.push_back(std::make_pair("sc_threshold", "0"));
+    videoOptions.push_back(std::make_pair("forced-idr", "1"));
+
+    char buf[64];
+    std::vector<Option> muxerOptions;
+    std::string fileName, formatName;
+    if (packagerType == PackagerTypeHLS)
+    {
+        // hls muxer rewrites the playlist in place at every segment, a player could read it half written.
+        // The muxer writes a work file instead, which is copied and renamed to index.m3u8 by publishPlaylist.
+        formatName = "hls";
+        fileName = dirName + "/index.m3u8.part";
+        sprintf(buf, "%f", segmentDuration);
+        muxerOptions.push_back(std::make_pair("hls_time", buf));
+        muxerOptions.push_back(std::make_pair("hls_list_size", "0"));
+        muxerOptions.push_back(std::make_pair("hls_segment_filename", dirName + "/segment%05d.ts"));
+    }
+    else
+    {
+        // dash muxer writes fragmented mp4 segments next to the manifest,
+        // and writes the manifest to a temporary file renamed over manifest.mpd itself.
+        formatName = "dash";
+        fileName = dirName + "/manifest.mpd";
+        sprintf(buf, "%lld", (long long int)(segmentDuration * 1000000 + 0.5));
+        muxerOptions.push_back(std::make_pair("min_seg_duration", buf));
+        muxerOptions.push_back(std::make_pair("use_template", "1"));
+        muxerOptions.push_back(std::make_pair("use_timeline", "1"));
+    }
+
+    if (!open(fileName, formatName, externTimeStamp, props, options, muxerOptions, segmentDuration, videoOptions))
+        return false;
+    if (packagerType == PackagerTypeHLS)
+    {
+        workPlaylistName = fileName;
+        playlistName = dirName + "/index.m3u8";
+        publishedPlaylistSize = -1;
+        playlistChecks = 0;
+        segmentDurationMicroSec = segmentDuration * 1000000 + 0.5;
+        nextSegmentTimeStamp = segmentDurationMicroSec;
+    }
+    return true;
+}
+
 bool AudioVideoWriter3::Impl::write(const AudioVideoFrame2& frame, int index)
 {
     if (!isOpened)
@@ -187,7 +336,7 @@ bool AudioVideoWriter3::Impl::write(const AudioVideoFrame2& frame, int index)
     if (frame.mediaType != AUDIO && frame.mediaType != VIDEO)
         return false;
 
-    if (index < 0 || index >= streams.size())
+    if (index < 0 || index >= (int)streams.size())
         return false;
 
     if (useExternTimeStamp)
@@ -213,7 +362,105 @@ bool AudioVideoWriter3::Impl::write(const AudioVideoFrame2& frame, int index)
         }
     }
 
-    return streams[index]->writeFrame(frame);
+    long long int numKeyPackets = streams[index]->numKeyPackets;
+    bool ok = streams[index]->writeFrame(frame);
+    if (!playlistName.empty())
+    {
+        // The muxer rewrites the playlist only when it cuts a segment, at a video key packet, or at any packet
+        // past the segment duration if there is no video. The packet may be held for a few writes to interleave
+        // the streams, so the playlist is looked at by the writes that follow instead of by every write.
+        if (streams[index]->numKeyPackets != numKeyPackets)
+            playlistChecks = maxPlaylistChecks;
+        if (useExternTimeStamp && frame.timeStamp - firstTimeStamp >= nextSegmentTimeStamp)
+        {
+            playlistChecks = maxPlaylistChecks;
+            nextSegmentTimeStamp =
+                ((frame.timeStamp - firstTimeStamp) / segmentDurationMicroSec + 1) * segmentDurationMicroSec;
+        }
+        if (playlistChecks > 0)
+            playlistChecks = publishPlaylist() ? 0 : playlistChecks - 1;
+    }
+    return ok;
+}
+
+bool AudioVideoWriter3::Impl::publishPlaylist()
+{
+    // The playlist only grows, as all the segments are listed
+    struct stat st;
+    if (stat(workPlaylistName.c_str(), &st) != 0 || st.st_size == publishedPlaylistSize)
+        return false;
+
+    std::vector<char> content(st.st_size);
+    FILE* src = fopen(workPlaylistName.c_str(), "rb");
+    if (!src)
+        return false;
+    size_t numRead = fread(content.data(), 1, content.size(), src);
+    fclose(src);
+
+    std::string tempName = playlistName + ".tmp";
+    FILE* dst = fopen(tempName.c_str(), "wb");
+    if (!dst)
+    {
+        lprintf("Error in %s, could not open %s\n", __FUNCTION__, tempName.c_str());
+        return false;
+    }
+    bool ok = fwrite(content.data(), 1, numRead, dst) == numRead;
+    ok = (fclose(dst) == 0) && ok;
+#ifdef _WIN32
+    ok = ok && MoveFileExA(tempName.c_str(), playlistName.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    ok = ok && rename(tempName.c_str(), playlistName.c_str()) == 0;
+#endif
+    if (!ok)
+    {
+        lprintf("Error in %s, could not update %s\n", __FUNCTION__, playlistName.c_str());
+        return false;
+    }
+    publishedPlaylistSize = numRead;
+    return true;
+}
+
+void AudioVideoWriter3::Impl::setLowLatency(bool lowLatency_, bool intraRefresh_)
+{
+    lowLatency = lowLatency_;
+    intraRefresh = intraRefresh_;
+}
+
+bool AudioVideoWriter3::Impl::isPassthrough(int index) const
+{
+    if (!isOpened || index < 0 || index >= (int)streams.size())
+        return false;
+
+    return streams[index]->isPassthrough();
+}
+
+void AudioVideoWriter3::Impl::getStats(AudioVideoStats& stats) const
+{
+    stats = AudioVideoStats();
+    if (!isOpened)
+        return;
+
+    // Each stream writer adds exactly one AVStream, so indexes of streams and fmtCtx->streams match
+    int numStreams = streams.size();
+    stats.streams.resize(numStreams);
+    for (int i = 0; i < numStreams; i++)
+    {
+        StreamStats& curr = stats.streams[i];
+        streams[i]->counters.get(curr);
+        int mediaType = fmtCtx->streams[i]->codec->codec_type;
+        curr.mediaType = mediaType == AVMEDIA_TYPE_AUDIO ? AUDIO : (mediaType == AVMEDIA_TYPE_VIDEO ? VIDEO : UNKNOWN);
+        stats.total.numPackets += curr.numPackets;
+        stats.total.numBytes += curr.numBytes;
+        stats.total.numFrames += curr.numFrames;
+        stats.total.numDroppedFrames += curr.numDroppedFrames;
+        stats.total.queueDepth += curr.queueDepth;
+        stats.total.convertNanoSec += curr.convertNanoSec;
+        stats.total.encodeNanoSec += curr.encodeNanoSec;
+        stats.total.muxNanoSec += curr.muxNanoSec;
+        stats.total.latencyNanoSec += curr.latencyNanoSec;
+        if (curr.maxLatencyNanoSec > stats.total.maxLatencyNanoSec)
+            stats.total.maxLatencyNanoSec = curr.maxLatencyNanoSec;
+    }
 }
 
 void AudioVideoWriter3::Impl::close()
@@ -224,7 +471,15 @@ void AudioVideoWriter3::Impl::close()
     streams.clear();
 
     if (isOpened && fmtCtx)
+    {
         av_write_trailer(fmtCtx);
+        // The final playlist with the end tag
+        if (!playlistName.empty())
+        {
+            publishPlaylist();
+            remove(workPlaylistName.c_str());
+        }
+    }
 
     if (fmtCtx && !(fmtCtx->oformat->flags & AVFMT_NOFILE))
     {
@@ -252,11 +507,33 @@ bool AudioVideoWriter3::open(const std::string& fileName, const std::string& for
     return ptrImpl->open(fileName, formatName, useExternTimeStamp, props, options);
 }
 
+bool AudioVideoWriter3::openPackager(const std::string& dirName, int packagerType, double segmentDuration,
+    bool useExternTimeStamp, const std::vector<OutputStreamProperties>& props, const std::vector<Option>& options)
+{
+    initFFMPEG();
+    return ptrImpl->openPackager(dirName, packagerType, segmentDuration, useExternTimeStamp, props, options);
+}
+
 bool AudioVideoWriter3::write(const AudioVideoFrame2& frame, int index)
 {
     return ptrImpl->write(frame, index);
 }
 
+void AudioVideoWriter3::setLowLatency(bool lowLatency, bool intraRefresh)
+{
+    ptrImpl->setLowLatency(lowLatency, intraRefresh);
+}
+
+bool AudioVideoWriter3::isPassthrough(int index) const
+{
+    return ptrImpl->isPassthrough(index);
+}
+
+void AudioVideoWriter3::getStats(AudioVideoStats& stats) const
+{
+    ptrImpl->getStats(stats);
+}
+
 void AudioVideoWriter3::close()
 {
     ptrImpl->close();
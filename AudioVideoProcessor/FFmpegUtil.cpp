@@ -1,6 +1,8 @@
 ﻿#include "FFmpegUtil.h"
 #include "AudioVideoProcessor.h"
 #include "AudioVideoGlobal.h"
+#include "AudioVideoTrace.h"
+#include "AudioVideoColorConvert.h"
 
 #ifdef __cplusplus
 #define __STDC_CONSTANT_MACROS
@@ -13,10 +15,16 @@ extern "C"
 #include <libavutil/timestamp.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
+#include <libavutil/time.h>
 #ifdef __cplusplus
 }
 #endif
 
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <vector>
+
 #define PRINT_REDUNDANT_LOG 0
 
 static char err_buf[AV_ERROR_MAX_STRING_SIZE];
@@ -74,7 +82,7 @@ int openCodecContext(int *streamIdx, const char *srcFileName,
 
 int decodeVideoPacket(AVPacket* pkt, AVCodecContext* videoDecCtx, AVFrame* frame, 
     int width, int height, AVPixelFormat pixFormat, SwsContext* swsCtx,
-    uint8_t* videoDstData[4], int videoDstLinesize[4], int *videoFrameCount, int *gotFrame)
+    uint8_t* videoDstData[4], int videoDstLinesize[4], int *videoFrameCount, int *gotFrame, StreamCounters* counters)
 {
     int ret = 0;
     int decoded = pkt->size;
@@ -82,11 +90,20 @@ int decodeVideoPacket(AVPacket* pkt, AVCodecContext* videoDecCtx, AVFrame* frame
 
     *gotFrame = 0;
 
+    long long int beginTime = counters ? getNanoSecCount() : 0;
     /* decode video frame */
     ret = avcodec_decode_video2(videoDecCtx, frame, gotFrame, pkt);
+    if (counters)
+    {
+        long long int endTime = getNanoSecCount();
+        addCounter(counters->decodeNanoSec, endTime - beginTime);
+        beginTime = endTime;
+    }
     if (ret < 0) 
     {
         lprintf("Error in %s when decoding video frame (%s)\n", __FUNCTION__, av_err2str_new(ret));
+        if (counters)
+            addCounter(counters->numDroppedFrames, 1);
         return ret;
     }
 
@@ -95,17 +112,16 @@ int decodeVideoPacket(AVPacket* pkt, AVCodecContext* videoDecCtx, AVFrame* frame
         if (frame->width != width || frame->height != height ||
             frame->format != pixFormat)
         {
-            /* To handle this change, one could call av_image_alloc again and
-                * decode the following frames into another rawvideo file. */
-            lprintf("Error in %s, Width, height and pixel format have to be "
-                    "constant, but the width, height or "
+            /* The decoded frame is kept but not converted, callers which could 
+               rebuild their conversion for the new format go on with it. */
+            lprintf("In %s, the width, height or "
                     "pixel format of the input video changed:\n"
                     "old: width = %d, height = %d, format = %s\n"
                     "new: width = %d, height = %d, format = %s\n",
                     __FUNCTION__, width, height, av_get_pix_fmt_name(pixFormat),
                     frame->width, frame->height,
                     av_get_pix_fmt_name((enum AVPixelFormat)(frame->format)));
-            return -1;
+            return AVERROR_INPUT_CHANGED;
         }
 
         (*videoFrameCount)++;
@@ -116,15 +132,17 @@ int decodeVideoPacket(AVPacket* pkt, AVCodecContext* videoDecCtx, AVFrame* frame
                 av_ts2timestr_new(frame->pts, &videoDecCtx->time_base));
 #endif
 
-        //ztool::Timer t;
         if (swsCtx)
         {
             sws_scale(swsCtx,
                 (const uint8_t * const *)frame->data, frame->linesize,
                 0, height, videoDstData, videoDstLinesize);
         }
-        //t.end();
-        //printf("sws time = %f\n", t.elapse());
+        if (counters)
+        {
+            addCounter(counters->convertNanoSec, getNanoSecCount() - beginTime);
+            addCounter(counters->numFrames, 1);
+        }
     }
 
     return decoded;
@@ -245,7 +263,7 @@ int decodeAudioPacket(AVPacket* pkt, AVCodecContext* audioDecCtx, AVFrame* frame
 int decodeAudioPacket(AVPacket* pkt, AVCodecContext* audioDecCtx, AVFrame* frame,
     int sampleRate, AVSampleFormat sampleFmt, int numChannels, int* numSamples,
     SwrContext* swrCtx, AVSampleFormat dstSampleFmt, unsigned char* audioDstData[8], int* audioDstLineSize,
-    int* gotFrame)
+    int* gotFrame, StreamCounters* counters)
 {
     int ret = 0;
     int decoded = pkt->size;
@@ -253,11 +271,20 @@ int decodeAudioPacket(AVPacket* pkt, AVCodecContext* audioDecCtx, AVFrame* frame
 
     *gotFrame = 0;
 
+    long long int beginTime = counters ? getNanoSecCount() : 0;
     /* decode audio frame */
     ret = avcodec_decode_audio4(audioDecCtx, frame, gotFrame, pkt);
+    if (counters)
+    {
+        long long int endTime = getNanoSecCount();
+        addCounter(counters->decodeNanoSec, endTime - beginTime);
+        beginTime = endTime;
+    }
     if (ret < 0)
     {
         lprintf("Error in %s when decoding audio frame (%s)\n", __FUNCTION__, av_err2str_new(ret));
+        if (counters)
+            addCounter(counters->numDroppedFrames, 1);
         return ret;
     }
     if (ret != decoded)
@@ -307,6 +334,11 @@ int decodeAudioPacket(AVPacket* pkt, AVCodecContext* audioDecCtx, AVFrame* frame
             if (frame->nb_samples != *numSamples)
                 *numSamples = frame->nb_samples;
         }
+        if (counters)
+        {
+            addCounter(counters->convertNanoSec, getNanoSecCount() - beginTime);
+            addCounter(counters->numFrames, 1);
+        }
     }
 
     return decoded;
@@ -315,7 +347,7 @@ int decodeAudioPacket(AVPacket* pkt, AVCodecContext* audioDecCtx, AVFrame* frame
 int decodeAudioPacket(AVPacket* pkt, AVCodecContext* audioDecCtx, AVFrame* frame,
     int sampleRate, enum AVSampleFormat sampleFmt, int numChannels, int numSamples,
     SwrContext* swrCtx, AVSampleFormat dstSampleFmt, unsigned char* audioDstData[8],
-    int* gotFrame)
+    int* gotFrame, StreamCounters* counters)
 {
     int ret = 0;
     int decoded = pkt->size;
@@ -323,11 +355,20 @@ int decodeAudioPacket(AVPacket* pkt, AVCodecContext* audioDecCtx, AVFrame* frame
 
     *gotFrame = 0;
 
+    long long int beginTime = counters ? getNanoSecCount() : 0;
     /* decode audio frame */
     ret = avcodec_decode_audio4(audioDecCtx, frame, gotFrame, pkt);
+    if (counters)
+    {
+        long long int endTime = getNanoSecCount();
+        addCounter(counters->decodeNanoSec, endTime - beginTime);
+        beginTime = endTime;
+    }
     if (ret < 0)
     {
         lprintf("Error in when decoding audio frame (%s)\n", __FUNCTION__, av_err2str_new(ret));
+        if (counters)
+            addCounter(counters->numDroppedFrames, 1);
         return ret;
     }
     if (ret != decoded)
@@ -366,11 +407,363 @@ int decodeAudioPacket(AVPacket* pkt, AVCodecContext* audioDecCtx, AVFrame* frame
                 return -1;
             }
         }
+        if (counters)
+        {
+            addCounter(counters->convertNanoSec, getNanoSecCount() - beginTime);
+            addCounter(counters->numFrames, 1);
+        }
     }
 
     return decoded;
 }
 
+int decodeAudioPacket(AVPacket* pkt, AVCodecContext* audioDecCtx, AVFrame* frame,
+    int sampleRate, enum AVSampleFormat sampleFmt, int numChannels,
+    SwrContext* swrCtx, int dstSampleRate, AVSampleFormat dstSampleFmt, int dstNumChannels,
+    unsigned char* audioDstData[8], int* audioDstLineSize, int* audioDstCapacity, int* numDstSamples,
+    int* gotFrame, StreamCounters* counters)
+{
+    int ret = 0;
+    int decoded = pkt->size;
+
+    *gotFrame = 0;
+    *numDstSamples = 0;
+
+    long long int beginTime = counters ? getNanoSecCount() : 0;
+    /* decode audio frame */
+    ret = avcodec_decode_audio4(audioDecCtx, frame, gotFrame, pkt);
+    if (counters)
+    {
+        long long int endTime = getNanoSecCount();
+        addCounter(counters->decodeNanoSec, endTime - beginTime);
+        beginTime = endTime;
+    }
+    if (ret < 0)
+    {
+        lprintf("Error in %s when decoding audio frame (%s)\n", __FUNCTION__, av_err2str_new(ret));
+        if (counters)
+            addCounter(counters->numDroppedFrames, 1);
+        return ret;
+    }
+    if (ret != decoded)
+    {
+        lprintf("Error in %s, decoded num of bytes not equal to packet size, "
+            "such packet containing multiple frames is not supported in this library\n", __FUNCTION__);
+        return -1;
+    }
+
+    if (*gotFrame)
+    {
+        if (frame->sample_rate != sampleRate || frame->format != sampleFmt || frame->channels != numChannels)
+        {
+            lprintf("Error in %s, Sample rate, sample format and number of channels have to be "
+                "Constant in the whole media file:\n"
+                "old sample rate = %d, sample format = %s, number of channels = %d\n,"
+                "new sample rate = %d, sample format = %s, number of channels = %d\n",
+                __FUNCTION__, sampleRate, av_get_sample_fmt_name(sampleFmt), numChannels,
+                frame->sample_rate, av_get_sample_fmt_name((enum AVSampleFormat)frame->format), frame->channels);
+            return -1;
+        }
+
+        // The number of converted samples varies from frame to frame when sample rate changes,
+        // grow the buffer geometrically so that it settles after a few frames
+        int maxNumDstSamples = av_rescale_rnd(swr_get_delay(swrCtx, sampleRate) + frame->nb_samples,
+            dstSampleRate, sampleRate, AV_ROUND_UP);
+        if (maxNumDstSamples > *audioDstCapacity || !audioDstData[0])
+        {
+            int capacity = FFMAX(maxNumDstSamples, *audioDstCapacity * 2);
+            av_freep(&audioDstData[0]);
+            if (av_samples_alloc(audioDstData, audioDstLineSize, dstNumChannels, capacity, dstSampleFmt, 0) < 0)
+            {
+                lprintf("Error in %s, could not allocate audio samples\n", __FUNCTION__);
+                *audioDstCapacity = 0;
+                return -1;
+            }
+            *audioDstCapacity = capacity;
+        }
+        ret = swr_convert(swrCtx, audioDstData, *audioDstCapacity, (const unsigned char**)frame->data, frame->nb_samples);
+        if (ret < 0)
+        {
+            lprintf("Error in %s, could not convert audio samples\n", __FUNCTION__);
+            return -1;
+        }
+        *numDstSamples = ret;
+        if (counters)
+        {
+            addCounter(counters->convertNanoSec, getNanoSecCount() - beginTime);
+            addCounter(counters->numFrames, 1);
+        }
+    }
+
+    return decoded;
+}
+
+int initResampler(SwrContext* swrCtx, const avp::ResampleOptions& options)
+{
+    int filterSize = 0, phaseShift = 0;
+    double precision = 20;
+    if (options.quality == avp::ResampleQualityLinear)
+    {
+        filterSize = 4;
+        phaseShift = 6;
+        precision = 16;
+    }
+    else if (options.quality == avp::ResampleQualityHigh)
+    {
+        filterSize = 64;
+        phaseShift = 14;
+        precision = 28;
+    }
+    if (options.filterSize > 0)
+        filterSize = options.filterSize;
+
+    if (filterSize > 0)
+        av_opt_set_int(swrCtx, "filter_size", filterSize, 0);
+    if (phaseShift > 0)
+        av_opt_set_int(swrCtx, "phase_shift", phaseShift, 0);
+    if (options.quality == avp::ResampleQualityLinear)
+        av_opt_set_int(swrCtx, "linear_interp", 1, 0);
+
+    int ret;
+    if (options.engine == avp::ResampleEngineSoxr)
+    {
+        av_opt_set_int(swrCtx, "resampler", SWR_ENGINE_SOXR, 0);
+        av_opt_set_double(swrCtx, "precision", precision, 0);
+        ret = swr_init(swrCtx);
+        if (ret >= 0)
+            return ret;
+
+        lprintf("Warning in %s, could not init soxr resampler, fall back to swr\n", __FUNCTION__);
+        av_opt_set_int(swrCtx, "resampler", SWR_ENGINE_SWR, 0);
+    }
+    return swr_init(swrCtx);
+}
+
+struct SwsCacheKey
+{
+    bool operator==(const SwsCacheKey& other) const
+    {
+        return srcWidth == other.srcWidth && srcHeight == other.srcHeight && srcFormat == other.srcFormat &&
+            dstWidth == other.dstWidth && dstHeight == other.dstHeight && dstFormat == other.dstFormat &&
+            flags == other.flags && matrix == other.matrix && fullRange == other.fullRange;
+    }
+    int srcWidth, srcHeight, srcFormat;
+    int dstWidth, dstHeight, dstFormat;
+    int flags, matrix, fullRange;
+};
+
+struct SwrCacheKey
+{
+    bool operator==(const SwrCacheKey& other) const
+    {
+        return inChannelLayout == other.inChannelLayout && inSampleRate == other.inSampleRate &&
+            inSampleFormat == other.inSampleFormat && outChannelLayout == other.outChannelLayout &&
+            outSampleRate == other.outSampleRate && outSampleFormat == other.outSampleFormat &&
+            engine == other.engine && quality == other.quality && filterSize == other.filterSize;
+    }
+    long long int inChannelLayout;
+    int inSampleRate, inSampleFormat;
+    long long int outChannelLayout;
+    int outSampleRate, outSampleFormat;
+    int engine, quality, filterSize;
+};
+
+// Idle contexts are in release order, the oldest is evicted first
+static std::mutex convertCacheMutex;
+static int maxIdleConvertContexts = 64;
+static std::vector<std::pair<SwsCacheKey, SwsContext*> > idleSwsContexts;
+static std::map<SwsContext*, SwsCacheKey> leasedSwsContexts;
+static std::vector<std::pair<SwrCacheKey, SwrContext*> > idleSwrContexts;
+static std::map<SwrContext*, SwrCacheKey> leasedSwrContexts;
+static long long int numSwsCreates = 0, numSwsReuses = 0;
+static long long int numSwrCreates = 0, numSwrReuses = 0;
+
+SwsContext* leaseSwsContext(int srcWidth, int srcHeight, AVPixelFormat srcFormat,
+    int dstWidth, int dstHeight, AVPixelFormat dstFormat, int flags, int matrix, int fullRange)
+{
+    SwsCacheKey key = { srcWidth, srcHeight, srcFormat, dstWidth, dstHeight, dstFormat,
+        flags, matrix, matrix >= 0 ? fullRange : 0 };
+    {
+        std::lock_guard<std::mutex> lg(convertCacheMutex);
+        for (int i = (int)idleSwsContexts.size() - 1; i >= 0; i--)
+        {
+            if (idleSwsContexts[i].first == key)
+            {
+                SwsContext* swsCtx = idleSwsContexts[i].second;
+                idleSwsContexts.erase(idleSwsContexts.begin() + i);
+                leasedSwsContexts[swsCtx] = key;
+                numSwsReuses++;
+                return swsCtx;
+            }
+        }
+    }
+
+    SwsContext* swsCtx = sws_getContext(srcWidth, srcHeight, srcFormat,
+        dstWidth, dstHeight, dstFormat, flags, NULL, NULL, NULL);
+    if (!swsCtx)
+        return NULL;
+    if (matrix >= 0)
+        avp::setSwsColorMatrix(swsCtx, matrix, fullRange);
+
+    std::lock_guard<std::mutex> lg(convertCacheMutex);
+    leasedSwsContexts[swsCtx] = key;
+    numSwsCreates++;
+    return swsCtx;
+}
+
+void releaseSwsContext(SwsContext** swsCtx)
+{
+    if (!swsCtx || !*swsCtx)
+        return;
+
+    SwsContext* freeCtx = *swsCtx;
+    {
+        std::lock_guard<std::mutex> lg(convertCacheMutex);
+        std::map<SwsContext*, SwsCacheKey>::iterator itr = leasedSwsContexts.find(*swsCtx);
+        if (itr != leasedSwsContexts.end())
+        {
+            if (maxIdleConvertContexts > 0)
+            {
+                freeCtx = NULL;
+                if ((int)idleSwsContexts.size() >= maxIdleConvertContexts)
+                {
+                    freeCtx = idleSwsContexts.front().second;
+                    idleSwsContexts.erase(idleSwsContexts.begin());
+                }
+                idleSwsContexts.push_back(std::make_pair(itr->second, *swsCtx));
+            }
+            leasedSwsContexts.erase(itr);
+        }
+    }
+    if (freeCtx)
+        sws_freeContext(freeCtx);
+    *swsCtx = NULL;
+}
+
+SwrContext* leaseSwrContext(long long int inChannelLayout, int inSampleRate, AVSampleFormat inSampleFormat,
+    long long int outChannelLayout, int outSampleRate, AVSampleFormat outSampleFormat,
+    const avp::ResampleOptions& options)
+{
+    SwrCacheKey key = { inChannelLayout, inSampleRate, inSampleFormat, outChannelLayout, outSampleRate, outSampleFormat,
+        options.engine, options.quality, options.filterSize };
+    {
+        std::lock_guard<std::mutex> lg(convertCacheMutex);
+        for (int i = (int)idleSwrContexts.size() - 1; i >= 0; i--)
+        {
+            if (idleSwrContexts[i].first == key)
+            {
+                SwrContext* swrCtx = idleSwrContexts[i].second;
+                idleSwrContexts.erase(idleSwrContexts.begin() + i);
+                leasedSwrContexts[swrCtx] = key;
+                numSwrReuses++;
+                return swrCtx;
+            }
+        }
+    }
+
+    SwrContext* swrCtx = swr_alloc();
+    if (!swrCtx)
+        return NULL;
+
+    av_opt_set_int(swrCtx, "in_channel_layout", inChannelLayout, 0);
+    av_opt_set_int(swrCtx, "in_sample_rate", inSampleRate, 0);
+    av_opt_set_sample_fmt(swrCtx, "in_sample_fmt", inSampleFormat, 0);
+
+    av_opt_set_int(swrCtx, "out_channel_layout", outChannelLayout, 0);
+    av_opt_set_int(swrCtx, "out_sample_rate", outSampleRate, 0);
+    av_opt_set_sample_fmt(swrCtx, "out_sample_fmt", outSampleFormat, 0);
+
+    if (initResampler(swrCtx, options) < 0)
+    {
+        swr_free(&swrCtx);
+        return NULL;
+    }
+
+    std::lock_guard<std::mutex> lg(convertCacheMutex);
+    leasedSwrContexts[swrCtx] = key;
+    numSwrCreates++;
+    return swrCtx;
+}
+
+void releaseSwrContext(SwrContext** swrCtx)
+{
+    if (!swrCtx || !*swrCtx)
+        return;
+
+    // The next user should not get the delayed samples of this one, swr_init keeps the options and the filter
+    if (swr_init(*swrCtx) < 0)
+    {
+        {
+            std::lock_guard<std::mutex> lg(convertCacheMutex);
+            leasedSwrContexts.erase(*swrCtx);
+        }
+        swr_free(swrCtx);
+        return;
+    }
+
+    SwrContext* freeCtx = *swrCtx;
+    {
+        std::lock_guard<std::mutex> lg(convertCacheMutex);
+        std::map<SwrContext*, SwrCacheKey>::iterator itr = leasedSwrContexts.find(*swrCtx);
+        if (itr != leasedSwrContexts.end())
+        {
+            if (maxIdleConvertContexts > 0)
+            {
+                freeCtx = NULL;
+                if ((int)idleSwrContexts.size() >= maxIdleConvertContexts)
+                {
+                    freeCtx = idleSwrContexts.front().second;
+                    idleSwrContexts.erase(idleSwrContexts.begin());
+                }
+                idleSwrContexts.push_back(std::make_pair(itr->second, *swrCtx));
+            }
+            leasedSwrContexts.erase(itr);
+        }
+    }
+    if (freeCtx)
+        swr_free(&freeCtx);
+    *swrCtx = NULL;
+}
+
+namespace avp
+{
+
+void setConvertCacheCapacity(int maxIdleContexts)
+{
+    std::vector<SwsContext*> freeSwsContexts;
+    std::vector<SwrContext*> freeSwrContexts;
+    {
+        std::lock_guard<std::mutex> lg(convertCacheMutex);
+        maxIdleConvertContexts = maxIdleContexts > 0 ? maxIdleContexts : 0;
+        while ((int)idleSwsContexts.size() > maxIdleConvertContexts)
+        {
+            freeSwsContexts.push_back(idleSwsContexts.front().second);
+            idleSwsContexts.erase(idleSwsContexts.begin());
+        }
+        while ((int)idleSwrContexts.size() > maxIdleConvertContexts)
+        {
+            freeSwrContexts.push_back(idleSwrContexts.front().second);
+            idleSwrContexts.erase(idleSwrContexts.begin());
+        }
+    }
+    for (int i = 0; i < (int)freeSwsContexts.size(); i++)
+        sws_freeContext(freeSwsContexts[i]);
+    for (int i = 0; i < (int)freeSwrContexts.size(); i++)
+        swr_free(&freeSwrContexts[i]);
+}
+
+void getConvertCacheStats(ConvertCacheStats& stats)
+{
+    std::lock_guard<std::mutex> lg(convertCacheMutex);
+    stats.numSwsCreates = numSwsCreates;
+    stats.numSwsReuses = numSwsReuses;
+    stats.numSwrCreates = numSwrCreates;
+    stats.numSwrReuses = numSwrReuses;
+    stats.numIdleContexts = idleSwsContexts.size() + idleSwrContexts.size();
+}
+
+}
+
 void logPacket(const AVFormatContext* fmtCtx, const AVPacket* pkt)
 {
     AVRational* time_base = &fmtCtx->streams[pkt->stream_index]->time_base;
@@ -509,6 +902,7 @@ AVFrame* allocPicture(enum AVPixelFormat pix_fmt, int width, int height)
     AVFrame* picture;
     int ret;
 
+    countFrameBufferAlloc();
     picture = av_frame_alloc();
     if (!picture)
     {
@@ -532,11 +926,160 @@ AVFrame* allocPicture(enum AVPixelFormat pix_fmt, int width, int height)
     return picture;
 }
 
-int writeVideoFrame(AVFormatContext* outFmtCtx, AVStream* stream, const AVFrame* frame)
+static std::atomic<long long int> numPacketBufferAllocs(0);
+static std::atomic<long long int> numPacketBufferGets(0);
+static std::atomic<long long int> numFrameBufferAllocs(0);
+
+static AVBufferRef* allocPacketBuffer(int size)
+{
+    numPacketBufferAllocs++;
+    return av_buffer_alloc(size);
+}
+
+// Size class i holds buffers of 1 << (i + minPacketSizeShift) bytes, padding included
+enum { minPacketSizeShift = 10, numPacketSizeClasses = 20 };
+
+struct PacketBufferPool
 {
+    AVBufferRef* encodeBuffer;
+    AVBufferPool* sizeClasses[numPacketSizeClasses];
+};
+
+PacketBufferPool* allocPacketBufferPool(int maxPacketSize)
+{
+    if (maxPacketSize <= 0)
+        return NULL;
+    PacketBufferPool* pool = new PacketBufferPool;
+    memset(pool, 0, sizeof(PacketBufferPool));
+    pool->encodeBuffer = allocPacketBuffer(maxPacketSize + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!pool->encodeBuffer)
+    {
+        delete pool;
+        return NULL;
+    }
+    return pool;
+}
+
+void freePacketBufferPool(PacketBufferPool** pool)
+{
+    if (!pool || !*pool)
+        return;
+
+    av_buffer_unref(&(*pool)->encodeBuffer);
+    // Buffers still held by the muxer return to their pool later,
+    // each pool is freed when the last of its buffers is released.
+    for (int i = 0; i < numPacketSizeClasses; i++)
+    {
+        if ((*pool)->sizeClasses[i])
+            av_buffer_pool_uninit(&(*pool)->sizeClasses[i]);
+    }
+    delete *pool;
+    *pool = NULL;
+}
+
+void countFrameBufferAlloc()
+{
+    numFrameBufferAllocs++;
+}
+
+static void initPooledPacket(AVPacket* pkt, PacketBufferPool* pktPool)
+{
+    av_init_packet(pkt);
+    pkt->data = NULL;
+    pkt->size = 0;
+    if (!pktPool)
+        return;
+
+    // If the encoder finds a large enough buffer in the packet,
+    // it writes directly into it instead of allocating a new one.
+    pkt->buf = av_buffer_ref(pktPool->encodeBuffer);
+    if (pkt->buf)
+    {
+        pkt->data = pkt->buf->data;
+        pkt->size = pkt->buf->size - AV_INPUT_BUFFER_PADDING_SIZE;
+    }
+}
+
+// Move the encoded data of pkt into a pooled buffer of its size class, so that the scratch
+// buffer is free for the next packet while the muxer holds this one
+static int movePacketToPool(AVPacket* pkt, PacketBufferPool* pktPool)
+{
+    if (!pktPool)
+        return 0;
+
+    int sizeClass = 0;
+    while (sizeClass < numPacketSizeClasses &&
+        (1 << (sizeClass + minPacketSizeShift)) < pkt->size + AV_INPUT_BUFFER_PADDING_SIZE)
+        sizeClass++;
+    // Keep packets larger than every class in the buffer the encoder gave
+    if (sizeClass == numPacketSizeClasses && (!pkt->buf || pkt->buf->data != pktPool->encodeBuffer->data))
+        return 0;
+
+    AVBufferRef* buf = NULL;
+    if (sizeClass < numPacketSizeClasses)
+    {
+        if (!pktPool->sizeClasses[sizeClass])
+            pktPool->sizeClasses[sizeClass] =
+                av_buffer_pool_init(1 << (sizeClass + minPacketSizeShift), allocPacketBuffer);
+        if (pktPool->sizeClasses[sizeClass])
+            buf = av_buffer_pool_get(pktPool->sizeClasses[sizeClass]);
+    }
+    else
+        buf = allocPacketBuffer(pkt->size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!buf)
+        return AVERROR(ENOMEM);
+
+    memcpy(buf->data, pkt->data, pkt->size);
+    memset(buf->data + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    av_buffer_unref(&pkt->buf);
+    pkt->buf = buf;
+    pkt->data = buf->data;
+    numPacketBufferGets++;
+    return 0;
+}
+
+namespace avp
+{
+
+static std::mutex memoryStatsMutex;
+static long long int lastStatsTime = -1;
+static long long int lastNumPacketBufferAllocs = 0;
+static long long int lastNumFrameBufferAllocs = 0;
+
+void getWriteMemoryStats(WriteMemoryStats& stats)
+{
+    std::lock_guard<std::mutex> lg(memoryStatsMutex);
+    stats.numPacketBufferAllocs = numPacketBufferAllocs;
+    stats.numPacketBufferGets = numPacketBufferGets;
+    stats.numFrameBufferAllocs = numFrameBufferAllocs;
+    stats.packetBufferAllocsPerSecond = 0;
+    stats.frameBufferAllocsPerSecond = 0;
+
+    long long int currTime = av_gettime_relative();
+    if (lastStatsTime >= 0 && currTime > lastStatsTime)
+    {
+        double elapse = (currTime - lastStatsTime) / 1000000.0;
+        stats.packetBufferAllocsPerSecond = (stats.numPacketBufferAllocs - lastNumPacketBufferAllocs) / elapse;
+        stats.frameBufferAllocsPerSecond = (stats.numFrameBufferAllocs - lastNumFrameBufferAllocs) / elapse;
+    }
+    lastStatsTime = currTime;
+    lastNumPacketBufferAllocs = stats.numPacketBufferAllocs;
+    lastNumFrameBufferAllocs = stats.numFrameBufferAllocs;
+}
+
+}
+
+int writeVideoFrame(AVFormatContext* outFmtCtx, AVStream* stream, const AVFrame* frame, PacketBufferPool* pktPool,
+    StreamCounters* counters, long long int* packetPts, int* keyPacket)
+{
+    avp::TraceScope trace("writeVideoFrame", stream->index, frame ? frame->pts : -1);
     int ret;
     AVCodecContext *codecCtx = stream->codec;
     int gotPacket = 0;
+    if (packetPts)
+        *packetPts = AV_NOPTS_VALUE;
+    if (keyPacket)
+        *keyPacket = 0;
 
     if (outFmtCtx->oformat->flags & AVFMT_RAWPICTURE) 
     {
@@ -547,6 +1090,11 @@ int writeVideoFrame(AVFormatContext* outFmtCtx, AVStream* stream, const AVFrame*
         if (!frame)
             return 1;
 
+        if (packetPts)
+            *packetPts = frame->pts;
+        if (keyPacket)
+            *keyPacket = 1;
+
         pkt.flags        |= AV_PKT_FLAG_KEY;
         pkt.stream_index  = stream->index;
         pkt.data          = (uint8_t *)frame;
@@ -555,15 +1103,32 @@ int writeVideoFrame(AVFormatContext* outFmtCtx, AVStream* stream, const AVFrame*
         pkt.pts = pkt.dts = frame->pts;
         av_packet_rescale_ts(&pkt, codecCtx->time_base, stream->time_base);
 
+        long long int beginTime = counters ? getNanoSecCount() : 0;
         ret = av_interleaved_write_frame(outFmtCtx, &pkt);
+        if (counters)
+        {
+            addCounter(counters->muxNanoSec, getNanoSecCount() - beginTime);
+            addCounter(counters->numFrames, 1);
+            addCounter(counters->numPackets, 1);
+            addCounter(counters->numBytes, sizeof(AVPicture));
+        }
     } 
     else 
     {
         AVPacket pkt = { 0 };
-        av_init_packet(&pkt);
+        initPooledPacket(&pkt, pktPool);
 
+        long long int beginTime = counters ? getNanoSecCount() : 0;
         /* encode the image */
         ret = avcodec_encode_video2(codecCtx, &pkt, frame, &gotPacket);
+        if (counters)
+        {
+            long long int endTime = getNanoSecCount();
+            addCounter(counters->encodeNanoSec, endTime - beginTime);
+            beginTime = endTime;
+            if (frame)
+                addCounter(counters->numFrames, 1);
+        }
         if (ret < 0) 
         {
             lprintf("Error in % when encoding video frame: %s\n", __FUNCTION__, av_err2str_new(ret));
@@ -572,13 +1137,33 @@ int writeVideoFrame(AVFormatContext* outFmtCtx, AVStream* stream, const AVFrame*
 
         if (gotPacket) 
         {
+            ret = movePacketToPool(&pkt, pktPool);
+            if (ret < 0)
+            {
+                lprintf("Error in %s, could not get packet buffer: %s\n", __FUNCTION__, av_err2str_new(ret));
+                av_free_packet(&pkt);
+                return 1;
+            }
+            if (packetPts)
+                *packetPts = pkt.pts;
+            if (keyPacket)
+                *keyPacket = (pkt.flags & AV_PKT_FLAG_KEY) != 0;
             /* rescale output packet timestamp values from codec to stream timebase */
             av_packet_rescale_ts(&pkt, codecCtx->time_base, stream->time_base);
             pkt.stream_index = stream->index;
+            int pktSize = pkt.size;
 
             /* Write the compressed frame to the media file. */
             //logPacket(outFmtCtx, &pkt);
             ret = av_interleaved_write_frame(outFmtCtx, &pkt);
+            // Give the pooled buffer back if the muxer did not take it
+            av_free_packet(&pkt);
+            if (counters)
+            {
+                addCounter(counters->muxNanoSec, getNanoSecCount() - beginTime);
+                addCounter(counters->numPackets, 1);
+                addCounter(counters->numBytes, pktSize);
+            }
         } 
         else
             ret = 0;
@@ -793,6 +1378,8 @@ AVFrame* allocAudioFrame(enum AVSampleFormat sampleFormat, int sampleRate, int c
     AVFrame *frame = av_frame_alloc();
     int ret;
 
+    countFrameBufferAlloc();
+
     if (!frame) 
     {
         lprintf("Error in %s, allocating an audio frame\n", __FUNCTION__);
@@ -818,14 +1405,26 @@ AVFrame* allocAudioFrame(enum AVSampleFormat sampleFormat, int sampleRate, int c
     return frame;
 }
 
-int writeAudioFrame(AVFormatContext* outFmtCtx, AVStream* stream, const AVFrame* frame)
+int writeAudioFrame(AVFormatContext* outFmtCtx, AVStream* stream, const AVFrame* frame, PacketBufferPool* pktPool,
+    StreamCounters* counters)
 {
+    avp::TraceScope trace("writeAudioFrame", stream->index, frame ? frame->pts : -1);
     int ret;
     AVCodecContext *codecCtx = stream->codec;
     int gotPacket = 0;
 
     AVPacket pkt = { 0 };
+    initPooledPacket(&pkt, pktPool);
+    long long int beginTime = counters ? getNanoSecCount() : 0;
     ret = avcodec_encode_audio2(codecCtx, &pkt, frame, &gotPacket);
+    if (counters)
+    {
+        long long int endTime = getNanoSecCount();
+        addCounter(counters->encodeNanoSec, endTime - beginTime);
+        beginTime = endTime;
+        if (frame)
+            addCounter(counters->numFrames, 1);
+    }
     if (ret < 0) 
     {
         lprintf("Error in %s when encoding audio frame: %s\n", __FUNCTION__, av_err2str_new(ret));
@@ -834,13 +1433,28 @@ int writeAudioFrame(AVFormatContext* outFmtCtx, AVStream* stream, const AVFrame*
 
     if (gotPacket)
     {
+        ret = movePacketToPool(&pkt, pktPool);
+        if (ret < 0)
+        {
+            lprintf("Error in %s, could not get packet buffer: %s\n", __FUNCTION__, av_err2str_new(ret));
+            av_free_packet(&pkt);
+            return 1;
+        }
         /* rescale output packet timestamp values from codec to stream timebase */
         av_packet_rescale_ts(&pkt, codecCtx->time_base, stream->time_base);
         pkt.stream_index = stream->index;
+        int pktSize = pkt.size;
 
         /* Write the compressed frame to the media file. */
         //logPacket(outFmtCtx, &pkt);
         ret = av_interleaved_write_frame(outFmtCtx, &pkt);
+        av_free_packet(&pkt);
+        if (counters)
+        {
+            addCounter(counters->muxNanoSec, getNanoSecCount() - beginTime);
+            addCounter(counters->numPackets, 1);
+            addCounter(counters->numBytes, pktSize);
+        }
     }
     else
         ret = 0;
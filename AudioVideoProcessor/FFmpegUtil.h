@@ -23,6 +23,98 @@ extern "C"
 }
 #endif
 
+// Names removed from later FFmpeg versions, the raw picture hack is never taken without AVFMT_RAWPICTURE
+#ifndef AVFMT_RAWPICTURE
+#define AVFMT_RAWPICTURE 0
+#endif
+#ifndef CODEC_FLAG_GLOBAL_HEADER
+#define CODEC_FLAG_GLOBAL_HEADER AV_CODEC_FLAG_GLOBAL_HEADER
+#endif
+
+#include <atomic>
+#include <chrono>
+
+// P010 is added in FFmpeg 3.0
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(55, 17, 100)
+#define AVP_HAS_PIX_FMT_P010 1
+#endif
+
+// NOTICE!!!
+// PixelType values equal AVPixelFormat values of FFmpeg 2.8, later versions renumbered the enum,
+// so always convert through these two functions.
+// Other values have no counterpart and give AV_PIX_FMT_NONE or PixelTypeUnknown.
+inline AVPixelFormat getAVPixelFormat(int pixelType)
+{
+    switch (pixelType)
+    {
+    case avp::PixelTypeYUV420P: return AV_PIX_FMT_YUV420P;
+    case avp::PixelTypeBGR24: return AV_PIX_FMT_BGR24;
+    case avp::PixelTypeYUV422P: return AV_PIX_FMT_YUV422P;
+    case avp::PixelTypeYUV444P: return AV_PIX_FMT_YUV444P;
+    case avp::PixelTypeGRAY8: return AV_PIX_FMT_GRAY8;
+    case avp::PixelTypeNV12: return AV_PIX_FMT_NV12;
+    case avp::PixelTypeRGBA: return AV_PIX_FMT_RGBA;
+    case avp::PixelTypeBGRA: return AV_PIX_FMT_BGRA;
+    case avp::PixelTypeYUV420P10: return AV_PIX_FMT_YUV420P10LE;
+    case avp::PixelTypeYUV422P10: return AV_PIX_FMT_YUV422P10LE;
+    case avp::PixelTypeYUV444P10: return AV_PIX_FMT_YUV444P10LE;
+    case avp::PixelTypeBGR32: return AV_PIX_FMT_BGR0;
+#ifdef AVP_HAS_PIX_FMT_P010
+    case avp::PixelTypeP010: return AV_PIX_FMT_P010LE;
+#else
+    case avp::PixelTypeP010: return AV_PIX_FMT_NONE;
+#endif
+    default: return AV_PIX_FMT_NONE;
+    }
+}
+
+inline int getPixelType(AVPixelFormat pixFmt)
+{
+    switch (pixFmt)
+    {
+    case AV_PIX_FMT_YUV420P: return avp::PixelTypeYUV420P;
+    case AV_PIX_FMT_BGR24: return avp::PixelTypeBGR24;
+    case AV_PIX_FMT_YUV422P: return avp::PixelTypeYUV422P;
+    case AV_PIX_FMT_YUV444P: return avp::PixelTypeYUV444P;
+    case AV_PIX_FMT_GRAY8: return avp::PixelTypeGRAY8;
+    case AV_PIX_FMT_NV12: return avp::PixelTypeNV12;
+    case AV_PIX_FMT_RGBA: return avp::PixelTypeRGBA;
+    case AV_PIX_FMT_BGRA: return avp::PixelTypeBGRA;
+    case AV_PIX_FMT_YUV420P10LE: return avp::PixelTypeYUV420P10;
+    case AV_PIX_FMT_YUV422P10LE: return avp::PixelTypeYUV422P10;
+    case AV_PIX_FMT_YUV444P10LE: return avp::PixelTypeYUV444P10;
+    case AV_PIX_FMT_BGR0: return avp::PixelTypeBGR32;
+#ifdef AVP_HAS_PIX_FMT_P010
+    case AV_PIX_FMT_P010LE: return avp::PixelTypeP010;
+#endif
+    default: return avp::PixelTypeUnknown;
+    }
+}
+
+// Pixel types accepted by the readers and writers
+inline bool isInterfacePixelType(int type)
+{
+    switch (type)
+    {
+    case avp::PixelTypeYUV420P:
+    case avp::PixelTypeBGR24:
+    case avp::PixelTypeYUV422P:
+    case avp::PixelTypeYUV444P:
+    case avp::PixelTypeGRAY8:
+    case avp::PixelTypeNV12:
+    case avp::PixelTypeRGBA:
+    case avp::PixelTypeBGRA:
+    case avp::PixelTypeYUV420P10:
+    case avp::PixelTypeYUV422P10:
+    case avp::PixelTypeYUV444P10:
+    case avp::PixelTypeBGR32:
+    case avp::PixelTypeP010:
+        return getAVPixelFormat(type) != AV_PIX_FMT_NONE;
+    default:
+        return false;
+    }
+}
+
 inline AVRational avrational(int num, int den)
 {
     struct AVRational r;
@@ -31,16 +123,79 @@ inline AVRational avrational(int num, int den)
     return r;
 }
 
+// Always on counters of one stream, updated by the thread reading or writing the stream,
+// and loaded by any other thread without locking
+struct StreamCounters
+{
+    StreamCounters() { clear(); }
+    void clear()
+    {
+        numPackets = 0;
+        numBytes = 0;
+        numFrames = 0;
+        numDroppedFrames = 0;
+        queueDepth = 0;
+        demuxNanoSec = 0;
+        decodeNanoSec = 0;
+        convertNanoSec = 0;
+        encodeNanoSec = 0;
+        muxNanoSec = 0;
+        latencyNanoSec = 0;
+        maxLatencyNanoSec = 0;
+    }
+    void get(avp::StreamStats& stats) const
+    {
+        stats.numPackets = numPackets.load(std::memory_order_relaxed);
+        stats.numBytes = numBytes.load(std::memory_order_relaxed);
+        stats.numFrames = numFrames.load(std::memory_order_relaxed);
+        stats.numDroppedFrames = numDroppedFrames.load(std::memory_order_relaxed);
+        stats.queueDepth = queueDepth.load(std::memory_order_relaxed);
+        stats.demuxNanoSec = demuxNanoSec.load(std::memory_order_relaxed);
+        stats.decodeNanoSec = decodeNanoSec.load(std::memory_order_relaxed);
+        stats.convertNanoSec = convertNanoSec.load(std::memory_order_relaxed);
+        stats.encodeNanoSec = encodeNanoSec.load(std::memory_order_relaxed);
+        stats.muxNanoSec = muxNanoSec.load(std::memory_order_relaxed);
+        stats.latencyNanoSec = latencyNanoSec.load(std::memory_order_relaxed);
+        stats.maxLatencyNanoSec = maxLatencyNanoSec.load(std::memory_order_relaxed);
+    }
+    std::atomic<long long int> numPackets;
+    std::atomic<long long int> numBytes;
+    std::atomic<long long int> numFrames;
+    std::atomic<long long int> numDroppedFrames;
+    std::atomic<long long int> queueDepth;
+    std::atomic<long long int> demuxNanoSec;
+    std::atomic<long long int> decodeNanoSec;
+    std::atomic<long long int> convertNanoSec;
+    std::atomic<long long int> encodeNanoSec;
+    std::atomic<long long int> muxNanoSec;
+    std::atomic<long long int> latencyNanoSec;
+    std::atomic<long long int> maxLatencyNanoSec;
+};
+
+inline long long int getNanoSecCount()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Only the owning thread writes a counter, so a relaxed load and store is enough
+inline void addCounter(std::atomic<long long int>& counter, long long int value)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
 void logPacket(const AVFormatContext* fmtCtx, const AVPacket* pkt);
 
 int openCodecContext(int *streamIdx, const char *srcFileName,
     AVFormatContext *fmtCtx, enum AVMediaType type);
 
+// Returns AVERROR_INPUT_CHANGED with gotFrame set if the decoded frame is not of width, height and pix_fmt,
+// the frame is then not converted with swsCtx
 int decodeVideoPacket(AVPacket* pkt, 
     AVCodecContext* videoDecCtx, AVFrame* frame, 
     int width, int height, enum AVPixelFormat pix_fmt, 
     SwsContext* swsCtx, uint8_t* videoDstData[4], int videoDstLinesize[4], 
-    int *videoFrameCount, int *gotFrame);
+    int *videoFrameCount, int *gotFrame, StreamCounters* counters = NULL);
 
 int decodeAudioPacket(AVPacket* pkt, AVCodecContext* audioDecCtx, AVFrame* frame,
     int sampleRate, enum AVSampleFormat sampleFmt, int numChannels, int* numSamples, 
@@ -55,12 +210,40 @@ int decodeAudioPacket(AVPacket* pkt, AVCodecContext* audioDecCtx, AVFrame* frame
 int decodeAudioPacket(AVPacket* pkt, AVCodecContext* audioDecCtx, AVFrame* frame,
     int sampleRate, AVSampleFormat sampleFmt, int numChannels, int* numSamples,
     SwrContext* swrCtx, AVSampleFormat dstSampleFmt, unsigned char* audioDstData[8], int* audioDstLineSize,
-    int* gotFrame);
+    int* gotFrame, StreamCounters* counters = NULL);
 
 int decodeAudioPacket(AVPacket* pkt, AVCodecContext* audioDecCtx, AVFrame* frame,
     int sampleRate, enum AVSampleFormat sampleFmt, int numChannels, int numSamples,
     SwrContext* swrCtx, AVSampleFormat dstSampleFmt, unsigned char* audioDstData[8],
-    int* gotFrame);
+    int* gotFrame, StreamCounters* counters = NULL);
+
+// Convert to dstSampleRate and dstNumChannels as well, audioDstData grows when
+// the converted samples do not fit in audioDstCapacity samples
+int decodeAudioPacket(AVPacket* pkt, AVCodecContext* audioDecCtx, AVFrame* frame,
+    int sampleRate, enum AVSampleFormat sampleFmt, int numChannels,
+    SwrContext* swrCtx, int dstSampleRate, AVSampleFormat dstSampleFmt, int dstNumChannels,
+    unsigned char* audioDstData[8], int* audioDstLineSize, int* audioDstCapacity, int* numDstSamples,
+    int* gotFrame, StreamCounters* counters = NULL);
+
+// Apply engine and quality options to swrCtx, whose input and output formats
+// have been set, and initialize it, return the value of swr_init
+int initResampler(SwrContext* swrCtx, const avp::ResampleOptions& options);
+
+// Lease a scale context from the process wide cache, or create one if no idle context has the same parameters.
+// If matrix is not negative, the yuv side uses matrix and fullRange as set by setSwsColorMatrix.
+SwsContext* leaseSwsContext(int srcWidth, int srcHeight, AVPixelFormat srcFormat,
+    int dstWidth, int dstHeight, AVPixelFormat dstFormat, int flags, int matrix = -1, int fullRange = 0);
+
+// Return a leased context to the cache, contexts not from the cache are freed
+void releaseSwsContext(SwsContext** swsCtx);
+
+// Lease an initialized resample context, see initResampler
+SwrContext* leaseSwrContext(long long int inChannelLayout, int inSampleRate, AVSampleFormat inSampleFormat,
+    long long int outChannelLayout, int outSampleRate, AVSampleFormat outSampleFormat,
+    const avp::ResampleOptions& options);
+
+// Return a leased context to the cache after dropping the samples it buffers
+void releaseSwrContext(SwrContext** swrCtx);
 
 int cvtFrameRate(double frameRate, int* frameRateNum, int* frameRateDen);
 
@@ -69,7 +252,23 @@ AVStream* addVideoStream(AVFormatContext* outFmtCtx, const char* codecName, enum
 
 AVFrame* allocPicture(enum AVPixelFormat pix_fmt, int width, int height);
 
-int writeVideoFrame(AVFormatContext* outFmtCtx, AVStream* stream, const AVFrame* frame);
+// Encoders write into one scratch buffer of maxPacketSize bytes, which must hold any single encoded packet.
+// Each packet is then copied into a pooled buffer of the smallest power of two size holding it,
+// and that buffer returns to its pool after muxing. Pools of each size are created on demand,
+// so the memory held follows the actual packet sizes and stays flat once every size in use is warm.
+struct PacketBufferPool;
+
+PacketBufferPool* allocPacketBufferPool(int maxPacketSize);
+
+void freePacketBufferPool(PacketBufferPool** pool);
+
+void countFrameBufferAlloc();
+
+// If packetPts is not NULL, it receives the pts in codec time base of the packet written,
+// or AV_NOPTS_VALUE if the encoder gave no packet. If keyPacket is not NULL, it receives
+// whether the packet written is a key frame.
+int writeVideoFrame(AVFormatContext* outFmtCtx, AVStream* stream, const AVFrame* frame, PacketBufferPool* pktPool = NULL,
+    StreamCounters* counters = NULL, long long int* packetPts = NULL, int* keyPacket = NULL);
 
 int writeVideoFrame2(AVFormatContext* outFmtCtx, AVStream* stream, AVCodecContext* codecCtx, const AVFrame* frame);
 
@@ -78,7 +277,8 @@ AVStream* addAudioStream(AVFormatContext* outFmtCtx, const char* codecName, enum
 
 AVFrame* allocAudioFrame(enum AVSampleFormat sampleFormat, int sampleRate, int channeLayout, int numSamples);
 
-int writeAudioFrame(AVFormatContext* outFmtCtx, AVStream* stream, const AVFrame* frame);
+int writeAudioFrame(AVFormatContext* outFmtCtx, AVStream* stream, const AVFrame* frame, PacketBufferPool* pktPool = NULL,
+    StreamCounters* counters = NULL);
 
 const char* getVideoEncodeSpeedString(int videoEncodeSpeed);
 
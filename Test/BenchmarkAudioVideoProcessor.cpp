@@ -0,0 +1,614 @@
+// Throughput benchmark of the readers and writers.
+// Inputs are generated locally from lavfi testsrc and sine with single threaded x264,
+// so that results of different builds on the same machine are comparable.
+// Usage: BenchmarkAudioVideoProcessor [result.json]
+// Results are printed and written as JSON to result.json, benchmark.json by default.
+
+#include "AudioVideoProcessor.h"
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <stdarg.h>
+#include <stdio.h>
+
+static const int frameRate = 25;
+static const int durationInSeconds = 10;
+static const int sampleRate = 48000;
+// AV_CH_LAYOUT_MONO
+static const int channelLayoutMono = 4;
+static const int numEncodeFrames = 100;
+static const int numSeeks = 50;
+
+struct Resolution
+{
+    int width, height;
+};
+
+static const Resolution resolutions[] = { { 640, 360 }, { 1280, 720 }, { 1920, 1080 } };
+static const int numResolutions = sizeof(resolutions) / sizeof(Resolution);
+
+static const int pixelTypes[] = { avp::PixelTypeBGR24, avp::PixelTypeBGR32, avp::PixelTypeYUV420P, avp::PixelTypeNV12 };
+static const int numPixelTypes = sizeof(pixelTypes) / sizeof(int);
+
+static const int sampleTypes[] = { avp::SampleType16S, avp::SampleType32FP };
+static const int numSampleTypes = sizeof(sampleTypes) / sizeof(int);
+
+static double getSeconds()
+{
+    return std::chrono::duration_cast<std::chrono::duration<double> >(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static const char* getPixelTypeName(int pixelType)
+{
+    switch (pixelType)
+    {
+    case avp::PixelTypeBGR24: return "BGR24";
+    case avp::PixelTypeBGR32: return "BGR32";
+    case avp::PixelTypeYUV420P: return "YUV420P";
+    case avp::PixelTypeNV12: return "NV12";
+    default: return "Unknown";
+    }
+}
+
+static const char* getSampleTypeName(int sampleType)
+{
+    switch (sampleType)
+    {
+    case avp::SampleType16S: return "16S";
+    case avp::SampleType32FP: return "32FP";
+    default: return "Unknown";
+    }
+}
+
+static double getFrameNumBytes(int pixelType, int width, int height)
+{
+    if (pixelType == avp::PixelTypeBGR24)
+        return width * height * 3.0;
+    if (pixelType == avp::PixelTypeBGR32)
+        return width * height * 4.0;
+    return width * height * 1.5;
+}
+
+static int getSampleNumBytes(int sampleType)
+{
+    return sampleType == avp::SampleType16S ? 2 : 4;
+}
+
+// Every result is one JSON object in the results array
+static std::vector<std::string> results;
+
+static void addResult(const char* format, ...)
+{
+    char buf[1024];
+    va_list vl;
+    va_start(vl, format);
+    vsnprintf(buf, sizeof(buf), format, vl);
+    va_end(vl);
+    printf("%s\n", buf);
+    results.push_back(buf);
+}
+
+static double getConvertGBPerSecond(double numBytes, long long int convertNanoSec)
+{
+    return convertNanoSec > 0 ? numBytes / convertNanoSec : 0;
+}
+
+static std::string getInputFileName(const Resolution& res)
+{
+    char buf[256];
+    sprintf(buf, "bench_%dx%d.mp4", res.width, res.height);
+    return buf;
+}
+
+// Encode testsrc video and sine audio into fileName, stream 0 is video, stream 1 is audio
+static bool generateInput(const Resolution& res, const std::string& fileName)
+{
+    char source[256];
+    std::vector<int> indexes(1, 0);
+
+    avp::AudioVideoReader3 videoSource;
+    sprintf(source, "testsrc=size=%dx%d:rate=%d:duration=%d", res.width, res.height, frameRate, durationInSeconds);
+    if (!videoSource.open(source, indexes, avp::SampleTypeUnknown, avp::PixelTypeYUV420P, "lavfi"))
+    {
+        printf("cannot open lavfi %s\n", source);
+        return false;
+    }
+
+    avp::AudioVideoReader3 audioSource;
+    sprintf(source, "sine=frequency=440:sample_rate=%d:duration=%d", sampleRate, durationInSeconds);
+    if (!audioSource.open(source, indexes, avp::SampleType32FP, avp::PixelTypeUnknown, "lavfi"))
+    {
+        printf("cannot open lavfi %s\n", source);
+        return false;
+    }
+
+    std::vector<avp::OutputStreamProperties> props(2);
+    props[0] = avp::OutputStreamProperties("h264", avp::PixelTypeYUV420P, res.width, res.height, frameRate, res.width * res.height * 3);
+    props[1] = avp::OutputStreamProperties("aac", avp::SampleType32FP, channelLayoutMono, sampleRate, 128000);
+    std::vector<avp::Option> opts;
+    opts.push_back(std::make_pair("preset", "veryfast"));
+    opts.push_back(std::make_pair("threads", "1"));
+    avp::AudioVideoWriter3 writer;
+    if (!writer.open(fileName, "", false, props, opts))
+    {
+        printf("cannot open %s for write\n", fileName.c_str());
+        return false;
+    }
+
+    avp::AudioVideoFrame2 videoFrame, audioFrame;
+    int index;
+    bool audioEnd = false;
+    long long int audioTimeStamp = -1;
+    while (videoSource.read(videoFrame, index))
+    {
+        writer.write(videoFrame, 0);
+        while (!audioEnd && audioTimeStamp <= videoFrame.timeStamp)
+        {
+            if (audioSource.read(audioFrame, index))
+            {
+                audioTimeStamp = audioFrame.timeStamp;
+                writer.write(audioFrame, 1);
+            }
+            else
+                audioEnd = true;
+        }
+    }
+    while (!audioEnd && audioSource.read(audioFrame, index))
+        writer.write(audioFrame, 1);
+    writer.close();
+    return true;
+}
+
+static void benchmarkDecode(const Resolution& res, const std::string& fileName)
+{
+    for (int i = 0; i < numPixelTypes; i++)
+    {
+        int pixelType = pixelTypes[i];
+        double frameNumBytes = getFrameNumBytes(pixelType, res.width, res.height);
+
+        // AudioVideoReader only outputs BGR24 and BGR32
+        if (pixelType == avp::PixelTypeBGR24 || pixelType == avp::PixelTypeBGR32)
+        {
+            avp::AudioVideoReader reader;
+            avp::AudioVideoFrame frame;
+            if (reader.open(fileName, false, true, pixelType))
+            {
+                int count = 0;
+                double beginTime = getSeconds();
+                while (reader.read(frame))
+                    count++;
+                double elapse = getSeconds() - beginTime;
+                reader.close();
+                addResult("{\"test\":\"decode\",\"api\":\"AudioVideoReader\",\"width\":%d,\"height\":%d,"
+                    "\"type\":\"%s\",\"frames\":%d,\"seconds\":%.4f,\"fps\":%.2f}",
+                    res.width, res.height, getPixelTypeName(pixelType), count, elapse, count / elapse);
+            }
+        }
+
+        {
+            avp::AudioVideoReader2 reader;
+            avp::AudioVideoFrame2 frame;
+            if (reader.open(fileName, false, avp::SampleTypeUnknown, true, pixelType))
+            {
+                int count = 0;
+                double beginTime = getSeconds();
+                while (reader.read(frame))
+                    count++;
+                double elapse = getSeconds() - beginTime;
+                reader.close();
+                addResult("{\"test\":\"decode\",\"api\":\"AudioVideoReader2\",\"width\":%d,\"height\":%d,"
+                    "\"type\":\"%s\",\"frames\":%d,\"seconds\":%.4f,\"fps\":%.2f}",
+                    res.width, res.height, getPixelTypeName(pixelType), count, elapse, count / elapse);
+            }
+        }
+
+        // Conversions to bgr run with swscale and with the fast kernels
+        int numConvertModes = (pixelType == avp::PixelTypeBGR24 || pixelType == avp::PixelTypeBGR32) ? 2 : 1;
+        for (int fast = 0; fast < numConvertModes; fast++)
+        {
+            avp::setFastColorConvert(fast != 0);
+            avp::AudioVideoReader3 reader;
+            avp::AudioVideoFrame2 frame;
+            std::vector<int> indexes(1, 0);
+            if (reader.open(fileName, indexes, avp::SampleTypeUnknown, pixelType))
+            {
+                int count = 0, index;
+                double beginTime = getSeconds();
+                while (reader.read(frame, index))
+                    count++;
+                double elapse = getSeconds() - beginTime;
+                avp::AudioVideoStats stats;
+                reader.getStats(stats);
+                reader.close();
+                addResult("{\"test\":\"decode\",\"api\":\"AudioVideoReader3\",\"width\":%d,\"height\":%d,"
+                    "\"type\":\"%s\",\"fast_convert\":%s,\"frames\":%d,\"seconds\":%.4f,\"fps\":%.2f,\"convert_gbps\":%.3f}",
+                    res.width, res.height, getPixelTypeName(pixelType), fast ? "true" : "false", count, elapse, count / elapse,
+                    getConvertGBPerSecond(count * frameNumBytes, stats.total.convertNanoSec));
+            }
+        }
+        avp::setFastColorConvert(false);
+    }
+
+    // Decode straight into a letterboxed 640 x 640 normalized float tensor
+    {
+        avp::AudioVideoReader3 reader;
+        avp::AudioVideoFrame2 frame;
+        std::vector<int> indexes(1, 0);
+        avp::TensorOptions options(640, 640);
+        options.rgb = true;
+        options.letterbox = true;
+        options.padValue = 114;
+        options.scale[0] = options.scale[1] = options.scale[2] = 1.0f / 255;
+        std::vector<float> tensor(3 * options.width * options.height);
+        if (reader.open(fileName, indexes, avp::SampleTypeUnknown, avp::PixelTypeUnknown))
+        {
+            int count = 0, index;
+            double beginTime = getSeconds();
+            while (reader.readTensor(frame, index, &tensor[0], options))
+                count++;
+            double elapse = getSeconds() - beginTime;
+            avp::AudioVideoStats stats;
+            reader.getStats(stats);
+            reader.close();
+            addResult("{\"test\":\"decode_tensor\",\"api\":\"AudioVideoReader3\",\"width\":%d,\"height\":%d,"
+                "\"tensor_width\":%d,\"tensor_height\":%d,\"frames\":%d,\"seconds\":%.4f,\"fps\":%.2f,\"convert_gbps\":%.3f}",
+                res.width, res.height, options.width, options.height, count, elapse, count / elapse,
+                getConvertGBPerSecond(count * tensor.size() * sizeof(float), stats.total.convertNanoSec));
+        }
+    }
+
+    // Decode audio and video on their own threads
+    {
+        avp::AudioVideoReader3 reader;
+        avp::AudioVideoFrame2 frame;
+        std::vector<int> indexes;
+        indexes.push_back(0);
+        indexes.push_back(1);
+        reader.setParallelDecode(4);
+        if (reader.open(fileName, indexes, avp::SampleType16S, avp::PixelTypeBGR24))
+        {
+            int count = 0, index;
+            double beginTime = getSeconds();
+            while (reader.read(frame, index))
+            {
+                if (index == 0)
+                    count++;
+            }
+            double elapse = getSeconds() - beginTime;
+            reader.close();
+            addResult("{\"test\":\"decode_parallel\",\"api\":\"AudioVideoReader3\",\"width\":%d,\"height\":%d,"
+                "\"type\":\"%s\",\"frames\":%d,\"seconds\":%.4f,\"fps\":%.2f}",
+                res.width, res.height, getPixelTypeName(avp::PixelTypeBGR24), count, elapse, count / elapse);
+        }
+    }
+
+    // Decode batches of bgr frames into one reused buffer
+    {
+        const int batchSize = 8;
+        avp::AudioVideoReader3 reader;
+        std::vector<avp::AudioVideoFrame2> frames;
+        std::vector<int> indexes(1, 0);
+        if (reader.open(fileName, indexes, avp::SampleTypeUnknown, avp::PixelTypeBGR24))
+        {
+            int count = 0;
+            double beginTime = getSeconds();
+            while (reader.readBatch(frames, batchSize, 0))
+                count += frames.size();
+            double elapse = getSeconds() - beginTime;
+            reader.close();
+            addResult("{\"test\":\"decode_batch\",\"api\":\"AudioVideoReader3\",\"width\":%d,\"height\":%d,"
+                "\"type\":\"%s\",\"batch\":%d,\"frames\":%d,\"seconds\":%.4f,\"fps\":%.2f}",
+                res.width, res.height, getPixelTypeName(avp::PixelTypeBGR24), batchSize, count, elapse, count / elapse);
+        }
+    }
+
+    for (int i = 0; i < numSampleTypes; i++)
+    {
+        int sampleType = sampleTypes[i];
+        avp::AudioVideoReader3 reader;
+        avp::AudioVideoFrame2 frame;
+        std::vector<int> indexes(1, 1);
+        if (reader.open(fileName, indexes, sampleType, avp::PixelTypeUnknown))
+        {
+            long long int numSamples = 0;
+            int index;
+            double beginTime = getSeconds();
+            while (reader.read(frame, index))
+                numSamples += frame.numSamples;
+            double elapse = getSeconds() - beginTime;
+            avp::AudioVideoStats stats;
+            reader.getStats(stats);
+            reader.close();
+            addResult("{\"test\":\"decode_audio\",\"api\":\"AudioVideoReader3\",\"type\":\"%s\","
+                "\"samples\":%lld,\"seconds\":%.4f,\"samples_per_second\":%.0f,\"convert_gbps\":%.3f}",
+                getSampleTypeName(sampleType), numSamples, elapse, numSamples / elapse,
+                getConvertGBPerSecond(double(numSamples) * getSampleNumBytes(sampleType), stats.total.convertNanoSec));
+        }
+    }
+}
+
+static void addSeekResult(const char* api, const Resolution& res, std::vector<double>& latencies)
+{
+    if (latencies.empty())
+        return;
+
+    std::sort(latencies.begin(), latencies.end());
+    int size = latencies.size();
+    addResult("{\"test\":\"seek\",\"api\":\"%s\",\"width\":%d,\"height\":%d,\"seeks\":%d,"
+        "\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f}",
+        api, res.width, res.height, size,
+        latencies[size * 50 / 100] * 1000, latencies[size * 90 / 100] * 1000,
+        latencies[size * 99 / 100] * 1000, latencies[size - 1] * 1000);
+}
+
+static void benchmarkSeek(const Resolution& res, const std::string& fileName)
+{
+    // The same seek targets for every reader
+    std::vector<long long int> timeStamps(numSeeks);
+    std::mt19937 engine(12345);
+    std::uniform_int_distribution<int> dist(0, (durationInSeconds - 1) * frameRate);
+    for (int i = 0; i < numSeeks; i++)
+        timeStamps[i] = dist(engine) * 1000000LL / frameRate;
+
+    // AudioVideoReader only outputs BGR24 and BGR32, the other readers output YUV420P without conversion
+    std::vector<double> latencies;
+    {
+        avp::AudioVideoReader reader;
+        avp::AudioVideoFrame frame;
+        if (reader.open(fileName, false, true, avp::PixelTypeBGR24))
+        {
+            for (int i = 0; i < numSeeks; i++)
+            {
+                double beginTime = getSeconds();
+                if (reader.seek(timeStamps[i], avp::VIDEO) && reader.read(frame))
+                    latencies.push_back(getSeconds() - beginTime);
+            }
+            reader.close();
+        }
+        addSeekResult("AudioVideoReader", res, latencies);
+    }
+
+    latencies.clear();
+    {
+        avp::AudioVideoReader2 reader;
+        avp::AudioVideoFrame2 frame;
+        if (reader.open(fileName, false, avp::SampleTypeUnknown, true, avp::PixelTypeYUV420P))
+        {
+            for (int i = 0; i < numSeeks; i++)
+            {
+                double beginTime = getSeconds();
+                if (reader.seek(timeStamps[i], avp::VIDEO) && reader.read(frame))
+                    latencies.push_back(getSeconds() - beginTime);
+            }
+            reader.close();
+        }
+        addSeekResult("AudioVideoReader2", res, latencies);
+    }
+
+    latencies.clear();
+    {
+        avp::AudioVideoReader3 reader;
+        avp::AudioVideoFrame2 frame;
+        std::vector<int> indexes(1, 0);
+        int index;
+        if (reader.open(fileName, indexes, avp::SampleTypeUnknown, avp::PixelTypeYUV420P))
+        {
+            for (int i = 0; i < numSeeks; i++)
+            {
+                double beginTime = getSeconds();
+                if (reader.seek(timeStamps[i], 0) && reader.read(frame, index))
+                    latencies.push_back(getSeconds() - beginTime);
+            }
+            reader.close();
+        }
+        addSeekResult("AudioVideoReader3", res, latencies);
+    }
+}
+
+static void benchmarkEncode(const Resolution& res, const std::string& fileName)
+{
+    std::vector<avp::Option> opts;
+    opts.push_back(std::make_pair("preset", "ultrafast"));
+    int videoBPS = res.width * res.height * 3;
+    for (int i = 0; i < numPixelTypes; i++)
+    {
+        int pixelType = pixelTypes[i];
+        double frameNumBytes = getFrameNumBytes(pixelType, res.width, res.height);
+
+        // Encode the same decoded frames with every writer
+        std::vector<avp::AudioVideoFrame2> frames;
+        {
+            avp::AudioVideoReader3 reader;
+            avp::AudioVideoFrame2 frame;
+            std::vector<int> indexes(1, 0);
+            int index;
+            if (!reader.open(fileName, indexes, avp::SampleTypeUnknown, pixelType))
+                continue;
+            while (frames.size() < frameRate && reader.read(frame, index))
+                frames.push_back(frame.clone());
+            reader.close();
+        }
+        if (frames.empty())
+            continue;
+        int numFrames = frames.size();
+
+        // AudioVideoWriter only takes BGR24 and BGR32
+        if (pixelType == avp::PixelTypeBGR24 || pixelType == avp::PixelTypeBGR32)
+        {
+            avp::AudioVideoWriter writer;
+            if (writer.open("bench_out.mp4", "", false, false, "", avp::SampleTypeUnknown, 0, 0, 0,
+                true, "h264", pixelType, res.width, res.height, frameRate, videoBPS, opts))
+            {
+                double beginTime = getSeconds();
+                for (int j = 0; j < numEncodeFrames; j++)
+                {
+                    const avp::AudioVideoFrame2& src = frames[j % numFrames];
+                    avp::AudioVideoFrame frame = avp::videoFrame(src.data[0], src.steps[0], pixelType,
+                        res.width, res.height, j * 1000000LL / frameRate);
+                    writer.write(frame);
+                }
+                writer.close();
+                double elapse = getSeconds() - beginTime;
+                addResult("{\"test\":\"encode\",\"api\":\"AudioVideoWriter\",\"width\":%d,\"height\":%d,"
+                    "\"type\":\"%s\",\"frames\":%d,\"seconds\":%.4f,\"fps\":%.2f}",
+                    res.width, res.height, getPixelTypeName(pixelType), numEncodeFrames, elapse, numEncodeFrames / elapse);
+            }
+        }
+
+        {
+            avp::AudioVideoWriter2 writer;
+            if (writer.open("bench_out.mp4", "", false, false, "", avp::SampleTypeUnknown, 0, 0, 0,
+                true, "h264", pixelType, res.width, res.height, frameRate, videoBPS, opts))
+            {
+                double beginTime = getSeconds();
+                for (int j = 0; j < numEncodeFrames; j++)
+                {
+                    avp::AudioVideoFrame2 frame = frames[j % numFrames];
+                    frame.timeStamp = j * 1000000LL / frameRate;
+                    writer.write(frame);
+                }
+                writer.close();
+                double elapse = getSeconds() - beginTime;
+                addResult("{\"test\":\"encode\",\"api\":\"AudioVideoWriter2\",\"width\":%d,\"height\":%d,"
+                    "\"type\":\"%s\",\"frames\":%d,\"seconds\":%.4f,\"fps\":%.2f}",
+                    res.width, res.height, getPixelTypeName(pixelType), numEncodeFrames, elapse, numEncodeFrames / elapse);
+            }
+        }
+
+        // Conversions from bgr run with swscale and with the fast kernels
+        int numConvertModes = (pixelType == avp::PixelTypeBGR24 || pixelType == avp::PixelTypeBGR32) ? 2 : 1;
+        for (int fast = 0; fast < numConvertModes; fast++)
+        {
+            avp::setFastColorConvert(fast != 0);
+            avp::AudioVideoWriter3 writer;
+            std::vector<avp::OutputStreamProperties> props(1);
+            props[0] = avp::OutputStreamProperties("h264", pixelType, res.width, res.height, frameRate, videoBPS);
+            if (writer.open("bench_out.mp4", "", false, props, opts))
+            {
+                double beginTime = getSeconds();
+                for (int j = 0; j < numEncodeFrames; j++)
+                {
+                    avp::AudioVideoFrame2 frame = frames[j % numFrames];
+                    frame.timeStamp = j * 1000000LL / frameRate;
+                    writer.write(frame, 0);
+                }
+                avp::AudioVideoStats stats;
+                writer.getStats(stats);
+                writer.close();
+                double elapse = getSeconds() - beginTime;
+                addResult("{\"test\":\"encode\",\"api\":\"AudioVideoWriter3\",\"width\":%d,\"height\":%d,"
+                    "\"type\":\"%s\",\"fast_convert\":%s,\"frames\":%d,\"seconds\":%.4f,\"fps\":%.2f,\"convert_gbps\":%.3f}",
+                    res.width, res.height, getPixelTypeName(pixelType), fast ? "true" : "false",
+                    numEncodeFrames, elapse, numEncodeFrames / elapse,
+                    getConvertGBPerSecond(numEncodeFrames * frameNumBytes, stats.total.convertNanoSec));
+            }
+        }
+        avp::setFastColorConvert(false);
+    }
+}
+
+static void benchmarkEncodeAudio(const std::string& fileName)
+{
+    for (int i = 0; i < numSampleTypes; i++)
+    {
+        int sampleType = sampleTypes[i];
+        std::vector<avp::AudioVideoFrame2> frames;
+        {
+            avp::AudioVideoReader3 reader;
+            avp::AudioVideoFrame2 frame;
+            std::vector<int> indexes(1, 1);
+            int index;
+            if (!reader.open(fileName, indexes, sampleType, avp::PixelTypeUnknown))
+                continue;
+            while (reader.read(frame, index))
+                frames.push_back(frame.clone());
+            reader.close();
+        }
+        if (frames.empty())
+            continue;
+        int numFrames = frames.size();
+
+        {
+            avp::AudioVideoWriter2 writer;
+            if (writer.open("bench_out.m4a", "mp4", false, true, "aac", sampleType, channelLayoutMono, sampleRate, 128000,
+                false, "", avp::PixelTypeUnknown, 0, 0, 0, 0))
+            {
+                long long int numSamples = 0;
+                double beginTime = getSeconds();
+                for (int j = 0; j < numFrames; j++)
+                {
+                    avp::AudioVideoFrame2 frame = frames[j];
+                    writer.write(frame);
+                    numSamples += frame.numSamples;
+                }
+                writer.close();
+                double elapse = getSeconds() - beginTime;
+                addResult("{\"test\":\"encode_audio\",\"api\":\"AudioVideoWriter2\",\"type\":\"%s\","
+                    "\"samples\":%lld,\"seconds\":%.4f,\"samples_per_second\":%.0f}",
+                    getSampleTypeName(sampleType), numSamples, elapse, numSamples / elapse);
+            }
+        }
+
+        {
+            avp::AudioVideoWriter3 writer;
+            std::vector<avp::OutputStreamProperties> props(1);
+            props[0] = avp::OutputStreamProperties("aac", sampleType, channelLayoutMono, sampleRate, 128000);
+            if (writer.open("bench_out.m4a", "mp4", false, props))
+            {
+                long long int numSamples = 0;
+                double beginTime = getSeconds();
+                for (int j = 0; j < numFrames; j++)
+                {
+                    writer.write(frames[j], 0);
+                    numSamples += frames[j].numSamples;
+                }
+                avp::AudioVideoStats stats;
+                writer.getStats(stats);
+                writer.close();
+                double elapse = getSeconds() - beginTime;
+                addResult("{\"test\":\"encode_audio\",\"api\":\"AudioVideoWriter3\",\"type\":\"%s\","
+                    "\"samples\":%lld,\"seconds\":%.4f,\"samples_per_second\":%.0f,\"convert_gbps\":%.3f}",
+                    getSampleTypeName(sampleType), numSamples, elapse, numSamples / elapse,
+                    getConvertGBPerSecond(double(numSamples) * getSampleNumBytes(sampleType), stats.total.convertNanoSec));
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string resultFileName = argc > 1 ? argv[1] : "benchmark.json";
+
+    avp::setDumpInput(false);
+    for (int i = 0; i < numResolutions; i++)
+    {
+        std::string fileName = getInputFileName(resolutions[i]);
+        if (!generateInput(resolutions[i], fileName))
+        {
+            printf("cannot generate input %s\n", fileName.c_str());
+            return 1;
+        }
+        benchmarkDecode(resolutions[i], fileName);
+        benchmarkSeek(resolutions[i], fileName);
+        benchmarkEncode(resolutions[i], fileName);
+        if (i == 0)
+            benchmarkEncodeAudio(fileName);
+    }
+
+    FILE* file = fopen(resultFileName.c_str(), "w");
+    if (!file)
+    {
+        printf("cannot open %s for write\n", resultFileName.c_str());
+        return 1;
+    }
+    fprintf(file, "{\"frame_rate\":%d,\"duration\":%d,\"encode_frames\":%d,\"results\":[\n",
+        frameRate, durationInSeconds, numEncodeFrames);
+    for (size_t i = 0; i < results.size(); i++)
+        fprintf(file, "%s%s\n", results[i].c_str(), i + 1 < results.size() ? "," : "");
+    fprintf(file, "]}\n");
+    fclose(file);
+    return 0;
+}
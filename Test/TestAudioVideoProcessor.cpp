@@ -4,6 +4,10 @@
 #include "opencv2/imgproc.hpp"
 #include "opencv2/highgui.hpp"
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <cmath>
+#include <cstring>
 
 void copy()
 {
@@ -1196,4 +1200,1423 @@ int main15()
     }    
 
     return 0;
-}
\ No newline at end of file
+}
+
+// 16 test AudioVideoWriter3's HLS packager
+int main16()
+{
+    std::string fileName = "F:\\panovideo\\test\\test1\\YDXJ0136.mp4";
+    avp::AudioVideoFrame2 avFrame;
+    avp::AudioVideoReader2 avReader;
+    avp::AudioVideoWriter3 avWriter;
+    std::vector<avp::Option> opts;
+    bool ok;
+
+    ok = avReader.open(fileName, true, avp::SampleTypeUnknown, true, avp::PixelTypeBGR24);
+    if (!ok)
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+    int width = avReader.getVideoWidth();
+    int height = avReader.getVideoHeight();
+    double frameRate = avReader.getVideoFrameRate();
+    int sampleType = avReader.getAudioSampleType();
+    int channelLayout = avReader.getAudioChannelLayout();
+    int sampleRate = avReader.getAudioSampleRate();
+
+    std::vector<avp::OutputStreamProperties> props(2);
+    props[0] = avp::OutputStreamProperties("h264", avp::PixelTypeBGR24, width, height, frameRate, 4000000);
+    props[1] = avp::OutputStreamProperties("aac", sampleType, channelLayout, sampleRate, 128000);
+    opts.push_back(std::make_pair("preset", "veryfast"));
+    ok = avWriter.openPackager("hls", avp::PackagerTypeHLS, 4, false, props, opts);
+    if (!ok)
+    {
+        printf("cannot open packager for write\n");
+        return 0;
+    }
+    while (avReader.read(avFrame))
+        avWriter.write(avFrame, avFrame.mediaType == avp::VIDEO ? 0 : 1);
+    avReader.close();
+    avWriter.close();
+
+    return 0;
+}
+
+
+// 17 test AudioSampleFifo, one thread decodes audio and pushes samples, 
+// another thread pulls fixed size frames and encodes them
+int main17()
+{
+    std::string fileName = "F:\\panovideo\\test\\test1\\YDXJ0136.mp4";
+    avp::AudioVideoReader2 avReader;
+    avp::AudioVideoWriter3 avWriter;
+    avp::AudioSampleFifo fifo;
+    bool ok;
+
+    ok = avReader.open(fileName, true, avp::SampleType32FP, false, avp::PixelTypeUnknown);
+    if (!ok)
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+    int channelLayout = avReader.getAudioChannelLayout();
+    int sampleRate = avReader.getAudioSampleRate();
+    int numChannels = avReader.getAudioNumChannels();
+
+    std::vector<avp::OutputStreamProperties> props(1);
+    props[0] = avp::OutputStreamProperties("aac", avp::SampleType32FP, channelLayout, sampleRate, 128000);
+    ok = avWriter.open("fifo.mp4", "", false, props);
+    if (!ok)
+    {
+        printf("cannot open file for write\n");
+        return 0;
+    }
+    // 32 bit float planar is what the aac encoder takes, no resampling is needed
+    printf("audio passthrough %d\n", avWriter.isPassthrough(0));
+
+    fifo.init(avp::SampleType32FP, numChannels, sampleRate);
+    std::atomic<bool> end(false);
+    std::thread capture([&]()
+    {
+        avp::AudioVideoFrame2 frame;
+        while (avReader.read(frame))
+        {
+            int numWritten = 0;
+            while (numWritten < frame.numSamples)
+            {
+                unsigned char* data[8] = { 0 };
+                for (int i = 0; i < numChannels; i++)
+                    data[i] = frame.data[i] + numWritten * sizeof(float);
+                numWritten += fifo.write(data, frame.numSamples - numWritten);
+                if (numWritten < frame.numSamples)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        end = true;
+    });
+
+    int frameSize = 1000;
+    long long int sampleCount = 0;
+    avp::AudioVideoFrame2 frame(avp::SampleType32FP, numChannels, channelLayout, frameSize);
+    Timer t;
+    while (true)
+    {
+        bool captureEnd = end;
+        if (fifo.size() < frameSize)
+        {
+            if (captureEnd && fifo.size() == 0)
+                break;
+            if (!captureEnd)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+        }
+        frame.numSamples = fifo.read(frame.data, frameSize);
+        frame.timeStamp = sampleCount * 1000000 / sampleRate;
+        sampleCount += frame.numSamples;
+        avWriter.write(frame, 0);
+    }
+    t.end();
+    capture.join();
+    avReader.close();
+    avWriter.close();
+    printf("samples %lld, time %f\n", sampleCount, t.elapse());
+
+    return 0;
+}
+
+// 18 test AudioVideoReader3 converting audio to 16k mono with the linear resampler
+int main18()
+{
+    std::string fileName = "F:\\panovideo\\test\\test1\\YDXJ0136.mp4";
+    avp::AudioVideoReader3 avReader;
+    avp::AudioVideoFrame2 avFrame;
+    std::vector<avp::InputStreamProperties> props;
+    bool ok;
+
+    avp::AudioVideoReader3::getStreamProperties(fileName, props);
+    std::vector<int> indexes;
+    for (int i = 0; i < props.size(); i++)
+    {
+        if (props[i].mediaType == avp::AUDIO)
+            indexes.push_back(i);
+    }
+
+    // 4 is AV_CH_LAYOUT_MONO
+    ok = avReader.open(fileName, indexes, avp::SampleType16S, 16000, 4,
+        avp::ResampleOptions(avp::ResampleEngineSwr, avp::ResampleQualityLinear), avp::PixelTypeUnknown);
+    if (!ok)
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+
+    int index;
+    long long int sampleCount = 0;
+    Timer t;
+    while (avReader.read(avFrame, index))
+    {
+        sampleCount += avFrame.numSamples;
+        printf("ts %lld, num samples %d\n", avFrame.timeStamp, avFrame.numSamples);
+    }
+    t.end();
+    printf("total samples %lld, duration %f, time %f\n", sampleCount, sampleCount / 16000.0, t.elapse());
+    avReader.close();
+
+    return 0;
+}
+
+static void printStats(const char* name, const avp::StreamStats& s)
+{
+    printf("%s: type %d, packets %lld, bytes %lld, frames %lld, dropped %lld, queue %lld, "
+        "demux %.3f ms, decode %.3f ms, convert %.3f ms, encode %.3f ms, mux %.3f ms\n",
+        name, s.mediaType, s.numPackets, s.numBytes, s.numFrames, s.numDroppedFrames, s.queueDepth,
+        s.demuxNanoSec / 1e6, s.decodeNanoSec / 1e6, s.convertNanoSec / 1e6, s.encodeNanoSec / 1e6, s.muxNanoSec / 1e6);
+}
+
+// 19 test getStats of AudioVideoReader3 and AudioVideoWriter3, 
+// another thread polls the counters while transcoding
+int main19()
+{
+    std::string fileName = "F:\\panovideo\\test\\test1\\YDXJ0136.mp4";
+    avp::AudioVideoReader3 avReader;
+    avp::AudioVideoWriter3 avWriter;
+    avp::AudioVideoFrame2 avFrame;
+    std::vector<avp::InputStreamProperties> inProps;
+    std::vector<avp::Option> opts;
+    bool ok;
+
+    avp::AudioVideoReader3::getStreamProperties(fileName, inProps);
+    std::vector<int> indexes;
+    std::vector<avp::OutputStreamProperties> outProps;
+    std::vector<int> outIndexes(inProps.size(), -1);
+    for (int i = 0; i < inProps.size(); i++)
+    {
+        if (inProps[i].mediaType == avp::VIDEO)
+        {
+            outIndexes[i] = outProps.size();
+            indexes.push_back(i);
+            outProps.push_back(avp::OutputStreamProperties("h264", avp::PixelTypeBGR24, 
+                inProps[i].width, inProps[i].height, inProps[i].frameRate, 4000000));
+        }
+        else if (inProps[i].mediaType == avp::AUDIO)
+        {
+            outIndexes[i] = outProps.size();
+            indexes.push_back(i);
+            outProps.push_back(avp::OutputStreamProperties("aac", avp::SampleType16S, 
+                inProps[i].channelLayout, inProps[i].sampleRate, 128000));
+        }
+    }
+
+    ok = avReader.open(fileName, indexes, avp::SampleType16S, avp::PixelTypeBGR24);
+    if (!ok)
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+    opts.push_back(std::make_pair("preset", "veryfast"));
+    ok = avWriter.open("stats.mp4", "", false, outProps, opts);
+    if (!ok)
+    {
+        printf("cannot open file for write\n");
+        return 0;
+    }
+
+    std::atomic<bool> end(false);
+    std::thread monitor([&]()
+    {
+        avp::AudioVideoStats readStats, writeStats;
+        while (!end)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+            avReader.getStats(readStats);
+            avWriter.getStats(writeStats);
+            printStats("read total", readStats.total);
+            printStats("write total", writeStats.total);
+        }
+    });
+
+    int index;
+    while (avReader.read(avFrame, index))
+        avWriter.write(avFrame, outIndexes[index]);
+
+    end = true;
+    monitor.join();
+
+    avp::AudioVideoStats stats;
+    avReader.getStats(stats);
+    for (int i = 0; i < stats.streams.size(); i++)
+        printStats("read stream", stats.streams[i]);
+    avWriter.getStats(stats);
+    for (int i = 0; i < stats.streams.size(); i++)
+        printStats("write stream", stats.streams[i]);
+    avReader.close();
+    avWriter.close();
+
+    return 0;
+}
+
+// 20 test tracing of the read and write paths, load trace.json in chrome://tracing
+int main20()
+{
+    std::string fileName = "F:\\panovideo\\test\\test1\\YDXJ0136.mp4";
+    avp::AudioVideoReader3 avReader;
+    avp::AudioVideoWriter3 avWriter;
+    avp::AudioVideoFrame2 avFrame;
+    std::vector<avp::InputStreamProperties> inProps;
+    std::vector<avp::Option> opts;
+    bool ok;
+
+    avp::AudioVideoReader3::getStreamProperties(fileName, inProps);
+    std::vector<int> indexes;
+    std::vector<avp::OutputStreamProperties> outProps;
+    for (int i = 0; i < inProps.size(); i++)
+    {
+        if (inProps[i].mediaType == avp::VIDEO)
+        {
+            indexes.push_back(i);
+            outProps.push_back(avp::OutputStreamProperties("h264", avp::PixelTypeYUV420P,
+                inProps[i].width, inProps[i].height, inProps[i].frameRate, 4000000));
+            break;
+        }
+    }
+
+    ok = avReader.open(fileName, indexes, avp::SampleTypeUnknown, avp::PixelTypeYUV420P);
+    if (!ok)
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+    opts.push_back(std::make_pair("preset", "veryfast"));
+    ok = avWriter.open("trace.mp4", "", false, outProps, opts);
+    if (!ok)
+    {
+        printf("cannot open file for write\n");
+        return 0;
+    }
+
+    avp::setTraceEnabled(true);
+    int index;
+    while (avReader.read(avFrame, index))
+        avWriter.write(avFrame, 0);
+    avWriter.close();
+    avReader.close();
+    avp::setTraceEnabled(false);
+    if (!avp::dumpTraceEvents("trace.json"))
+        printf("cannot dump trace events\n");
+
+    return 0;
+}
+
+// 21 test async log, several threads read the same file and log at the same time
+int main21()
+{
+    std::string fileName = "F:\\panovideo\\test\\test1\\YDXJ0136.mp4";
+    avp::setAsyncLog(true, true);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; i++)
+    {
+        threads.push_back(std::thread([&fileName, i]()
+        {
+            avp::AudioVideoReader3 avReader;
+            avp::AudioVideoFrame2 avFrame;
+            std::vector<avp::InputStreamProperties> props;
+            avp::AudioVideoReader3::getStreamProperties(fileName, props);
+            std::vector<int> indexes;
+            for (int j = 0; j < props.size(); j++)
+                indexes.push_back(j);
+            if (!avReader.open(fileName, indexes, avp::SampleType16S, avp::PixelTypeBGR24))
+            {
+                printf("thread %d cannot open file for read\n", i);
+                return;
+            }
+            int index, count = 0;
+            while (avReader.read(avFrame, index))
+                count++;
+            avReader.close();
+            printf("thread %d read %d frames\n", i, count);
+        }));
+    }
+    for (int i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    avp::setAsyncLog(false);
+    return 0;
+}
+
+// 22 test reading into frames backed by huge pages
+int main22()
+{
+    avp::AudioVideoReader3 avReader;
+    avp::AudioVideoFrame2 avFrame, copyFrame;
+    std::vector<int> indexes;
+    bool ok;
+
+    avp::setUseHugePages(true);
+    indexes.push_back(0);
+    ok = avReader.open("F:\\panovideo\\test\\test1\\YDXJ0136.mp4", indexes, avp::SampleType16S, avp::PixelTypeBGR32);
+    if (!ok)
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+
+    Timer t;
+    int index, count = 0;
+    while (avReader.read(avFrame, index))
+    {
+        if (avFrame.mediaType != avp::VIDEO)
+            continue;
+        avFrame.copyTo(copyFrame);
+        if ((size_t)copyFrame.data[0] % 128)
+            printf("frame %d not aligned\n", count);
+        count++;
+    }
+    t.end();
+    printf("%d frames copied, time = %f\n", count, t.elapse());
+    avReader.close();
+    avp::setUseHugePages(false);
+    return 0;
+}
+
+// 23 test copying read frames into frames with aligned steps and padding
+int main23()
+{
+    avp::AudioVideoReader3 avReader;
+    avp::AudioVideoFrame2 avFrame, alignedFrame;
+    std::vector<int> indexes;
+    bool ok;
+
+    indexes.push_back(0);
+    ok = avReader.open("F:\\panovideo\\test\\test1\\YDXJ0136.mp4", indexes, avp::SampleType16S, avp::PixelTypeYUV420P);
+    if (!ok)
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+
+    int index, count = 0;
+    while (avReader.read(avFrame, index))
+    {
+        if (avFrame.mediaType != avp::VIDEO)
+            continue;
+        if (alignedFrame.mediaType != avp::VIDEO)
+        {
+            ok = alignedFrame.createAligned(avFrame.pixelType, avFrame.width, avFrame.height, 64, 2, 16);
+            if (!ok)
+            {
+                printf("cannot create aligned frame\n");
+                break;
+            }
+            printf("steps %d %d %d\n", alignedFrame.steps[0], alignedFrame.steps[1], alignedFrame.steps[2]);
+        }
+        unsigned char* data = alignedFrame.data[0];
+        avFrame.copyTo(alignedFrame);
+        if (alignedFrame.data[0] != data || alignedFrame.steps[0] % 64 || alignedFrame.steps[1] % 64 ||
+            (size_t)alignedFrame.data[1] % 64 || (size_t)alignedFrame.data[2] % 64)
+            printf("frame %d lost aligned layout\n", count);
+        count++;
+    }
+    printf("%d frames copied\n", count);
+    avReader.close();
+    return 0;
+}
+
+// 24 test reading and writing yuv422p and 10 bit sources in the native pixel type
+int main24()
+{
+    std::string fileName = "F:\\panovideo\\test\\hdr\\yuv420p10.mp4";
+    std::vector<avp::InputStreamProperties> props;
+    avp::AudioVideoReader3::getStreamProperties(fileName, props);
+    int videoIndex = -1;
+    for (int i = 0; i < props.size(); i++)
+    {
+        if (props[i].mediaType == avp::VIDEO)
+        {
+            videoIndex = i;
+            break;
+        }
+    }
+    if (videoIndex < 0)
+    {
+        printf("no video stream\n");
+        return 0;
+    }
+    int pixelType = props[videoIndex].pixelType;
+    printf("native pixel type %d\n", pixelType);
+
+    avp::AudioVideoReader3 avReader;
+    avp::AudioVideoWriter3 avWriter;
+    avp::AudioVideoFrame2 avFrame;
+    std::vector<int> indexes;
+    std::vector<avp::OutputStreamProperties> outProps;
+    std::vector<avp::Option> opts;
+    bool ok;
+
+    indexes.push_back(videoIndex);
+    ok = avReader.open(fileName, indexes, avp::SampleType16S, pixelType);
+    if (!ok)
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+    outProps.push_back(avp::OutputStreamProperties("h264", pixelType, props[videoIndex].width, props[videoIndex].height,
+        props[videoIndex].frameRate, 0));
+    ok = avWriter.open("native.mp4", "", false, outProps, opts);
+    if (!ok)
+    {
+        printf("cannot open file for write\n");
+        return 0;
+    }
+
+    avp::AudioVideoStats stats;
+    int index;
+    while (avReader.read(avFrame, index))
+        avWriter.write(avFrame, 0);
+    avReader.getStats(stats);
+    printf("read convert time %lld ns\n", stats.total.convertNanoSec);
+    avWriter.getStats(stats);
+    printf("write convert time %lld ns\n", stats.total.convertNanoSec);
+    avWriter.close();
+    avReader.close();
+    return 0;
+}
+
+// 25 test fast color conversion against swscale output and time both
+int main25()
+{
+    std::string fileName = "F:\\panovideo\\test\\test1\\YDXJ0136.mp4";
+    std::vector<cv::Mat> swsImages;
+    avp::AudioVideoReader3 avReader;
+    avp::AudioVideoFrame2 avFrame;
+    std::vector<int> indexes(1, 0);
+    avp::AudioVideoStats stats;
+    int index;
+    bool ok;
+
+    avp::setFastColorConvert(false);
+    ok = avReader.open(fileName, indexes, avp::SampleType16S, avp::PixelTypeBGR24);
+    if (!ok)
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+    while (swsImages.size() < 100 && avReader.read(avFrame, index))
+        swsImages.push_back(cv::Mat(avFrame.height, avFrame.width, CV_8UC3, avFrame.data[0], avFrame.steps[0]).clone());
+    avReader.getStats(stats);
+    printf("sws read convert time %lld ns\n", stats.total.convertNanoSec);
+    avReader.close();
+
+    avp::setFastColorConvert(true);
+    ok = avReader.open(fileName, indexes, avp::SampleType16S, avp::PixelTypeBGR24);
+    if (!ok)
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+    int count = 0;
+    double maxDiff = 0, sumMeanDiff = 0;
+    while (count < swsImages.size() && avReader.read(avFrame, index))
+    {
+        cv::Mat fast(avFrame.height, avFrame.width, CV_8UC3, avFrame.data[0], avFrame.steps[0]);
+        cv::Mat diff;
+        cv::absdiff(fast, swsImages[count], diff);
+        double currMax;
+        cv::minMaxLoc(diff.reshape(1), 0, &currMax);
+        maxDiff = std::max(maxDiff, currMax);
+        sumMeanDiff += cv::mean(diff.reshape(1))[0];
+        count++;
+    }
+    avReader.getStats(stats);
+    printf("fast read convert time %lld ns\n", stats.total.convertNanoSec);
+    avReader.close();
+    if (count)
+        printf("%d frames, max diff %f, mean diff %f\n", count, maxDiff, sumMeanDiff / count);
+
+    for (int fast = 0; fast < 2; fast++)
+    {
+        avp::setFastColorConvert(fast != 0);
+        avp::AudioVideoWriter3 avWriter;
+        std::vector<avp::OutputStreamProperties> outProps;
+        std::vector<avp::Option> opts;
+        outProps.push_back(avp::OutputStreamProperties("h264", avp::PixelTypeBGR24,
+            swsImages[0].cols, swsImages[0].rows, 30, 0));
+        ok = avWriter.open(fast ? "fast.mp4" : "sws.mp4", "", false, outProps, opts);
+        if (!ok)
+        {
+            printf("cannot open file for write\n");
+            break;
+        }
+        for (int i = 0; i < swsImages.size(); i++)
+        {
+            unsigned char* data[8] = { swsImages[i].data, 0 };
+            int steps[8] = { swsImages[i].step[0], 0 };
+            avp::AudioVideoFrame2 frame(data, steps, avp::PixelTypeBGR24,
+                swsImages[i].cols, swsImages[i].rows, i * 1000000LL / 30);
+            avWriter.write(frame, 0);
+        }
+        avWriter.getStats(stats);
+        printf("%s write convert time %lld ns\n", fast ? "fast" : "sws", stats.total.convertNanoSec);
+        avWriter.close();
+    }
+    avp::setFastColorConvert(false);
+    return 0;
+}
+
+// 26 test reading video frames into a normalized float tensor against bgr frames resized by opencv
+int main26()
+{
+    std::string fileName = "F:\\panovideo\\test\\test1\\YDXJ0136.mp4";
+    avp::AudioVideoReader3 avReader;
+    avp::AudioVideoFrame2 avFrame;
+    std::vector<int> indexes(1, 0);
+    int index;
+    bool ok;
+
+    avp::TensorOptions options(416, 416);
+    options.scale[0] = options.scale[1] = options.scale[2] = 1.0f / 255;
+    std::vector<float> tensor(3 * options.width * options.height);
+    std::vector<cv::Mat> refs;
+
+    Timer t;
+    ok = avReader.open(fileName, indexes, avp::SampleType16S, avp::PixelTypeBGR24);
+    if (!ok)
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+    t.start();
+    while (refs.size() < 100 && avReader.read(avFrame, index))
+    {
+        cv::Mat src(avFrame.height, avFrame.width, CV_8UC3, avFrame.data[0], avFrame.steps[0]);
+        cv::Mat dst;
+        cv::resize(src, dst, cv::Size(options.width, options.height), 0, 0, cv::INTER_LINEAR);
+        dst.convertTo(dst, CV_32F, 1.0 / 255);
+        refs.push_back(dst);
+    }
+    t.end();
+    printf("read, resize and normalize time %f\n", t.elapse());
+    avReader.close();
+
+    ok = avReader.open(fileName, indexes, avp::SampleType16S, avp::PixelTypeUnknown);
+    if (!ok)
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+    int count = 0;
+    double maxDiff = 0;
+    t.start();
+    while (count < refs.size() && avReader.readTensor(avFrame, index, &tensor[0], options))
+    {
+        std::vector<cv::Mat> planes(3);
+        for (int i = 0; i < 3; i++)
+            planes[i] = cv::Mat(options.height, options.width, CV_32F, &tensor[i * options.width * options.height]);
+        cv::Mat merged, diff;
+        cv::merge(planes, merged);
+        cv::absdiff(merged, refs[count], diff);
+        double currMax;
+        cv::minMaxLoc(diff.reshape(1), 0, &currMax);
+        maxDiff = std::max(maxDiff, currMax);
+        count++;
+    }
+    t.end();
+    printf("read tensor time %f, %d frames, max diff %f\n", t.elapse(), count, maxDiff);
+
+    options.letterbox = true;
+    options.padValue = 114;
+    options.rgb = true;
+    if (avReader.readTensor(avFrame, index, &tensor[0], options))
+    {
+        int x, y, w, h;
+        avp::getTensorRect(options, avFrame.width, avFrame.height, x, y, w, h);
+        printf("letterbox rect %d %d %d %d, pad %f\n", x, y, w, h, tensor[0]);
+    }
+    avReader.close();
+    return 0;
+}
+
+// 27 test reading video frames in batches sharing one contiguous buffer
+int main27()
+{
+    std::string fileName = "F:\\panovideo\\test\\test1\\YDXJ0136.mp4";
+    avp::AudioVideoReader3 avReader;
+    std::vector<avp::AudioVideoFrame2> frames;
+    std::vector<int> indexes(1, 0);
+    bool ok;
+
+    ok = avReader.open(fileName, indexes, avp::SampleType16S, avp::PixelTypeBGR24);
+    if (!ok)
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+
+    Timer t;
+    int count = 0;
+    const unsigned char* prevData = 0;
+    while (avReader.readBatch(frames, 16, 0))
+    {
+        int frameNumBytes = frames[0].steps[0] * frames[0].height;
+        for (int i = 0; i < frames.size(); i++)
+        {
+            if (frames[i].data[0] != frames[0].data[0] + i * frameNumBytes)
+                printf("frame %d of batch not contiguous\n", i);
+        }
+        if (prevData && prevData != frames[0].data[0])
+            printf("batch buffer reallocated\n");
+        prevData = frames[0].data[0];
+        count += frames.size();
+
+        cv::Mat show(frames[0].height, frames[0].width, CV_8UC3, frames[0].data[0], frames[0].steps[0]);
+        cv::imshow("first of batch", show);
+        cv::waitKey(1);
+    }
+    t.end();
+    printf("%d frames, time %f\n", count, t.elapse());
+    avReader.close();
+    return 0;
+}
+
+// 28 test reading audio and video frames into caller owned buffers
+struct FrameRing
+{
+    std::vector<avp::AudioVideoFrame2> videoFrames;
+    int next;
+};
+
+static bool provideFrame(void* userData, int index, avp::AudioVideoFrame2& buffer)
+{
+    FrameRing* ring = (FrameRing*)userData;
+    if (index != 0)
+        return false;
+    buffer = ring->videoFrames[ring->next];
+    ring->next = (ring->next + 1) % ring->videoFrames.size();
+    return true;
+}
+
+int main28()
+{
+    std::string fileName = "F:\\panovideo\\test\\test1\\YDXJ0136.mp4";
+    avp::AudioVideoReader3 avReader;
+    avp::AudioVideoFrame2 avFrame;
+    std::vector<int> indexes;
+    avp::InputStreamProperties videoProp, audioProp;
+    int index;
+    bool ok;
+
+    indexes.push_back(0);
+    indexes.push_back(1);
+    ok = avReader.open(fileName, indexes, avp::SampleType16S, avp::PixelTypeBGR24);
+    if (!ok)
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+    avReader.getProperties(0, videoProp);
+    avReader.getProperties(1, audioProp);
+
+    std::vector<avp::AudioVideoFrame2> buffers(2);
+    buffers[0].create(videoProp.pixelType, videoProp.width, videoProp.height);
+    buffers[1].create(audioProp.sampleType, audioProp.numChannels, audioProp.channelLayout, audioProp.numSamples);
+    int numVideoFrames = 0, numAudioFrames = 0;
+    while (numVideoFrames < 100 && avReader.readTo(buffers, index))
+    {
+        if (index == 0)
+        {
+            numVideoFrames++;
+            cv::Mat show(buffers[0].height, buffers[0].width, CV_8UC3, buffers[0].data[0], buffers[0].steps[0]);
+            cv::imshow("buffer", show);
+            cv::waitKey(1);
+        }
+        else
+            numAudioFrames++;
+    }
+    printf("%d video frames and %d audio frames read to buffers\n", numVideoFrames, numAudioFrames);
+    avReader.close();
+
+    indexes.resize(1);
+    ok = avReader.open(fileName, indexes, avp::SampleType16S, avp::PixelTypeBGR24);
+    if (!ok)
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+    FrameRing ring;
+    ring.videoFrames.resize(4);
+    for (int i = 0; i < ring.videoFrames.size(); i++)
+        ring.videoFrames[i].create(videoProp.pixelType, videoProp.width, videoProp.height);
+    ring.next = 0;
+    Timer t;
+    numVideoFrames = 0;
+    while (avReader.readTo(provideFrame, &ring, avFrame, index))
+    {
+        if (avFrame.data[0] != ring.videoFrames[numVideoFrames % ring.videoFrames.size()].data[0])
+            printf("frame %d not decoded into the ring\n", numVideoFrames);
+        numVideoFrames++;
+    }
+    t.end();
+    printf("%d video frames read to ring, time %f\n", numVideoFrames, t.elapse());
+    avReader.close();
+    return 0;
+}
+
+// 29 test decoding into memory supplied by the caller
+struct DecodePool
+{
+    std::mutex mtx;
+    std::vector<void*> blocks;
+    int blockSize;
+    int numAllocs, numFrees;
+};
+
+static void* allocDecodeBuffer(void* userData, int numBytes, int alignment)
+{
+    DecodePool* pool = (DecodePool*)userData;
+    std::lock_guard<std::mutex> lock(pool->mtx);
+    if (numBytes > pool->blockSize || alignment > 64 || pool->blocks.empty())
+        return 0;
+    void* ptr = pool->blocks.back();
+    pool->blocks.pop_back();
+    pool->numAllocs++;
+    return ptr;
+}
+
+static void freeDecodeBuffer(void* userData, void* ptr)
+{
+    DecodePool* pool = (DecodePool*)userData;
+    std::lock_guard<std::mutex> lock(pool->mtx);
+    pool->blocks.push_back(ptr);
+    pool->numFrees++;
+}
+
+int main29()
+{
+    std::string fileName = "F:\\panovideo\\test\\test1\\YDXJ0136.mp4";
+    std::vector<avp::InputStreamProperties> props;
+    avp::AudioVideoReader3::getStreamProperties(fileName, props);
+    if (props.empty() || props[0].mediaType != avp::VIDEO)
+    {
+        printf("no video stream\n");
+        return 0;
+    }
+
+    DecodePool pool;
+    pool.blockSize = (props[0].width + 128) * (props[0].height + 128) * 2;
+    pool.numAllocs = 0;
+    pool.numFrees = 0;
+    std::vector<std::unique_ptr<unsigned char[]> > memory(32);
+    for (int i = 0; i < memory.size(); i++)
+    {
+        memory[i].reset(new unsigned char[pool.blockSize + 64]);
+        unsigned char* ptr = memory[i].get();
+        pool.blocks.push_back(ptr + (64 - (size_t)ptr % 64) % 64);
+    }
+
+    avp::AudioVideoReader3 avReader;
+    avp::AudioVideoFrame2 avFrame;
+    std::vector<int> indexes(1, 0);
+    int index, count = 0;
+    avReader.setDecodeAllocator(avp::DecodeAllocator(allocDecodeBuffer, freeDecodeBuffer, &pool));
+    if (!avReader.open(fileName, indexes, avp::SampleType16S, props[0].pixelType))
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+    Timer t;
+    while (avReader.read(avFrame, index))
+    {
+        bool inPool = false;
+        for (int i = 0; i < memory.size(); i++)
+        {
+            if (avFrame.data[0] >= memory[i].get() && avFrame.data[0] < memory[i].get() + pool.blockSize + 64)
+                inPool = true;
+        }
+        if (!inPool)
+            printf("frame %d not in caller memory\n", count);
+        count++;
+    }
+    t.end();
+    avReader.close();
+    printf("%d frames, time %f, %d allocs, %d frees\n", count, t.elapse(), pool.numAllocs, pool.numFrees);
+    return 0;
+}
+
+// 30 test decoding the video tracks of a multi camera recording in parallel
+int main30()
+{
+    std::string fileName = "F:\\panovideo\\test\\multicam\\four_tracks.mov";
+    std::vector<avp::InputStreamProperties> props;
+    avp::AudioVideoReader3::getStreamProperties(fileName, props);
+    std::vector<int> indexes;
+    for (int i = 0; i < props.size(); i++)
+    {
+        if (props[i].mediaType == avp::VIDEO)
+            indexes.push_back(i);
+    }
+    if (indexes.empty())
+    {
+        printf("no video stream\n");
+        return 0;
+    }
+
+    for (int parallel = 0; parallel < 2; parallel++)
+    {
+        avp::AudioVideoReader3 avReader;
+        avp::AudioVideoFrame2 avFrame;
+        avReader.setParallelDecode(parallel ? 4 : 0);
+        if (!avReader.open(fileName, indexes, avp::SampleType16S, avp::PixelTypeBGR24))
+        {
+            printf("cannot open file for read\n");
+            return 0;
+        }
+        std::vector<long long int> lastTimeStamps(props.size(), -1);
+        int index, count = 0;
+        Timer t;
+        while (avReader.read(avFrame, index))
+        {
+            if (avFrame.timeStamp < lastTimeStamps[index])
+                printf("stream %d out of order at %lld\n", index, avFrame.timeStamp);
+            lastTimeStamps[index] = avFrame.timeStamp;
+            count++;
+            if (count % 100 == 0)
+            {
+                avp::AudioVideoStats stats;
+                avReader.getStats(stats);
+                printf("queue depth %lld\n", stats.total.queueDepth);
+            }
+        }
+        t.end();
+        printf("%s, %d frames, time %f\n", parallel ? "parallel" : "serial", count, t.elapse());
+        avReader.close();
+    }
+
+    // Read each stream on its own thread
+    avp::AudioVideoReader3 avReader;
+    avReader.setParallelDecode(4);
+    if (!avReader.open(fileName, indexes, avp::SampleType16S, avp::PixelTypeBGR24))
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+    std::vector<std::thread> threads;
+    for (int i = 0; i < indexes.size(); i++)
+    {
+        threads.push_back(std::thread([&avReader, &indexes, i]()
+        {
+            avp::AudioVideoFrame2 frame;
+            int count = 0;
+            while (avReader.readStream(frame, indexes[i]))
+                count++;
+            printf("stream %d, %d frames\n", indexes[i], count);
+        }));
+    }
+    for (int i = 0; i < threads.size(); i++)
+        threads[i].join();
+    avReader.close();
+    return 0;
+}
+
+// 31 test reading hourly recordings as one continuous stream
+int main31()
+{
+    std::vector<std::string> fileNames;
+    fileNames.push_back("F:\\panovideo\\test\\hourly\\00.mp4");
+    fileNames.push_back("F:\\panovideo\\test\\hourly\\01.mp4");
+    fileNames.push_back("F:\\panovideo\\test\\hourly\\02.mp4");
+    std::vector<int> indexes;
+
+    avp::AudioVideoPlaylistReader avReader;
+    avp::AudioVideoFrame2 avFrame;
+    if (!avReader.open(fileNames, indexes, avp::SampleType16S, avp::PixelTypeBGR24))
+    {
+        printf("cannot open files for read\n");
+        return 0;
+    }
+
+    std::vector<long long int> lastTimeStamps(16, -1);
+    int index, fileIndex = -1, videoIndex = -1, count = 0;
+    Timer t;
+    while (avReader.read(avFrame, index))
+    {
+        if (avReader.getFileIndex() != fileIndex)
+        {
+            fileIndex = avReader.getFileIndex();
+            printf("file %d starts at %lld\n", fileIndex, avFrame.timeStamp);
+        }
+        if (index < lastTimeStamps.size())
+        {
+            if (avFrame.timeStamp < lastTimeStamps[index])
+                printf("stream %d goes back from %lld to %lld\n", index, lastTimeStamps[index], avFrame.timeStamp);
+            lastTimeStamps[index] = avFrame.timeStamp;
+        }
+        if (avFrame.mediaType == avp::VIDEO)
+            videoIndex = index;
+        count++;
+    }
+    t.end();
+    printf("%d frames, time %f\n", count, t.elapse());
+
+    // Seek into the second file on the whole timeline
+    if (videoIndex >= 0 && avReader.seek(3600000000LL + 60000000LL, videoIndex) && avReader.read(avFrame, index))
+        printf("after seek, file %d, time stamp %lld\n", avReader.getFileIndex(), avFrame.timeStamp);
+    avReader.close();
+
+    // The same recordings listed in a manifest
+    if (avReader.openManifest("F:\\panovideo\\test\\hourly\\list.txt", indexes, avp::SampleType16S, avp::PixelTypeBGR24))
+    {
+        count = 0;
+        while (avReader.read(avFrame, index))
+            count++;
+        printf("manifest, %d frames\n", count);
+        avReader.close();
+    }
+    return 0;
+}
+
+// 32 test switching between short segments with reopen instead of open
+int main32()
+{
+    std::vector<std::string> fileNames;
+    char buf[256];
+    for (int i = 0; i < 10; i++)
+    {
+        sprintf(buf, "F:\\panovideo\\test\\segments\\seg%03d.ts", i);
+        fileNames.push_back(buf);
+    }
+    std::vector<avp::InputStreamProperties> props;
+    avp::AudioVideoReader3::getStreamProperties(fileNames[0], props);
+    std::vector<int> indexes;
+    for (int i = 0; i < props.size(); i++)
+    {
+        if (props[i].mediaType == avp::AUDIO || props[i].mediaType == avp::VIDEO)
+            indexes.push_back(i);
+    }
+
+    for (int useReopen = 0; useReopen < 2; useReopen++)
+    {
+        avp::AudioVideoReader3 avReader;
+        avp::AudioVideoFrame2 avFrame;
+        int index, count = 0;
+        double openTime = 0;
+        Timer t;
+        for (int i = 0; i < fileNames.size(); i++)
+        {
+            Timer openTimer;
+            bool ok = (useReopen && i > 0) ? avReader.reopen(fileNames[i]) :
+                avReader.open(fileNames[i], indexes, avp::SampleType16S, avp::PixelTypeBGR24);
+            openTimer.end();
+            openTime += openTimer.elapse();
+            if (!ok)
+            {
+                printf("cannot open file %s for read\n", fileNames[i].c_str());
+                return 0;
+            }
+            while (avReader.read(avFrame, index))
+                count++;
+        }
+        t.end();
+        printf("%s, %d frames, open time %f, total time %f\n", useReopen ? "reopen" : "open", 
+            count, openTime, t.elapse());
+        avReader.close();
+    }
+    return 0;
+}
+
+// 33 test opening many short clips with the scale and resample contexts taken from the cache
+int main33()
+{
+    const char* fileName = "F:\\panovideo\\test\\test1\\YDXJ0136.mp4";
+    std::vector<avp::InputStreamProperties> props;
+    avp::AudioVideoReader3::getStreamProperties(fileName, props);
+    std::vector<int> indexes;
+    for (int i = 0; i < props.size(); i++)
+    {
+        if (props[i].mediaType == avp::AUDIO || props[i].mediaType == avp::VIDEO)
+            indexes.push_back(i);
+    }
+
+    for (int capacity = 0; capacity <= 64; capacity += 64)
+    {
+        avp::setConvertCacheCapacity(capacity);
+        Timer t;
+        for (int i = 0; i < 100; i++)
+        {
+            avp::AudioVideoReader3 avReader;
+            avp::AudioVideoFrame2 avFrame;
+            int index;
+            if (!avReader.open(fileName, indexes, avp::SampleType16S, 22050, 0, avp::ResampleOptions(), 
+                avp::PixelTypeBGR24))
+            {
+                printf("cannot open file for read\n");
+                return 0;
+            }
+            for (int j = 0; j < 10 && avReader.read(avFrame, index); j++);
+            avReader.close();
+        }
+        t.end();
+        avp::ConvertCacheStats stats;
+        avp::getConvertCacheStats(stats);
+        printf("capacity %d, time %f, sws %lld created %lld reused, swr %lld created %lld reused, %d idle\n",
+            capacity, t.elapse(), stats.numSwsCreates, stats.numSwsReuses, 
+            stats.numSwrCreates, stats.numSwrReuses, stats.numIdleContexts);
+    }
+    return 0;
+}
+
+// 34 test reading a stream whose resolution changes in the middle
+int main34()
+{
+    const char* fileName = "F:\\panovideo\\test\\abr\\resolution_switch.ts";
+    std::vector<avp::InputStreamProperties> props;
+    avp::AudioVideoReader3::getStreamProperties(fileName, props);
+    std::vector<int> indexes;
+    for (int i = 0; i < props.size(); i++)
+    {
+        if (props[i].mediaType == avp::VIDEO)
+            indexes.push_back(i);
+    }
+
+    for (int keep = 0; keep < 2; keep++)
+    {
+        avp::AudioVideoReader3 avReader;
+        avp::AudioVideoFrame2 avFrame;
+        avReader.setKeepVideoSize(keep != 0);
+        if (!avReader.open(fileName, indexes, avp::SampleType16S, avp::PixelTypeBGR24))
+        {
+            printf("cannot open file for read\n");
+            return 0;
+        }
+        int index, count = 0;
+        while (avReader.read(avFrame, index))
+        {
+            if (avFrame.flags & avp::FrameFlagFormatChanged)
+            {
+                avp::InputStreamProperties prop;
+                avReader.getProperties(index, prop);
+                printf("%s, frame %d, size changed, frame %d x %d, stream %d x %d\n", 
+                    keep ? "keep" : "follow", count, avFrame.width, avFrame.height, prop.width, prop.height);
+            }
+            count++;
+            cv::Mat show(avFrame.height, avFrame.width, CV_8UC3, avFrame.data[0], avFrame.steps[0]);
+            cv::imshow("frame", show);
+            cv::waitKey(1);
+        }
+        printf("%s, %d frames\n", keep ? "keep" : "follow", count);
+        avReader.close();
+    }
+    return 0;
+}
+
+// 35 extract a time range through callback
+struct RangeCount
+{
+    long long int begin, end;
+    int numVideo, numAudio, numOutside;
+};
+
+static bool countRangeFrame(void* userData, int index, const avp::AudioVideoFrame2& frame)
+{
+    RangeCount* count = (RangeCount*)userData;
+    if (frame.mediaType == avp::VIDEO)
+    {
+        count->numVideo++;
+        if (frame.timeStamp < count->begin || frame.timeStamp >= count->end)
+            count->numOutside++;
+    }
+    else if (frame.mediaType == avp::AUDIO)
+        count->numAudio++;
+    return true;
+}
+
+int main35()
+{
+    const char* fileName = "F:\\panovideo\\test\\test1\\YDXJ0136.mp4";
+    std::vector<avp::InputStreamProperties> props;
+    avp::AudioVideoReader3::getStreamProperties(fileName, props);
+    std::vector<int> indexes;
+    int videoIndex = -1;
+    for (int i = 0; i < props.size(); i++)
+    {
+        if (props[i].mediaType == avp::AUDIO || props[i].mediaType == avp::VIDEO)
+            indexes.push_back(i);
+        if (props[i].mediaType == avp::VIDEO && videoIndex < 0)
+            videoIndex = i;
+    }
+
+    avp::AudioVideoReader3 avReader;
+    if (!avReader.open(fileName, indexes, avp::SampleType16S, avp::PixelTypeBGR24))
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+
+    RangeCount count;
+    count.begin = 12300000;
+    count.end = 14800000;
+    count.numVideo = count.numAudio = count.numOutside = 0;
+    Timer t;
+    bool ok = avReader.readRange(count.begin, count.end, countRangeFrame, &count);
+    t.end();
+    printf("read range %s, %d video frames, %d audio frames, %d outside range, time %f\n", 
+        ok ? "ok" : "failed", count.numVideo, count.numAudio, count.numOutside, t.elapse());
+
+    // Compare with seek and read, which converts every frame after the key frame
+    avp::AudioVideoFrame2 frame;
+    int index, numVideo = 0;
+    t.start();
+    avReader.seek(count.begin, videoIndex);
+    while (avReader.read(frame, index))
+    {
+        if (frame.timeStamp >= count.end)
+            break;
+        if (frame.mediaType == avp::VIDEO && frame.timeStamp >= count.begin)
+            numVideo++;
+    }
+    t.end();
+    printf("seek and read, %d video frames, time %f\n", numVideo, t.elapse());
+    avReader.close();
+    return 0;
+}
+
+// 36 compare encoding speed and size of encoder configs
+int main36()
+{
+    std::string fileName = "F:\\panovideo\\test\\test1\\YDXJ0136.mp4";
+    std::vector<avp::AudioVideoFrame2> frames;
+    avp::AudioVideoReader2 avReader;
+    if (!avReader.open(fileName, false, avp::SampleTypeUnknown, true, avp::PixelTypeBGR24))
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+    int width = avReader.getVideoWidth();
+    int height = avReader.getVideoHeight();
+    double frameRate = avReader.getVideoFrameRate();
+    avp::AudioVideoFrame2 avFrame;
+    for (int i = 0; i < 300 && avReader.read(avFrame); i++)
+    {
+        frames.push_back(avp::AudioVideoFrame2());
+        avFrame.copyTo(frames.back());
+    }
+    avReader.close();
+
+    const char* names[] = { "default", "zero latency", "max throughput", "crf 28", "cbr" };
+    std::vector<avp::EncoderConfig> configs(5);
+    configs[1] = avp::EncoderConfig::zeroLatency();
+    configs[2] = avp::EncoderConfig::maxThroughput();
+    configs[3].rateControl = avp::RateControlCRF;
+    configs[3].crf = 28;
+    configs[4].rateControl = avp::RateControlCBR;
+    configs[4].gopLength = frameRate * 2 + 0.5;
+    for (int i = 0; i < configs.size(); i++)
+    {
+        char outName[64];
+        sprintf(outName, "config%d.mp4", i);
+        std::vector<avp::OutputStreamProperties> props(1);
+        props[0] = avp::OutputStreamProperties("h264", avp::PixelTypeBGR24, width, height, frameRate, 4000000);
+        props[0].encoderConfig = configs[i];
+        avp::AudioVideoWriter3 avWriter;
+        if (!avWriter.open(outName, "", false, props))
+        {
+            printf("cannot open file for write\n");
+            return 0;
+        }
+        Timer t;
+        for (int j = 0; j < frames.size(); j++)
+            avWriter.write(frames[j], 0);
+        avWriter.close();
+        t.end();
+        printf("%s, %d frames, time %f, fps %f\n", names[i], (int)frames.size(), t.elapse(), frames.size() / t.elapse());
+    }
+    return 0;
+}
+
+// 37 compare per frame encode latency of default and low latency writers
+int main37()
+{
+    std::string fileName = "F:\\panovideo\\test\\test1\\YDXJ0136.mp4";
+    std::vector<avp::AudioVideoFrame2> frames;
+    avp::AudioVideoReader2 avReader;
+    if (!avReader.open(fileName, false, avp::SampleTypeUnknown, true, avp::PixelTypeBGR24))
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+    int width = avReader.getVideoWidth();
+    int height = avReader.getVideoHeight();
+    double frameRate = avReader.getVideoFrameRate();
+    avp::AudioVideoFrame2 avFrame;
+    for (int i = 0; i < 300 && avReader.read(avFrame); i++)
+    {
+        frames.push_back(avp::AudioVideoFrame2());
+        avFrame.copyTo(frames.back());
+    }
+    avReader.close();
+
+    for (int mode = 0; mode < 3; mode++)
+    {
+        const char* names[] = { "default", "low latency", "low latency intra refresh" };
+        char outName[64];
+        sprintf(outName, "latency%d.ts", mode);
+        std::vector<avp::OutputStreamProperties> props(1);
+        props[0] = avp::OutputStreamProperties("h264", avp::PixelTypeBGR24, width, height, frameRate, 4000000);
+        avp::AudioVideoWriter3 avWriter;
+        avWriter.setLowLatency(mode > 0, mode > 1);
+        if (!avWriter.open(outName, "", false, props))
+        {
+            printf("cannot open file for write\n");
+            return 0;
+        }
+        // Frames come at the rate of a camera
+        for (int j = 0; j < frames.size(); j++)
+        {
+            avWriter.write(frames[j], 0);
+            std::this_thread::sleep_for(std::chrono::milliseconds(int(1000 / frameRate)));
+        }
+        avp::AudioVideoStats stats;
+        avWriter.getStats(stats);
+        avWriter.close();
+        const avp::StreamStats& video = stats.streams[0];
+        printf("%s, %lld packets, average latency %f ms, max latency %f ms\n", names[mode], video.numPackets,
+            video.numPackets ? video.latencyNanoSec / 1000000.0 / video.numPackets : 0.0, 
+            video.maxLatencyNanoSec / 1000000.0);
+    }
+    return 0;
+}
+
+// 38 test that writing a constant format stream stops allocating frame and packet buffers after warm up
+int main38()
+{
+    std::string fileName = "F:\\panovideo\\test\\test1\\YDXJ0136.mp4";
+    std::vector<avp::AudioVideoFrame2> frames;
+    avp::AudioVideoReader2 avReader;
+    if (!avReader.open(fileName, false, avp::SampleTypeUnknown, true, avp::PixelTypeBGR24))
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+    int width = avReader.getVideoWidth();
+    int height = avReader.getVideoHeight();
+    double frameRate = avReader.getVideoFrameRate();
+    avp::AudioVideoFrame2 avFrame;
+    for (int i = 0; i < 300 && avReader.read(avFrame); i++)
+    {
+        frames.push_back(avp::AudioVideoFrame2());
+        avFrame.copyTo(frames.back());
+    }
+    avReader.close();
+
+    std::vector<avp::OutputStreamProperties> props(1);
+    props[0] = avp::OutputStreamProperties("h264", avp::PixelTypeBGR24, width, height, frameRate, 4000000);
+    avp::AudioVideoWriter3 avWriter;
+    if (!avWriter.open("memory.mp4", "", false, props))
+    {
+        printf("cannot open file for write\n");
+        return 0;
+    }
+
+    // The first pass warms up the packet buffers of every size the encoder produces,
+    // the later passes give packets of the same sizes again
+    avp::WriteMemoryStats warm, last;
+    for (int pass = 0; pass < 3; pass++)
+    {
+        for (int j = 0; j < frames.size(); j++)
+            avWriter.write(frames[j], 0);
+        avp::getWriteMemoryStats(pass == 0 ? warm : last);
+    }
+    avWriter.close();
+
+    bool ok = last.numPacketBufferAllocs == warm.numPacketBufferAllocs &&
+        last.numFrameBufferAllocs == warm.numFrameBufferAllocs;
+    printf("allocation counters %s, packet buffers %lld after warm up %lld, frame buffers %lld after warm up %lld, "
+        "packet buffer gets %lld\n", ok ? "flat" : "growing", warm.numPacketBufferAllocs, last.numPacketBufferAllocs,
+        warm.numFrameBufferAllocs, last.numFrameBufferAllocs, last.numPacketBufferGets);
+    return ok ? 0 : 1;
+}
+
+static bool readAudioSamples(const char* fileName, std::vector<float> samples[2])
+{
+    avp::AudioVideoReader2 avReader;
+    if (!avReader.open(fileName, true, avp::SampleType32FP, false, avp::PixelTypeUnknown))
+        return false;
+    avp::AudioVideoFrame2 frame;
+    while (avReader.read(frame))
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            const float* data = (const float*)frame.data[i];
+            samples[i].insert(samples[i].end(), data, data + frame.numSamples);
+        }
+    }
+    avReader.close();
+    return true;
+}
+
+// 39 test that passthrough audio reaches the encoder unchanged, by comparing with the same samples
+// given packed, which are converted to planar exactly
+int main39()
+{
+    // 3 is AV_CH_LAYOUT_STEREO
+    int sampleRate = 48000, channelLayout = 3, frameSize = 1000, numFrames = 240;
+    const char* outNames[] = { "passthrough.mp4", "converted.mp4" };
+    bool passthrough[2];
+    for (int k = 0; k < 2; k++)
+    {
+        int sampleType = k == 0 ? avp::SampleType32FP : avp::SampleType32F;
+        std::vector<avp::OutputStreamProperties> props(1);
+        props[0] = avp::OutputStreamProperties("aac", sampleType, channelLayout, sampleRate, 128000);
+        avp::AudioVideoWriter3 avWriter;
+        if (!avWriter.open(outNames[k], "", false, props))
+        {
+            printf("cannot open file for write\n");
+            return 0;
+        }
+        passthrough[k] = avWriter.isPassthrough(0);
+
+        // Frames are not a multiple of the encoder frame size,
+        // so samples go through both the direct and the fifo path
+        avp::AudioVideoFrame2 frame(sampleType, 2, channelLayout, frameSize);
+        for (int j = 0; j < numFrames; j++)
+        {
+            for (int s = 0; s < frameSize; s++)
+            {
+                double t = double(j * frameSize + s) / sampleRate;
+                float left = 0.5 * sin(2 * 3.14159265 * 440 * t), right = 0.25 * sin(2 * 3.14159265 * 1000 * t);
+                if (k == 0)
+                {
+                    ((float*)frame.data[0])[s] = left;
+                    ((float*)frame.data[1])[s] = right;
+                }
+                else
+                {
+                    ((float*)frame.data[0])[s * 2] = left;
+                    ((float*)frame.data[0])[s * 2 + 1] = right;
+                }
+            }
+            frame.timeStamp = (long long int)j * frameSize * 1000000 / sampleRate;
+            avWriter.write(frame, 0);
+        }
+        avWriter.close();
+    }
+
+    std::vector<float> samples[2][2];
+    if (!readAudioSamples(outNames[0], samples[0]) || !readAudioSamples(outNames[1], samples[1]))
+    {
+        printf("cannot open file for read\n");
+        return 0;
+    }
+    bool same = samples[0][0].size() > 0;
+    for (int i = 0; i < 2 && same; i++)
+    {
+        same = samples[0][i].size() == samples[1][i].size() &&
+            memcmp(samples[0][i].data(), samples[1][i].data(), samples[0][i].size() * sizeof(float)) == 0;
+    }
+    bool ok = passthrough[0] && !passthrough[1] && same;
+    printf("passthrough %s, planar input passthrough %d, packed input passthrough %d, samples %s, %d samples\n",
+        ok ? "ok" : "failed", passthrough[0], passthrough[1], same ? "same" : "differ", (int)samples[0][0].size());
+    return ok ? 0 : 1;
+}